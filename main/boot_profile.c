@@ -0,0 +1,210 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_app_desc.h"
+#include "nvs.h"
+#include "cJSON.h"
+#include "config.h"
+#include "boot_profile.h"
+
+static const char *TAG = "boot-profile";
+
+#define NVS_BOOT_HISTORY__KEY   "boot-hist"
+#define BOOT_HISTORY_VERSION    1
+#define BOOT_HISTORY_CNT        8
+/* Room for phases added later, the blob keep its size */
+#define BOOT_PHASE_SLOTS        16
+#define PHASE_NOT_REACHED       0xffffffff
+/* No Telegram or no uplink: save what was reached by then */
+#define BOOT_SAVE_TIMEOUT_MS    60000
+
+struct BootRecord_st {
+    char fw_version[16];
+    uint32_t reset_reason;
+    /* ms since reset */
+    uint32_t phase_ms[BOOT_PHASE_SLOTS];
+};
+
+struct BootHistory_st {
+    uint16_t version;
+    uint16_t cnt;
+    /* Newest last */
+    struct BootRecord_st rec[BOOT_HISTORY_CNT];
+};
+
+_Static_assert(BOOT_PHASE_CNT <= BOOT_PHASE_SLOTS, "Boot phases exceed the history slots");
+
+static const char *phase_name[BOOT_PHASE_CNT] = {
+    [BOOT_PHASE_APP_MAIN]       = "app_main",
+    [BOOT_PHASE_NVS_INIT]       = "nvs_flash_init",
+    [BOOT_PHASE_POWER_UP_INIT]  = "power_up_init",
+    [BOOT_PHASE_POWER_DRIVER]   = "power_driver",
+    [BOOT_PHASE_WIFI_START]     = "wifi_start",
+    [BOOT_PHASE_WIFI_ASSOC]     = "wifi_assoc",
+    [BOOT_PHASE_GOT_IP]         = "got_ip",
+    [BOOT_PHASE_MDNS]           = "mdns",
+    [BOOT_PHASE_HTTPD]          = "httpd",
+    [BOOT_PHASE_SNTP_SYNC]      = "sntp_sync",
+    [BOOT_PHASE_TELEGRAM_POLL]  = "telegram_poll",
+    [BOOT_PHASE_FIRST_ACTUATION] = "first_actuation",
+};
+
+static struct BootRecord_st current = {
+    .phase_ms = {
+        [0 ... BOOT_PHASE_SLOTS - 1] = PHASE_NOT_REACHED,
+    },
+};
+/* `history` and `saved`, written once by the save, read by the JSON */
+static SemaphoreHandle_t history_lock;
+static esp_timer_handle_t save_timer;
+static struct BootHistory_st history;
+static bool saved;
+
+/* Last startup phase reached, first actuation is not one */
+static int last_phase(void)
+{
+    int i, last = -1;
+
+    for(i = 0; i < BOOT_PHASE_CNT; i++) {
+        if(i == BOOT_PHASE_FIRST_ACTUATION || current.phase_ms[i] == PHASE_NOT_REACHED)
+            continue;
+        if(last < 0 || current.phase_ms[i] > current.phase_ms[last])
+            last = i;
+    }
+
+    return last;
+}
+
+static void boot_profile_save(void)
+{
+    nvs_handle_t hdl;
+    esp_err_t err;
+    int last;
+
+    if(history_lock == NULL)
+        return;
+
+    xSemaphoreTake(history_lock, portMAX_DELAY);
+    if(saved) {
+        xSemaphoreGive(history_lock);
+        return;
+    }
+    saved = true;
+
+    history.version = BOOT_HISTORY_VERSION;
+    if(history.cnt == BOOT_HISTORY_CNT) {
+        memmove(&history.rec[0], &history.rec[1], sizeof(history.rec[0]) * (BOOT_HISTORY_CNT - 1));
+        history.cnt--;
+    }
+    history.rec[history.cnt++] = current;
+
+    err = nvs_open(NVS_NAME, NVS_READWRITE, &hdl);
+    if(err == ESP_OK) {
+        err = nvs_set_blob(hdl, NVS_BOOT_HISTORY__KEY, &history, sizeof(history));
+        if(err == ESP_OK)
+            err = nvs_commit(hdl);
+        nvs_close(hdl);
+    }
+    xSemaphoreGive(history_lock);
+
+    last = last_phase();
+    ESP_LOGI(TAG, "Boot reached %s in %lu ms, history saved:%s",
+                    last < 0 ? "nothing" : phase_name[last],
+                    last < 0 ? 0 : current.phase_ms[last], esp_err_to_name(err));
+}
+
+static void save_timer_cb(void *arg)
+{
+    boot_profile_save();
+}
+
+void boot_profile_mark(enum BootPhase phase)
+{
+    if(phase >= BOOT_PHASE_CNT || current.phase_ms[phase] != PHASE_NOT_REACHED)
+        return;
+
+    current.phase_ms[phase] = esp_timer_get_time() / 1000;
+    ESP_LOGD(TAG, "%s at %lu ms", phase_name[phase], current.phase_ms[phase]);
+
+    if(phase == BOOT_PHASE_TELEGRAM_POLL) {
+        esp_timer_stop(save_timer);
+        boot_profile_save();
+    }
+}
+
+/* Only the current layout is read, anything else start a new history */
+static void history_load(nvs_handle_t hdl)
+{
+    size_t sz = sizeof(history);
+    esp_err_t err;
+
+    err = nvs_get_blob(hdl, NVS_BOOT_HISTORY__KEY, &history, &sz);
+    if(err == ESP_ERR_NVS_NOT_FOUND)
+        return;
+
+    if(err != ESP_OK || sz != sizeof(history) ||
+            history.version != BOOT_HISTORY_VERSION || history.cnt > BOOT_HISTORY_CNT) {
+        ESP_LOGW(TAG, "Boot history not readable (%s), start a new one", esp_err_to_name(err));
+        memset(&history, 0, sizeof(history));
+    }
+}
+
+void boot_profile_init(void)
+{
+    const esp_app_desc_t *app = esp_app_get_description();
+    esp_timer_create_args_t timer_args = {
+        .callback = save_timer_cb,
+        .name = "boot-profile",
+    };
+    nvs_handle_t hdl;
+
+    strlcpy(current.fw_version, app->version, sizeof(current.fw_version));
+    current.reset_reason = esp_reset_reason();
+
+    if(nvs_open(NVS_NAME, NVS_READONLY, &hdl) == ESP_OK) {
+        history_load(hdl);
+        nvs_close(hdl);
+    }
+
+    history_lock = xSemaphoreCreateMutex();
+    if(esp_timer_create(&timer_args, &save_timer) == ESP_OK)
+        esp_timer_start_once(save_timer, BOOT_SAVE_TIMEOUT_MS * 1000LL);
+}
+
+static cJSON* record_to_json(const struct BootRecord_st *rec)
+{
+    cJSON *obj = cJSON_CreateObject();
+    cJSON *phases;
+    int i;
+
+    cJSON_AddStringToObject(obj, "firmware", rec->fw_version);
+    cJSON_AddNumberToObject(obj, "reset_reason", rec->reset_reason);
+
+    phases = cJSON_AddObjectToObject(obj, "phases_ms");
+    for(i = 0; i < BOOT_PHASE_CNT; i++) {
+        if(rec->phase_ms[i] != PHASE_NOT_REACHED)
+            cJSON_AddNumberToObject(phases, phase_name[i], rec->phase_ms[i]);
+    }
+
+    return obj;
+}
+
+void boot_profile_add_json(cJSON *root)
+{
+    cJSON *array;
+    int i;
+
+    cJSON_AddItemToObject(root, "boot", record_to_json(&current));
+
+    array = cJSON_AddArrayToObject(root, "boot_history");
+    if(history_lock == NULL)
+        return;
+
+    xSemaphoreTake(history_lock, portMAX_DELAY);
+    for(i = history.cnt - 1; i >= 0; i--)
+        cJSON_AddItemToArray(array, record_to_json(&history.rec[i]));
+    xSemaphoreGive(history_lock);
+}
@@ -0,0 +1,38 @@
+#ifndef _BOOT_PROFILE_H_
+#define _BOOT_PROFILE_H_
+
+/* Index of the phase in the NVS history: new phases only appended */
+enum BootPhase {
+    BOOT_PHASE_APP_MAIN,
+    BOOT_PHASE_NVS_INIT,
+    BOOT_PHASE_POWER_UP_INIT,
+    BOOT_PHASE_WIFI_START,
+    BOOT_PHASE_WIFI_ASSOC,
+    BOOT_PHASE_GOT_IP,
+    BOOT_PHASE_MDNS,
+    BOOT_PHASE_HTTPD,
+    BOOT_PHASE_SNTP_SYNC,
+    BOOT_PHASE_TELEGRAM_POLL,
+    /* Not a startup step: first door open since reset */
+    BOOT_PHASE_FIRST_ACTUATION,
+    BOOT_PHASE_POWER_DRIVER,
+    BOOT_PHASE_CNT,
+};
+
+/**
+ * \brief Record the time since reset of a startup phase
+ *
+ * Only the first call for each phase is kept. The profile is appended to the
+ * boot history in NVS at the first Telegram poll, or after one minute with
+ * the phases reached by then.
+ */
+void boot_profile_mark(enum BootPhase phase);
+
+/* Load boot history, NVS must be initialised */
+void boot_profile_init(void);
+
+/* Add `boot` (this boot) and `boot_history` to `root` */
+struct cJSON;
+void boot_profile_add_json(struct cJSON *root);
+
+#endif
@@ -2,12 +2,19 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_crc.h"
+#include "esp_timer.h"
+#include "esp_private/esp_clk.h"
 #include "config.h"
+#include "boot_profile.h"
+#include "event_bus.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "nvs_flash.h"
 #include "mdns.h"
+#include "gate_mdns.h"
 
 #define CRC_SEED 0x87485837
 static const char *TAG = "config";
@@ -56,74 +63,510 @@ enum STARTUP_MODE power_up_get_mode() {
     return (enum STARTUP_MODE)power_up_data.data.mode;
 }
 
-esp_err_t nvs_read_wifi_credential(uint8_t *ssid, uint8_t *password)
+static inline uint32_t ssid_crc(const uint8_t *ssid)
+{
+    return esp_crc32_be(CRC_SEED, ssid, strnlen((const char*)ssid, 32));
+}
+
+void power_up_set_wifi_hint(const uint8_t *ssid, const uint8_t *bssid, uint8_t channel)
+{
+    power_up_data.data.hint_ssid_crc = ssid_crc(ssid);
+    memcpy(power_up_data.data.hint_bssid, bssid, sizeof(power_up_data.data.hint_bssid));
+    power_up_data.data.hint_channel = channel;
+    power_up_data.data.hint_valid = true;
+    power_up_data.crc = esp_crc32_be(CRC_SEED, (uint8_t*)&power_up_data.data, sizeof(power_up_data.data));
+}
+
+bool power_up_get_wifi_hint(const uint8_t *ssid, uint8_t *bssid, uint8_t *channel)
+{
+    if(!power_up_data.data.hint_valid || power_up_data.data.hint_ssid_crc != ssid_crc(ssid))
+        return false;
+
+    memcpy(bssid, power_up_data.data.hint_bssid, sizeof(power_up_data.data.hint_bssid));
+    *channel = power_up_data.data.hint_channel;
+
+    return true;
+}
+
+void power_up_clear_wifi_hint()
+{
+    power_up_data.data.hint_valid = false;
+    power_up_data.data.lease.expire_s = 0;
+    power_up_data.crc = esp_crc32_be(CRC_SEED, (uint8_t*)&power_up_data.data, sizeof(power_up_data.data));
+}
+
+int64_t power_up_clock_s(void)
+{
+    return esp_clk_rtc_time() / 1000000;
+}
+
+void power_up_set_lease(const struct PowerUpLease_st *lease)
+{
+    power_up_data.data.lease = *lease;
+    power_up_data.crc = esp_crc32_be(CRC_SEED, (uint8_t*)&power_up_data.data, sizeof(power_up_data.data));
+}
+
+bool power_up_get_lease(struct PowerUpLease_st *lease)
+{
+    const struct PowerUpLease_st *l = &power_up_data.data.lease;
+    int64_t now = power_up_clock_s();
+
+    /* Lease is tied to the network of the hint. Longer than granted: clock restarted */
+    if(!power_up_data.data.hint_valid || l->expire_s <= now || l->expire_s - now > l->lease_s)
+        return false;
+
+    *lease = power_up_data.data.lease;
+    return true;
+}
+
+void power_up_set_dhcp_ref_ms(uint16_t ms)
+{
+    power_up_data.data.dhcp_ref_ms = ms;
+    power_up_data.crc = esp_crc32_be(CRC_SEED, (uint8_t*)&power_up_data.data, sizeof(power_up_data.data));
+}
+
+uint16_t power_up_get_dhcp_ref_ms()
+{
+    return power_up_data.data.dhcp_ref_ms;
+}
+
+static struct AppConfig_t app_config;
+static uint32_t app_config_dirty;
+static SemaphoreHandle_t app_config_lock;
+
+static const char *power_line_name[POWER_LINE_CNT] = {
+    POWER_LINE_1_NAME,
+    POWER_LINE_2_NAME,
+};
+
+static inline void power_line_key(char *key, size_t sz, const char *prefix, enum PowerLine pl)
+{
+    snprintf(key, sz, "%s%s", prefix, power_line_name[pl]);
+}
+
+static void nvs_load_str(nvs_handle_t hdl, const char *key, char *out, size_t sz, uint32_t field)
+{
+    if(nvs_get_str(hdl, key, out, &sz) == ESP_OK)
+        app_config.valid |= field;
+    else
+        out[0] = 0;
+}
+
+static void nvs_load_u32(nvs_handle_t hdl, const char *key, uint32_t *out, uint32_t field)
+{
+    if(nvs_get_u32(hdl, key, out) == ESP_OK)
+        app_config.valid |= field;
+}
+
+/* Legacy layout: one NVS key for each field */
+static esp_err_t app_config_load_nvs(void)
 {
     nvs_handle_t nvs_handle;
-    esp_err_t err;
+    char key[32];
     size_t sz;
+    esp_err_t err;
+    int pl;
 
     err = nvs_open(NVS_NAME, NVS_READONLY, &nvs_handle);
-    if(err != ESP_OK)
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Can't open NVS:%s, configuration empty", esp_err_to_name(err));
         return err;
-
-    if(ssid) {
-        /* ESP SSID len*/
-        sz = 32;
-        err = nvs_get_str(nvs_handle, NVS_WIFI_SSID__KEY, (char*) ssid, &sz);
-        if(err != ESP_OK)
-            goto close_and_ret;
     }
 
-    if(password) {
-        /* ESP MAX Password len*/
-        sz = 64;
-        err = nvs_get_str(nvs_handle, NVS_WIFI_PASS__KEY, (char*) password, &sz);
-        if(err != ESP_OK)
-            goto close_and_ret;
+    nvs_load_str(nvs_handle, NVS_WIFI_SSID__KEY, app_config.wifi_ssid, sizeof(app_config.wifi_ssid), APP_CFG_WIFI_SSID);
+    nvs_load_str(nvs_handle, NVS_WIFI_PASS__KEY, app_config.wifi_pass, sizeof(app_config.wifi_pass), APP_CFG_WIFI_PASS);
+    nvs_load_str(nvs_handle, NVS_MDNS_NAME__KEY, app_config.mdns_name, sizeof(app_config.mdns_name), APP_CFG_MDNS_NAME);
+    nvs_load_str(nvs_handle, NVS_TELEGRAM_TOKEN, app_config.telegram_token, sizeof(app_config.telegram_token), APP_CFG_TELEGRAM_TOKEN);
+
+    if(nvs_get_i64(nvs_handle, NVS_TELEGRAM_CHATID, &app_config.telegram_chatid) == ESP_OK)
+        app_config.valid |= APP_CFG_TELEGRAM_CHATID;
+
+    sz = sizeof(app_config.wifi_profile);
+    if(nvs_get_blob(nvs_handle, NVS_WIFI_PROFILES__KEY, app_config.wifi_profile, &sz) == ESP_OK)
+        app_config.valid |= APP_CFG_WIFI_PROFILES;
+
+    if(nvs_get_i8(nvs_handle, NVS_WIFI_RSSI_MIN__KEY, &app_config.wifi_rssi_min) == ESP_OK)
+        app_config.valid |= APP_CFG_WIFI_RSSI_MIN;
+
+    if(nvs_get_u8(nvs_handle, NVS_POWER_PROFILE__KEY, &app_config.power_profile) == ESP_OK)
+        app_config.valid |= APP_CFG_POWER_PROFILE;
+
+    nvs_load_str(nvs_handle, NVS_OTA_URL__KEY, app_config.ota_url, sizeof(app_config.ota_url), APP_CFG_OTA_URL);
+
+    nvs_load_str(nvs_handle, NVS_MQTT_URL__KEY, app_config.mqtt_url, sizeof(app_config.mqtt_url), APP_CFG_MQTT_URL);
+
+    sz = sizeof(app_config.lan_key);
+    if(nvs_get_blob(nvs_handle, NVS_LAN_KEY__KEY, app_config.lan_key, &sz) == ESP_OK && sz == sizeof(app_config.lan_key))
+        app_config.valid |= APP_CFG_LAN_KEY;
+
+    for(pl = 0; pl < POWER_LINE_CNT; pl++) {
+        struct PowerLineConfig_t *c = &app_config.power_line[pl];
+
+        power_line_key(key, sizeof(key), NVS_POWER_LINE_DOWN_TIME__KEY, pl);
+        nvs_load_u32(nvs_handle, key, &c->down_time_ms, APP_CFG_PL_DOWN(pl));
+
+        power_line_key(key, sizeof(key), NVS_POWER_LINE_UP_TIME__KEY, pl);
+        nvs_load_u32(nvs_handle, key, &c->up_time_ms, APP_CFG_PL_UP(pl));
+
+        power_line_key(key, sizeof(key), NVS_POWER_LINE_COUNT, pl);
+        nvs_load_u32(nvs_handle, key, &c->cycle_cnt, APP_CFG_PL_CYCLE(pl));
     }
 
-close_and_ret:
     nvs_close(nvs_handle);
+
+    return ESP_OK;
+}
+
+esp_err_t app_config_load(void)
+{
+    int64_t start = esp_timer_get_time();
+    const char *src = "record";
+    uint16_t version;
+    esp_err_t err;
+    size_t len;
+
+    if(app_config_lock == NULL)
+        app_config_lock = xSemaphoreCreateMutex();
+
+    memset(&app_config, 0, sizeof(app_config));
+    app_config_dirty = 0;
+
+    if(config_store_init() == ESP_OK) {
+        err = config_store_read(&app_config, sizeof(app_config), &len, &version);
+        if(err != ESP_OK) {
+            /* First boot with the record store: migrate NVS keys */
+            memset(&app_config, 0, sizeof(app_config));
+            src = "nvs";
+            err = app_config_load_nvs();
+            if(err == ESP_OK && app_config.valid != 0) {
+                err = config_store_write(&app_config, sizeof(app_config), APP_CFG_VERSION);
+                ESP_LOGI(TAG, "NVS configuration migrated to record:%s", esp_err_to_name(err));
+            }
+        } else if(version != APP_CFG_VERSION) {
+            /* Fields are only appended, new one are left not valid */
+            ESP_LOGW(TAG, "Record version:%u len:%u, current:%u len:%u",
+                            version, len, APP_CFG_VERSION, sizeof(app_config));
+        }
+    } else {
+        src = "nvs";
+        err = app_config_load_nvs();
+    }
+
+    ESP_LOGI(TAG, "Configuration loaded from %s in %lld us, valid:0x%08lx",
+                    src, esp_timer_get_time() - start, app_config.valid);
+
     return err;
 }
 
-void set_dns_hostname(char* new_hostname)
+const struct AppConfig_t* app_config_get(void)
+{
+    return &app_config;
+}
+
+static void app_config_set_str(char *dst, size_t sz, const char *val, uint32_t field)
+{
+    strlcpy(dst, val, sz);
+    app_config.valid |= field;
+    app_config_dirty |= field;
+}
+
+void app_config_set_wifi(const char *ssid, const char *pass)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+
+    if(ssid != NULL)
+        app_config_set_str(app_config.wifi_ssid, sizeof(app_config.wifi_ssid), ssid, APP_CFG_WIFI_SSID);
+
+    if(pass != NULL)
+        app_config_set_str(app_config.wifi_pass, sizeof(app_config.wifi_pass), pass, APP_CFG_WIFI_PASS);
+
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_wifi_profile(int idx, const char *ssid, const char *pass)
+{
+    struct WifiProfile_t *p;
+
+    if(idx < 0 || idx >= APP_CFG_WIFI_PROFILE_CNT)
+        return;
+
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+
+    p = &app_config.wifi_profile[idx];
+    strlcpy(p->ssid, ssid ? ssid : "", sizeof(p->ssid));
+    strlcpy(p->pass, pass ? pass : "", sizeof(p->pass));
+    app_config.valid |= APP_CFG_WIFI_PROFILES;
+    app_config_dirty |= APP_CFG_WIFI_PROFILES;
+
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_wifi_rssi_min(int8_t rssi)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+    app_config.wifi_rssi_min = rssi;
+    app_config.valid |= APP_CFG_WIFI_RSSI_MIN;
+    app_config_dirty |= APP_CFG_WIFI_RSSI_MIN;
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_power_profile(uint8_t profile)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+    app_config.power_profile = profile;
+    app_config.valid |= APP_CFG_POWER_PROFILE;
+    app_config_dirty |= APP_CFG_POWER_PROFILE;
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_ota_url(const char *url)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+    app_config_set_str(app_config.ota_url, sizeof(app_config.ota_url), url, APP_CFG_OTA_URL);
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_mqtt_url(const char *url)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+    app_config_set_str(app_config.mqtt_url, sizeof(app_config.mqtt_url), url, APP_CFG_MQTT_URL);
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_lan_key(const uint8_t *key)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+
+    if(key != NULL) {
+        memcpy(app_config.lan_key, key, sizeof(app_config.lan_key));
+        app_config.valid |= APP_CFG_LAN_KEY;
+    } else {
+        memset(app_config.lan_key, 0, sizeof(app_config.lan_key));
+        app_config.valid &= ~APP_CFG_LAN_KEY;
+    }
+    app_config_dirty |= APP_CFG_LAN_KEY;
+
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_telegram(const char *token, int64_t chatid)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+
+    if(token != NULL)
+        app_config_set_str(app_config.telegram_token, sizeof(app_config.telegram_token), token, APP_CFG_TELEGRAM_TOKEN);
+
+    if(chatid != 0) {
+        app_config.telegram_chatid = chatid;
+        app_config.valid |= APP_CFG_TELEGRAM_CHATID;
+        app_config_dirty |= APP_CFG_TELEGRAM_CHATID;
+    }
+
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_mdns_name(const char *name)
+{
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+    app_config_set_str(app_config.mdns_name, sizeof(app_config.mdns_name), name, APP_CFG_MDNS_NAME);
+    xSemaphoreGive(app_config_lock);
+}
+
+void app_config_set_power_line(enum PowerLine pl, const struct PowerLineConfig_t *cfg)
+{
+    uint32_t fields = APP_CFG_PL_DOWN(pl) | APP_CFG_PL_UP(pl) | APP_CFG_PL_CYCLE(pl);
+
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+    app_config.power_line[pl] = *cfg;
+    app_config.valid |= fields;
+    app_config_dirty |= fields;
+    xSemaphoreGive(app_config_lock);
+}
+
+static esp_err_t app_config_commit_nvs(uint32_t dirty)
 {
     nvs_handle_t nvs_handle;
+    char key[32];
+    esp_err_t err;
+    int pl;
 
-    ESP_ERROR_CHECK( nvs_open(NVS_NAME, NVS_READWRITE, &nvs_handle) );
-    ESP_ERROR_CHECK( nvs_set_str(nvs_handle, NVS_MDNS_NAME__KEY, new_hostname) );
-    ESP_ERROR_CHECK( nvs_commit(nvs_handle) );
+    err = nvs_open(NVS_NAME, NVS_READWRITE, &nvs_handle);
+    if(err != ESP_OK)
+        return err;
+
+    if(err == ESP_OK && (dirty & APP_CFG_WIFI_SSID))
+        err = nvs_set_str(nvs_handle, NVS_WIFI_SSID__KEY, app_config.wifi_ssid);
+
+    if(err == ESP_OK && (dirty & APP_CFG_WIFI_PASS))
+        err = nvs_set_str(nvs_handle, NVS_WIFI_PASS__KEY, app_config.wifi_pass);
+
+    if(err == ESP_OK && (dirty & APP_CFG_MDNS_NAME))
+        err = nvs_set_str(nvs_handle, NVS_MDNS_NAME__KEY, app_config.mdns_name);
+
+    if(err == ESP_OK && (dirty & APP_CFG_TELEGRAM_TOKEN))
+        err = nvs_set_str(nvs_handle, NVS_TELEGRAM_TOKEN, app_config.telegram_token);
+
+    if(err == ESP_OK && (dirty & APP_CFG_TELEGRAM_CHATID))
+        err = nvs_set_i64(nvs_handle, NVS_TELEGRAM_CHATID, app_config.telegram_chatid);
+
+    if(err == ESP_OK && (dirty & APP_CFG_WIFI_PROFILES))
+        err = nvs_set_blob(nvs_handle, NVS_WIFI_PROFILES__KEY, app_config.wifi_profile, sizeof(app_config.wifi_profile));
+
+    if(err == ESP_OK && (dirty & APP_CFG_WIFI_RSSI_MIN))
+        err = nvs_set_i8(nvs_handle, NVS_WIFI_RSSI_MIN__KEY, app_config.wifi_rssi_min);
+
+    if(err == ESP_OK && (dirty & APP_CFG_POWER_PROFILE))
+        err = nvs_set_u8(nvs_handle, NVS_POWER_PROFILE__KEY, app_config.power_profile);
+
+    if(err == ESP_OK && (dirty & APP_CFG_OTA_URL))
+        err = nvs_set_str(nvs_handle, NVS_OTA_URL__KEY, app_config.ota_url);
+
+    if(err == ESP_OK && (dirty & APP_CFG_MQTT_URL))
+        err = nvs_set_str(nvs_handle, NVS_MQTT_URL__KEY, app_config.mqtt_url);
+
+    if(err == ESP_OK && (dirty & APP_CFG_LAN_KEY)) {
+        if(app_config.valid & APP_CFG_LAN_KEY)
+            err = nvs_set_blob(nvs_handle, NVS_LAN_KEY__KEY, app_config.lan_key, sizeof(app_config.lan_key));
+        else if((err = nvs_erase_key(nvs_handle, NVS_LAN_KEY__KEY)) == ESP_ERR_NVS_NOT_FOUND)
+            err = ESP_OK;
+    }
+
+    for(pl = 0; pl < POWER_LINE_CNT; pl++) {
+        const struct PowerLineConfig_t *c = &app_config.power_line[pl];
+
+        if(err == ESP_OK && (dirty & APP_CFG_PL_DOWN(pl))) {
+            power_line_key(key, sizeof(key), NVS_POWER_LINE_DOWN_TIME__KEY, pl);
+            err = nvs_set_u32(nvs_handle, key, c->down_time_ms);
+        }
+
+        if(err == ESP_OK && (dirty & APP_CFG_PL_UP(pl))) {
+            power_line_key(key, sizeof(key), NVS_POWER_LINE_UP_TIME__KEY, pl);
+            err = nvs_set_u32(nvs_handle, key, c->up_time_ms);
+        }
+
+        if(err == ESP_OK && (dirty & APP_CFG_PL_CYCLE(pl))) {
+            power_line_key(key, sizeof(key), NVS_POWER_LINE_COUNT, pl);
+            err = nvs_set_u32(nvs_handle, key, c->cycle_cnt);
+        }
+    }
+
+    if(err == ESP_OK)
+        err = nvs_commit(nvs_handle);
 
-    ESP_LOGI(TAG, "New credential saved");
     nvs_close(nvs_handle);
+
+    return err;
 }
 
-void initialise_mdns(void)
+esp_err_t app_config_commit(void)
 {
-    nvs_handle_t nvs_handle;
-    char hostname[64];
+    int64_t start = esp_timer_get_time();
+    uint32_t dirty;
     esp_err_t err;
-    size_t sz;
 
-    ESP_LOGI(TAG, "Start MDNS");
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
 
-    err = nvs_open(NVS_NAME, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK_WITHOUT_ABORT(err);
+    dirty = app_config_dirty;
+    if(dirty == 0) {
+        xSemaphoreGive(app_config_lock);
+        return ESP_OK;
+    }
+
+    /* Whole record rewritten at once: SSID and password can't go out of sync */
+    if(config_store_available())
+        err = config_store_write(&app_config, sizeof(app_config), APP_CFG_VERSION);
+    else
+        err = app_config_commit_nvs(dirty);
+
+    if(err == ESP_OK)
+        app_config_dirty = 0;
+
+    xSemaphoreGive(app_config_lock);
 
     if(err == ESP_OK) {
-        sz = sizeof(hostname);
-        err = nvs_get_str(nvs_handle, NVS_MDNS_NAME__KEY, (char*) hostname, &sz);
-        if(err != ESP_OK) {
-            snprintf(hostname, NAME_MAX_SZ, DEFAULT_NAME);
-            ESP_LOGE(TAG, "Can't read from NVS Name, use default:%s", hostname);
-        }
+        ESP_LOGI(TAG, "Configuration saved in %lld us, fields:0x%08lx", esp_timer_get_time() - start, dirty);
+        event_bus_publish("config", "\"fields\":%lu", dirty);
+    } else {
+        ESP_LOGE(TAG, "Can't save configuration:%s", esp_err_to_name(err));
+    }
+
+    return err;
+}
 
+esp_err_t app_config_erase(void)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err;
+
+    xSemaphoreTake(app_config_lock, portMAX_DELAY);
+
+    if(config_store_available())
+        config_store_erase();
+
+    /* Legacy keys too, or they would be migrated again at next boot */
+    err = nvs_open(NVS_NAME, NVS_READWRITE, &nvs_handle);
+    if(err == ESP_OK) {
+        err = nvs_erase_all(nvs_handle);
+        if(err == ESP_OK)
+            err = nvs_commit(nvs_handle);
         nvs_close(nvs_handle);
-    } else {
-        strcpy(hostname, "apri-cancello-default");
     }
 
+    memset(&app_config, 0, sizeof(app_config));
+    app_config_dirty = 0;
+
+    xSemaphoreGive(app_config_lock);
+
+    return err;
+}
+
+esp_err_t nvs_read_wifi_credential(uint8_t *ssid, uint8_t *password)
+{
+    if(ssid) {
+        if(!(app_config.valid & APP_CFG_WIFI_SSID))
+            return ESP_ERR_NVS_NOT_FOUND;
+
+        /* ESP SSID len, not null terminated when 32 char long */
+        strncpy((char*) ssid, app_config.wifi_ssid, 32);
+    }
+
+    if(password) {
+        if(!(app_config.valid & APP_CFG_WIFI_PASS))
+            return ESP_ERR_NVS_NOT_FOUND;
+
+        /* ESP MAX Password len*/
+        strncpy((char*) password, app_config.wifi_pass, 64);
+    }
+
+    return ESP_OK;
+}
+
+void set_dns_hostname(char* new_hostname)
+{
+    app_config_set_mdns_name(new_hostname);
+    ESP_ERROR_CHECK( app_config_commit() );
+
+    ESP_LOGI(TAG, "New credential saved");
+}
+
+const char* app_config_hostname(void)
+{
+    const struct AppConfig_t *cfg = app_config_get();
+
+    return (cfg->valid & APP_CFG_MDNS_NAME) ? cfg->mdns_name : DEFAULT_NAME;
+}
+
+void initialise_mdns(void)
+{
+    char hostname[NAME_MAX_SZ];
+    esp_err_t err;
+
+    ESP_LOGI(TAG, "Start MDNS");
+
+    strlcpy(hostname, app_config_hostname(), sizeof(hostname));
+    if(!(app_config_get()->valid & APP_CFG_MDNS_NAME))
+        ESP_LOGE(TAG, "Can't read from NVS Name, use default:%s", hostname);
+
     err = mdns_init();
     ESP_ERROR_CHECK(err);
 
@@ -131,6 +574,8 @@ void initialise_mdns(void)
     ESP_ERROR_CHECK(err);
 
     ESP_LOGI(TAG, "mdns hostname set to: [%s]", hostname);
+    gate_mdns_register(hostname);
+    boot_profile_mark(BOOT_PHASE_MDNS);
 }
 
 void wait_and_restart_task(void* arg)
@@ -0,0 +1,210 @@
+#include <stddef.h>
+#include <string.h>
+#include "esp_crc.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "config.h"
+
+/*
+ * A/B configuration record store
+ *
+ * The `config` partition hold two slots of one flash sector each. Every
+ * update is written to the slot not in use with generation + 1: payload
+ * first, header last. A reset before the header is written leaves the new
+ * slot blank (or with a wrong CRC) and the previous record still valid.
+ *
+ * At boot the slot with the highest generation and a valid CRC is used.
+ */
+
+static const char *TAG = "config-store";
+
+#define STORE_PARTITION_LABEL   "config"
+#define STORE_PARTITION_SUBTYPE 0x40
+#define STORE_SLOT_SZ           0x1000
+#define STORE_SLOT_CNT          2
+#define STORE_MAGIC             0x47434647  /* "GCFG" */
+#define STORE_CRC_SEED          0x3a9e51c7
+
+struct ConfigRecordHdr_st {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length;
+    uint32_t generation;
+    uint32_t crc;
+};
+
+static const esp_partition_t *store_part;
+static int active_slot = -1;
+static uint32_t active_generation;
+
+static uint32_t record_crc(const struct ConfigRecordHdr_st *hdr, const void *data)
+{
+    uint32_t crc;
+
+    crc = esp_crc32_le(STORE_CRC_SEED, (const uint8_t*)hdr, offsetof(struct ConfigRecordHdr_st, crc));
+    return esp_crc32_le(crc, data, hdr->length);
+}
+
+static bool read_hdr(int slot, struct ConfigRecordHdr_st *hdr)
+{
+    esp_err_t err;
+
+    err = esp_partition_read(store_part, slot * STORE_SLOT_SZ, hdr, sizeof(*hdr));
+    if(err != ESP_OK)
+        return false;
+
+    return hdr->magic == STORE_MAGIC &&
+           hdr->length > 0 &&
+           hdr->length <= STORE_SLOT_SZ - sizeof(*hdr);
+}
+
+esp_err_t config_store_init(void)
+{
+    store_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, STORE_PARTITION_SUBTYPE, STORE_PARTITION_LABEL);
+    if(store_part == NULL) {
+        ESP_LOGW(TAG, "No `%s` partition, configuration stay in NVS", STORE_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if(store_part->size < STORE_SLOT_SZ * STORE_SLOT_CNT) {
+        ESP_LOGE(TAG, "Partition too small:%lu", store_part->size);
+        store_part = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * Read and check the payload of one slot. The CRC is computed over the whole
+ * record while only the first `max_sz` byte are copied: a record written by a
+ * newer firmware with more fields is still usable after a downgrade.
+ */
+static bool read_payload(int slot, const struct ConfigRecordHdr_st *hdr, uint8_t *data, size_t max_sz)
+{
+    size_t offset = slot * STORE_SLOT_SZ + sizeof(*hdr);
+    uint8_t chunk[64];
+    uint32_t crc;
+    size_t done;
+
+    crc = esp_crc32_le(STORE_CRC_SEED, (const uint8_t*)hdr, offsetof(struct ConfigRecordHdr_st, crc));
+
+    for(done = 0; done < hdr->length; ) {
+        size_t sz = hdr->length - done;
+
+        if(sz > sizeof(chunk))
+            sz = sizeof(chunk);
+
+        if(esp_partition_read(store_part, offset + done, chunk, sz) != ESP_OK)
+            return false;
+
+        crc = esp_crc32_le(crc, chunk, sz);
+
+        if(done < max_sz)
+            memcpy(&data[done], chunk, (done + sz > max_sz) ? max_sz - done : sz);
+
+        done += sz;
+    }
+
+    return crc == hdr->crc;
+}
+
+esp_err_t config_store_read(void *data, size_t max_sz, size_t *out_len, uint16_t *out_version)
+{
+    struct ConfigRecordHdr_st hdr[STORE_SLOT_CNT];
+    bool valid[STORE_SLOT_CNT];
+    int slot;
+
+    if(store_part == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    for(slot = 0; slot < STORE_SLOT_CNT; slot++)
+        valid[slot] = read_hdr(slot, &hdr[slot]);
+
+    /* Newest first, if its payload is corrupted fall back to the other one */
+    while(valid[0] || valid[1]) {
+        if(valid[0] && valid[1])
+            slot = (hdr[1].generation > hdr[0].generation) ? 1 : 0;
+        else
+            slot = valid[0] ? 0 : 1;
+
+        if(read_payload(slot, &hdr[slot], data, max_sz)) {
+            active_slot = slot;
+            active_generation = hdr[slot].generation;
+            *out_len = (hdr[slot].length < max_sz) ? hdr[slot].length : max_sz;
+            *out_version = hdr[slot].version;
+
+            ESP_LOGI(TAG, "Record slot:%d gen:%lu ver:%u len:%u",
+                            slot, hdr[slot].generation, hdr[slot].version, hdr[slot].length);
+            return ESP_OK;
+        }
+
+        ESP_LOGW(TAG, "Slot:%d gen:%lu corrupted", slot, hdr[slot].generation);
+        valid[slot] = false;
+
+        /* Never reuse a generation number, even of a corrupted record */
+        if(hdr[slot].generation > active_generation)
+            active_generation = hdr[slot].generation;
+    }
+
+    active_slot = -1;
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t config_store_write(const void *data, size_t len, uint16_t version)
+{
+    struct ConfigRecordHdr_st hdr;
+    size_t offset;
+    esp_err_t err;
+    int slot;
+
+    if(store_part == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    if(len == 0 || len > STORE_SLOT_SZ - sizeof(hdr))
+        return ESP_ERR_INVALID_SIZE;
+
+    slot = (active_slot == 0) ? 1 : 0;
+    offset = slot * STORE_SLOT_SZ;
+
+    hdr.magic = STORE_MAGIC;
+    hdr.version = version;
+    hdr.length = len;
+    hdr.generation = active_generation + 1;
+    hdr.crc = record_crc(&hdr, data);
+
+    err = esp_partition_erase_range(store_part, offset, STORE_SLOT_SZ);
+    if(err != ESP_OK)
+        return err;
+
+    err = esp_partition_write(store_part, offset + sizeof(hdr), data, len);
+    if(err != ESP_OK)
+        return err;
+
+    /* Header last: the record become valid only when completely written */
+    err = esp_partition_write(store_part, offset, &hdr, sizeof(hdr));
+    if(err != ESP_OK)
+        return err;
+
+    active_slot = slot;
+    active_generation = hdr.generation;
+
+    ESP_LOGI(TAG, "Record written slot:%d gen:%lu", slot, hdr.generation);
+    return ESP_OK;
+}
+
+esp_err_t config_store_erase(void)
+{
+    if(store_part == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    active_slot = -1;
+    active_generation = 0;
+
+    return esp_partition_erase_range(store_part, 0, STORE_SLOT_SZ * STORE_SLOT_CNT);
+}
+
+bool config_store_available(void)
+{
+    return store_part != NULL;
+}
@@ -0,0 +1,413 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "ota_update.h"
+#include "delta_patch.h"
+
+static const char *TAG = "delta";
+
+#define DELTA_HDR_SZ        80
+#define DELTA_SRC_BUF_SZ    4096
+
+enum DeltaState {
+    DP_HDR,
+    DP_DIFF_LEN,
+    DP_EXTRA_LEN,
+    DP_SEEK,
+    DP_SKIP,
+    DP_LIT_CNT,
+    DP_LIT,
+    DP_EXTRA,
+    DP_DONE,
+};
+
+struct DeltaPatch_st {
+    enum DeltaState state;
+    esp_err_t err;
+
+    uint8_t hdr[DELTA_HDR_SZ];
+    size_t hdr_fill;
+
+    /* Varint being decoded */
+    uint32_t v;
+    uint8_t shift;
+
+    uint32_t diff_left;
+    uint32_t lit_left;
+    uint32_t extra_left;
+
+    /* Source: running partition, read through a small cache */
+    const esp_partition_t *src;
+    uint32_t src_sz;
+    int64_t src_pos;
+    uint8_t src_buf[DELTA_SRC_BUF_SZ];
+    uint32_t src_buf_off;
+    uint32_t src_buf_len;
+
+    /* Target: OTA session buffers */
+    struct OtaSession_st *ota;
+    uint32_t tgt_sz;
+    uint32_t produced;
+    uint8_t *out;
+    size_t out_fill;
+
+    uint8_t sha_expect[OTA_SHA256_SZ];
+    bool sha_check;
+
+    size_t patch_sz;
+    int64_t start_us;
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool delta_patch_is_patch(const uint8_t *data, size_t len)
+{
+    return len >= 4 && memcmp(data, DELTA_PATCH_MAGIC, 4) == 0;
+}
+
+esp_err_t delta_patch_begin(struct DeltaPatch_st **patch, const uint8_t *sha256)
+{
+    struct DeltaPatch_st *d;
+
+    d = calloc(1, sizeof(*d));
+    if(d == NULL)
+        return ESP_ERR_NO_MEM;
+
+    if(sha256) {
+        memcpy(d->sha_expect, sha256, OTA_SHA256_SZ);
+        d->sha_check = true;
+    }
+
+    d->state = DP_HDR;
+    d->start_us = esp_timer_get_time();
+    *patch = d;
+
+    return ESP_OK;
+}
+
+/* Pointer to source byte at `src_pos`, `avail` contiguous byte */
+static const uint8_t *src_get(struct DeltaPatch_st *d, uint32_t *avail)
+{
+    uint32_t pos = d->src_pos;
+
+    if(pos < d->src_buf_off || pos >= d->src_buf_off + d->src_buf_len) {
+        d->src_buf_off = pos;
+        d->src_buf_len = d->src_sz - pos;
+        if(d->src_buf_len > DELTA_SRC_BUF_SZ)
+            d->src_buf_len = DELTA_SRC_BUF_SZ;
+
+        d->err = esp_partition_read(d->src, pos, d->src_buf, d->src_buf_len);
+        if(d->err != ESP_OK) {
+            d->src_buf_len = 0;
+            return NULL;
+        }
+    }
+
+    *avail = d->src_buf_off + d->src_buf_len - pos;
+    return &d->src_buf[pos - d->src_buf_off];
+}
+
+/* Room in the current OTA buffer, flush it when full */
+static uint8_t *out_get(struct DeltaPatch_st *d, size_t *room)
+{
+    if(d->out != NULL && d->out_fill == OTA_BUF_SZ) {
+        d->err = ota_session_push(d->ota, d->out_fill);
+        d->out = NULL;
+        if(d->err != ESP_OK)
+            return NULL;
+    }
+
+    if(d->out == NULL) {
+        d->out = ota_session_get_buffer(d->ota);
+        d->out_fill = 0;
+        if(d->out == NULL) {
+            d->err = ESP_FAIL;
+            return NULL;
+        }
+    }
+
+    *room = OTA_BUF_SZ - d->out_fill;
+    return &d->out[d->out_fill];
+}
+
+/*
+ * Produce `n` byte: source byte plus `add` (NULL: source as is), or `add`
+ * alone when `from_src` is false.
+ */
+static void out_put(struct DeltaPatch_st *d, const uint8_t *add, uint32_t n, bool from_src)
+{
+    const uint8_t *src = NULL;
+    uint32_t avail = UINT32_MAX, i, k;
+    size_t room;
+    uint8_t *out;
+
+    if(d->produced + n > d->tgt_sz ||
+       (from_src && (d->src_pos < 0 || d->src_pos + n > d->src_sz))) {
+        ESP_LOGE(TAG, "Patch out of range: out %lu+%lu/%lu src %lld/%lu",
+                        d->produced, n, d->tgt_sz, d->src_pos, d->src_sz);
+        d->err = ESP_ERR_INVALID_SIZE;
+        return;
+    }
+
+    while(n && d->err == ESP_OK) {
+        out = out_get(d, &room);
+        if(out == NULL)
+            return;
+
+        if(from_src) {
+            src = src_get(d, &avail);
+            if(src == NULL)
+                return;
+        }
+
+        k = n;
+        if(k > room)
+            k = room;
+        if(k > avail)
+            k = avail;
+
+        if(!from_src)
+            memcpy(out, add, k);
+        else if(add == NULL)
+            memcpy(out, src, k);
+        else
+            for(i = 0; i < k; i++)
+                out[i] = src[i] + add[i];
+
+        if(add)
+            add += k;
+        if(from_src)
+            d->src_pos += k;
+        d->out_fill += k;
+        d->produced += k;
+        n -= k;
+    }
+}
+
+static esp_err_t header_parse(struct DeltaPatch_st *d)
+{
+    const uint8_t *src_sha = &d->hdr[16], *tgt_sha = &d->hdr[48];
+    uint8_t sha[OTA_SHA256_SZ];
+    int64_t start = esp_timer_get_time();
+    esp_err_t err;
+
+    if(!delta_patch_is_patch(d->hdr, 4) || (d->hdr[4] | (d->hdr[5] << 8)) != DELTA_PATCH_VERSION) {
+        ESP_LOGE(TAG, "Unknown patch version");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if(d->sha_check && memcmp(tgt_sha, d->sha_expect, OTA_SHA256_SZ) != 0) {
+        ESP_LOGE(TAG, "Patch target is not the expected image");
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    d->src_sz = get_le32(&d->hdr[8]);
+    d->tgt_sz = get_le32(&d->hdr[12]);
+    d->src = esp_ota_get_running_partition();
+    if(d->src_sz > d->src->size) {
+        ESP_LOGE(TAG, "Source %lu byte, larger than %s", d->src_sz, d->src->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    /* Patch is only valid for the exact image it was made from */
+    err = ota_partition_sha256(d->src, d->src_sz, sha);
+    if(err != ESP_OK)
+        return err;
+
+    if(memcmp(sha, src_sha, OTA_SHA256_SZ) != 0) {
+        ESP_LOGE(TAG, "Patch made for another firmware, running %s", d->src->label);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    ESP_LOGI(TAG, "Source %s %lu byte verified in %lld ms, target %lu byte",
+                    d->src->label, d->src_sz, (esp_timer_get_time() - start) / 1000, d->tgt_sz);
+
+    return ota_session_begin(&d->ota, d->tgt_sz, tgt_sha);
+}
+
+/* Decode one varint byte, true when the value is complete in `d->v` */
+static bool varint_step(struct DeltaPatch_st *d, uint8_t b)
+{
+    if(d->shift > 28) {
+        d->err = ESP_ERR_INVALID_ARG;
+        return false;
+    }
+
+    d->v |= (uint32_t)(b & 0x7f) << d->shift;
+    d->shift += 7;
+
+    return !(b & 0x80);
+}
+
+static void record_next(struct DeltaPatch_st *d)
+{
+    if(d->diff_left)
+        d->state = DP_SKIP;
+    else if(d->extra_left)
+        d->state = DP_EXTRA;
+    else
+        d->state = d->produced == d->tgt_sz ? DP_DONE : DP_DIFF_LEN;
+}
+
+static void varint_done(struct DeltaPatch_st *d)
+{
+    uint32_t v = d->v;
+
+    d->v = 0;
+    d->shift = 0;
+
+    switch(d->state) {
+    case DP_DIFF_LEN:
+        d->diff_left = v;
+        d->state = DP_EXTRA_LEN;
+        break;
+
+    case DP_EXTRA_LEN:
+        d->extra_left = v;
+        d->state = DP_SEEK;
+        break;
+
+    case DP_SEEK:
+        /* zigzag */
+        d->src_pos += (int32_t)((v >> 1) ^ -(v & 1));
+        record_next(d);
+        break;
+
+    case DP_SKIP:
+        if(v > d->diff_left) {
+            d->err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        out_put(d, NULL, v, true);
+        d->diff_left -= v;
+        d->state = DP_LIT_CNT;
+        break;
+
+    case DP_LIT_CNT:
+        if(v > d->diff_left) {
+            d->err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        d->lit_left = v;
+        d->diff_left -= v;
+        if(d->lit_left)
+            d->state = DP_LIT;
+        else
+            record_next(d);
+        break;
+
+    default:
+        break;
+    }
+}
+
+esp_err_t delta_patch_feed(struct DeltaPatch_st *d, const uint8_t *data, size_t len)
+{
+    size_t n;
+
+    d->patch_sz += len;
+
+    while(len && d->err == ESP_OK) {
+        switch(d->state) {
+        case DP_HDR:
+            n = DELTA_HDR_SZ - d->hdr_fill;
+            if(n > len)
+                n = len;
+            memcpy(&d->hdr[d->hdr_fill], data, n);
+            d->hdr_fill += n;
+
+            if(d->hdr_fill == DELTA_HDR_SZ) {
+                d->err = header_parse(d);
+                d->state = DP_DIFF_LEN;
+            }
+            break;
+
+        case DP_DIFF_LEN:
+        case DP_EXTRA_LEN:
+        case DP_SEEK:
+        case DP_SKIP:
+        case DP_LIT_CNT:
+            n = 1;
+            if(varint_step(d, *data))
+                varint_done(d);
+            break;
+
+        case DP_LIT:
+            n = d->lit_left < len ? d->lit_left : len;
+            out_put(d, data, n, true);
+            d->lit_left -= n;
+            if(d->lit_left == 0)
+                record_next(d);
+            break;
+
+        case DP_EXTRA:
+            n = d->extra_left < len ? d->extra_left : len;
+            out_put(d, data, n, false);
+            d->extra_left -= n;
+            if(d->extra_left == 0)
+                record_next(d);
+            break;
+
+        case DP_DONE:
+        default:
+            ESP_LOGE(TAG, "Data after end of patch");
+            d->err = ESP_ERR_INVALID_SIZE;
+            n = len;
+            break;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return d->err;
+}
+
+static void delta_patch_free(struct DeltaPatch_st *d)
+{
+    int64_t us = esp_timer_get_time() - d->start_us;
+
+    ESP_LOGI(TAG, "Patch %u byte, image %lu byte in %lld ms", d->patch_sz, d->produced, us / 1000);
+    free(d);
+}
+
+esp_err_t delta_patch_end(struct DeltaPatch_st *d, uint8_t *sha256_out)
+{
+    esp_err_t err = d->err;
+
+    if(err == ESP_OK && d->state != DP_DONE) {
+        ESP_LOGE(TAG, "Patch truncated, %lu of %lu byte", d->produced, d->tgt_sz);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    if(d->ota == NULL) {
+        delta_patch_free(d);
+        return err == ESP_OK ? ESP_ERR_INVALID_SIZE : err;
+    }
+
+    if(err == ESP_OK && d->out_fill)
+        err = ota_session_push(d->ota, d->out_fill);
+
+    if(err != ESP_OK) {
+        ota_session_abort(d->ota);
+    } else {
+        /* Size and digest from the header are checked here */
+        err = ota_session_end(d->ota, sha256_out);
+    }
+
+    delta_patch_free(d);
+    return err;
+}
+
+void delta_patch_abort(struct DeltaPatch_st *d)
+{
+    if(d->ota)
+        ota_session_abort(d->ota);
+
+    delta_patch_free(d);
+}
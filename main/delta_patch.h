@@ -0,0 +1,33 @@
+#ifndef _DELTA_PATCH_H_
+#define _DELTA_PATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/*
+ * Delta OTA: apply a patch made by tools/ota_delta against the running
+ * app partition, the output stream into the next OTA partition through
+ * ota_update.c. Format is described in tools/ota_delta/ota_delta.py.
+ */
+
+#define DELTA_PATCH_MAGIC   "GDLT"
+#define DELTA_PATCH_VERSION 1
+
+struct DeltaPatch_st;
+
+/* `sha256` (optional) must match the target digest inside the patch header */
+esp_err_t delta_patch_begin(struct DeltaPatch_st **patch, const uint8_t *sha256);
+
+/* Feed the patch as it arrive, any chunk size */
+esp_err_t delta_patch_feed(struct DeltaPatch_st *d, const uint8_t *data, size_t len);
+
+/* Check the whole target was produced, then as ota_session_end(). `d` is freed */
+esp_err_t delta_patch_end(struct DeltaPatch_st *d, uint8_t *sha256_out);
+void delta_patch_abort(struct DeltaPatch_st *d);
+
+/* True if the first 4 byte of a body are a delta patch */
+bool delta_patch_is_patch(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,41 @@
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "door_result.h"
+
+static const char *result_names[DOOR_RESULT_CNT] = {
+    [DOOR_OK]           = "ok",
+    [DOOR_BAD_REQUEST]  = "bad_request",
+    [DOOR_NO_KEY]       = "no_key",
+    [DOOR_BAD_MAC]      = "bad_mac",
+    [DOOR_BAD_SESSION]  = "bad_session",
+    [DOOR_REPLAY]       = "replay",
+    [DOOR_BUSY]         = "busy",
+    [DOOR_NO_CLOCK]     = "no_clock",
+    [DOOR_STALE]        = "stale",
+};
+
+/* Few increment, one lock for every source */
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+const char* door_result_name(enum DoorResult r)
+{
+    return r < DOOR_RESULT_CNT ? result_names[r] : "unknown";
+}
+
+void door_stats_add(struct DoorStats_st *st, enum DoorResult r, int64_t start_us)
+{
+    uint32_t us = start_us ? esp_timer_get_time() - start_us : 0;
+
+    portENTER_CRITICAL(&stats_lock);
+    st->result[r]++;
+    if(us > st->handler_max_us)
+        st->handler_max_us = us;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void door_stats_get(const struct DoorStats_st *st, struct DoorStats_st *out)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *out = *st;
+    portEXIT_CRITICAL(&stats_lock);
+}
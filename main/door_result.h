@@ -0,0 +1,38 @@
+#ifndef _DOOR_RESULT_H_
+#define _DOOR_RESULT_H_
+
+#include <stdint.h>
+
+/*
+ * Result of a door command from the network: LAN door, MQTT and UDP
+ *
+ * One set of names for the three, the same word in log, event, /metrics
+ * and tools. The value is sent in the UDP answer: only append.
+ */
+
+enum DoorResult {
+    DOOR_OK,
+    DOOR_BAD_REQUEST,
+    DOOR_NO_KEY,
+    DOOR_BAD_MAC,
+    DOOR_BAD_SESSION,       /* Not the current one, retry with it */
+    DOOR_REPLAY,
+    DOOR_BUSY,              /* Power task queue full */
+    DOOR_NO_CLOCK,          /* No SNTP yet, the time can't be checked */
+    DOOR_STALE,
+    DOOR_RESULT_CNT,
+};
+
+struct DoorStats_st {
+    uint32_t result[DOOR_RESULT_CNT];
+    /* Received to answer sent */
+    uint32_t handler_max_us;
+};
+
+const char* door_result_name(enum DoorResult r);
+
+/* Count `r` in `st`, `start_us` is esp_timer time when received, 0: not timed */
+void door_stats_add(struct DoorStats_st *st, enum DoorResult r, int64_t start_us);
+void door_stats_get(const struct DoorStats_st *st, struct DoorStats_st *out);
+
+#endif
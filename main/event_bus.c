@@ -0,0 +1,305 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "lwip/sockets.h"
+#include "event_bus.h"
+#include "gate_mqtt.h"
+
+static const char *TAG = "events";
+
+/* Client stuck this long with a full socket buffer is dropped */
+#define EVENT_BUS_STALL_US  (3LL * EVENT_BUS_KEEPALIVE_S * 1000000)
+
+struct EventClient_st {
+    int fd;                         /* -1: free slot */
+    char (*ring)[EVENT_BUS_EVENT_SZ];
+    uint8_t len[EVENT_BUS_RING_CNT];    /* 0: `dropped` marker, count in the slot */
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;               /* Since the last marker */
+
+    /* httpd task only */
+    size_t sent;                    /* Byte of the tail event already on the socket */
+    int64_t progress_us;
+    bool queued;                    /* Flush pending in httpd, under s_lock */
+};
+
+static httpd_handle_t s_server;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct EventClient_st s_client[EVENT_BUS_CLIENT_MAX];
+static uint32_t s_seq;
+static esp_timer_handle_t s_keepalive;
+
+/* Caller hold s_lock */
+static bool ring_put(struct EventClient_st *c, const char *msg, size_t len)
+{
+    uint32_t slot;
+
+    if(c->head - c->tail >= EVENT_BUS_RING_CNT)
+        return false;
+
+    slot = c->head % EVENT_BUS_RING_CNT;
+    memcpy(c->ring[slot], msg, len);
+    c->len[slot] = len;
+    c->head++;
+
+    return true;
+}
+
+static void client_flush(void *arg);
+
+/* Copy in every client ring, `count` drop in the `dropped` total */
+static void publish_raw(const char *msg, size_t len, bool count)
+{
+    struct EventClient_st *c;
+    uint32_t drop_marker;
+    bool queue;
+    int i;
+
+    for(i = 0; i < EVENT_BUS_CLIENT_MAX; i++) {
+        c = &s_client[i];
+        queue = false;
+
+        portENTER_CRITICAL(&s_lock);
+        if(c->fd >= 0) {
+            /* Room again after a drop: tell the client first, space for both needed */
+            if(c->dropped && c->head - c->tail <= EVENT_BUS_RING_CNT - 2) {
+                drop_marker = c->dropped;
+                c->dropped = 0;
+                ring_put(c, (const char *)&drop_marker, sizeof(drop_marker));
+                c->len[(c->head - 1) % EVENT_BUS_RING_CNT] = 0;
+            }
+
+            if(!ring_put(c, msg, len) && count)
+                c->dropped++;
+
+            /* Full ring too: the flush is what find a stalled client */
+            queue = !c->queued && c->head != c->tail;
+            c->queued |= queue;
+        }
+        portEXIT_CRITICAL(&s_lock);
+
+        if(queue && httpd_queue_work(s_server, client_flush, c) != ESP_OK) {
+            portENTER_CRITICAL(&s_lock);
+            c->queued = false;
+            portEXIT_CRITICAL(&s_lock);
+        }
+    }
+}
+
+void event_bus_publish(const char *event, const char *fmt, ...)
+{
+    char msg[EVENT_BUS_EVENT_SZ];
+    uint32_t id;
+    va_list ap;
+    int n, data;
+
+    if(s_server == NULL)
+        return;
+
+    portENTER_CRITICAL(&s_lock);
+    id = ++s_seq;
+    portEXIT_CRITICAL(&s_lock);
+
+    data = snprintf(msg, sizeof(msg), "id: %lu\nevent: %s\ndata: ", id, event);
+    n = data + snprintf(&msg[data], sizeof(msg) - data, "{\"t\":%lld%s",
+                    esp_timer_get_time() / 1000, fmt ? "," : "");
+    if(fmt && n < sizeof(msg)) {
+        va_start(ap, fmt);
+        n += vsnprintf(&msg[n], sizeof(msg) - n, fmt, ap);
+        va_end(ap);
+    }
+    if(n < sizeof(msg))
+        n += snprintf(&msg[n], sizeof(msg) - n, "}\n\n");
+
+    if(n >= sizeof(msg)) {
+        ESP_LOGW(TAG, "Event %s too long, not sent", event);
+        return;
+    }
+
+    /* Same object on MQTT, without the final blank line */
+    gate_mqtt_event(event, &msg[data], n - data - 2);
+
+    publish_raw(msg, n, true);
+}
+
+/* httpd task: write what the socket take without waiting */
+static void client_flush(void *arg)
+{
+    struct EventClient_st *c = arg;
+    uint32_t slot, n;
+    bool more;
+    int fd, ret;
+
+    portENTER_CRITICAL(&s_lock);
+    c->queued = false;
+    portEXIT_CRITICAL(&s_lock);
+
+    for(;;) {
+        portENTER_CRITICAL(&s_lock);
+        fd = c->fd;
+        more = fd >= 0 && c->tail != c->head;
+        slot = c->tail % EVENT_BUS_RING_CNT;
+        portEXIT_CRITICAL(&s_lock);
+
+        if(!more)
+            break;
+
+        /* Slot at the tail belong to us until `tail` move */
+        if(c->len[slot] == 0) {
+            memcpy(&n, c->ring[slot], sizeof(n));
+            c->len[slot] = snprintf(c->ring[slot], EVENT_BUS_EVENT_SZ, "event: dropped\ndata: {\"n\":%lu}\n\n", n);
+        }
+
+        ret = httpd_socket_send(s_server, fd, &c->ring[slot][c->sent], c->len[slot] - c->sent, MSG_DONTWAIT);
+        if(ret == HTTPD_SOCK_ERR_TIMEOUT) {
+            /* Socket buffer full: retried on next event or keepalive */
+            if(esp_timer_get_time() - c->progress_us > EVENT_BUS_STALL_US) {
+                ESP_LOGW(TAG, "Client fd:%d stalled, closed", fd);
+                httpd_sess_trigger_close(s_server, fd);
+            }
+            break;
+        }
+
+        if(ret < 0) {
+            ESP_LOGI(TAG, "Client fd:%d send failed:%d", fd, ret);
+            httpd_sess_trigger_close(s_server, fd);
+            break;
+        }
+
+        c->progress_us = esp_timer_get_time();
+        c->sent += ret;
+        if(c->sent == c->len[slot]) {
+            c->sent = 0;
+            portENTER_CRITICAL(&s_lock);
+            c->tail++;
+            portEXIT_CRITICAL(&s_lock);
+        }
+    }
+}
+
+static void keepalive_cb(void *arg)
+{
+    /* SSE comment: keep proxies and NAT open, find dead clients */
+    publish_raw(":\n\n", 3, false);
+}
+
+static esp_err_t events_get_handler(httpd_req_t *req)
+{
+    static const char hdr[] = "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/event-stream\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "\r\n"
+                              "retry: 3000\n\n";
+    struct EventClient_st *c = NULL;
+    int fd = httpd_req_to_sockfd(req);
+    int i;
+
+    /* Ring are allocated for a slot at its first client and kept */
+    for(i = 0; i < EVENT_BUS_CLIENT_MAX && c == NULL; i++) {
+        if(s_client[i].fd < 0) {
+            c = &s_client[i];
+            if(c->ring == NULL)
+                c->ring = malloc(EVENT_BUS_RING_CNT * EVENT_BUS_EVENT_SZ);
+            if(c->ring == NULL)
+                c = NULL;
+        }
+    }
+
+    if(c == NULL) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Too many event clients");
+        return ESP_OK;
+    }
+
+    /* Handler run in httpd task, as flush and close: only publisher race with us */
+    c->sent = 0;
+    c->progress_us = esp_timer_get_time();
+    portENTER_CRITICAL(&s_lock);
+    c->head = c->tail = 0;
+    c->dropped = 0;
+    c->queued = false;
+    c->fd = fd;
+    portEXIT_CRITICAL(&s_lock);
+
+    /*
+     * Response written on the socket directly and never completed: httpd
+     * keep the session, events follow until the client close it.
+     */
+    if(httpd_socket_send(req->handle, fd, hdr, sizeof(hdr) - 1, 0) != sizeof(hdr) - 1) {
+        portENTER_CRITICAL(&s_lock);
+        c->fd = -1;
+        portEXIT_CRITICAL(&s_lock);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Client fd:%d connected, slot %d", fd, i - 1);
+
+    return ESP_OK;
+}
+
+void event_bus_sock_close(void *hd, int sockfd)
+{
+    int i;
+
+    for(i = 0; i < EVENT_BUS_CLIENT_MAX; i++) {
+        portENTER_CRITICAL(&s_lock);
+        if(s_client[i].fd == sockfd) {
+            s_client[i].fd = -1;
+            portEXIT_CRITICAL(&s_lock);
+            ESP_LOGI(TAG, "Client fd:%d gone", sockfd);
+            continue;
+        }
+        portEXIT_CRITICAL(&s_lock);
+    }
+
+    /* Replace the httpd default close */
+    close(sockfd);
+}
+
+bool event_bus_is_client(int sockfd)
+{
+    bool found = false;
+    int i;
+
+    portENTER_CRITICAL(&s_lock);
+    for(i = 0; i < EVENT_BUS_CLIENT_MAX && !found; i++)
+        found = s_client[i].fd == sockfd;
+    portEXIT_CRITICAL(&s_lock);
+
+    return found;
+}
+
+static const httpd_uri_t events_get_uri = {
+    .uri = "/api/v1/events",
+    .method = HTTP_GET,
+    .handler = events_get_handler,
+};
+
+void event_bus_register(void *server)
+{
+    const esp_timer_create_args_t args = {
+        .callback = keepalive_cb,
+        .name = "sse-keepalive",
+    };
+    int i;
+
+    if(server == NULL || s_server != NULL)
+        return;
+
+    for(i = 0; i < EVENT_BUS_CLIENT_MAX; i++)
+        s_client[i].fd = -1;
+
+    httpd_register_uri_handler(server, &events_get_uri);
+    s_server = server;
+
+    if(esp_timer_create(&args, &s_keepalive) == ESP_OK)
+        esp_timer_start_periodic(s_keepalive, EVENT_BUS_KEEPALIVE_S * 1000000LL);
+}
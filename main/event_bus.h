@@ -0,0 +1,42 @@
+#ifndef _EVENT_BUS_H_
+#define _EVENT_BUS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Live device events, Server-Sent Events on GET /api/v1/events
+ *
+ *   id: 42
+ *   event: gate
+ *   data: {"t":123456,"line":"p1","state":"start"}
+ *
+ * `t` is uptime in ms, `id` grow by one for each event published: a gap
+ * means events dropped for that client. Event: gate, button, wifi, config,
+ * lan, mqtt, udp. The `data` object is also published on MQTT, event/<event>.
+ *
+ * Each client has its own bounded ring. Publish only copy the event into
+ * the rings and never wait; the socket is written from the httpd task,
+ * non blocking. A client that does not keep up lose the newest events,
+ * then get a `dropped` event with the count.
+ */
+
+#define EVENT_BUS_CLIENT_MAX    3
+#define EVENT_BUS_RING_CNT      16
+#define EVENT_BUS_EVENT_SZ      128
+#define EVENT_BUS_KEEPALIVE_S   15
+
+/*
+ * Register the URI on the started httpd. httpd_config_t.close_fn must call
+ * event_bus_sock_close, to know when a client goes away.
+ * Handle are `httpd_handle_t`, no httpd include here: power_sim use this.
+ */
+void event_bus_register(void *server);
+void event_bus_sock_close(void *hd, int sockfd);
+/* `sockfd` is an event stream, never idle for httpd */
+bool event_bus_is_client(int sockfd);
+
+/* `fmt` give the JSON members after `t`, can be NULL. Any task, not ISR */
+void event_bus_publish(const char *event, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
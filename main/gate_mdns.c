@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_app_desc.h"
+#include "mdns.h"
+#include "config.h"
+#include "gate_mdns.h"
+#include "gate_mqtt.h"
+
+static const char *TAG = "gate mdns";
+
+#define GATE_MDNS_PORT      80
+
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t state;
+static const char *state_published;
+static bool registered;
+
+/* Most important first */
+static const char* state_name(uint32_t st)
+{
+    if(st & GATE_MDNS_OTA)
+        return "ota";
+    if(st & GATE_MDNS_OPENING)
+        return "opening";
+    return "ready";
+}
+
+/* Name to announce if it changed, call with `state_lock` held */
+static const char* state_changed(void)
+{
+    const char *name = state_name(state);
+
+    if(!registered || name == state_published)
+        return NULL;
+
+    state_published = name;
+    return name;
+}
+
+void gate_mdns_register(const char *hostname)
+{
+    const esp_app_desc_t *app = esp_app_get_description();
+    const char *name;
+    uint8_t mac[6];
+    char id[8];
+    esp_err_t err;
+
+    mdns_txt_item_t http_txt[] = {
+        { "path", "/api/v1/system/info" },
+    };
+    mdns_txt_item_t gate_txt[] = {
+        { "fw", app->version },
+        { "api", GATE_MDNS_API },
+        { "lines", POWER_LINE_1_NAME "," POWER_LINE_2_NAME },
+        { "state", NULL },
+        { "id", id },
+    };
+
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(id, sizeof(id), "%02x%02x%02x", mac[3], mac[4], mac[5]);
+
+    portENTER_CRITICAL(&state_lock);
+    gate_txt[3].value = state_name(state);
+    portEXIT_CRITICAL(&state_lock);
+
+    mdns_instance_name_set(hostname);
+
+    err = mdns_service_add(NULL, "_http", "_tcp", GATE_MDNS_PORT, http_txt, ARRAY_SIZE(http_txt));
+    if(err == ESP_OK)
+        err = mdns_service_add(NULL, GATE_MDNS_SERVICE, GATE_MDNS_PROTO, GATE_MDNS_PORT, gate_txt, ARRAY_SIZE(gate_txt));
+
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Service add:%s", esp_err_to_name(err));
+        return;
+    }
+
+    ESP_LOGI(TAG, "Services added, fw:%s id:%s state:%s", app->version, id, gate_txt[3].value);
+
+    /* State may have changed while the services were added */
+    portENTER_CRITICAL(&state_lock);
+    registered = true;
+    state_published = gate_txt[3].value;
+    name = state_changed();
+    portEXIT_CRITICAL(&state_lock);
+
+    if(name != NULL)
+        mdns_service_txt_item_set(GATE_MDNS_SERVICE, GATE_MDNS_PROTO, "state", name);
+}
+
+void gate_mdns_set_state(enum GateMdnsState flag, bool on)
+{
+    const char *name, *prev, *cur;
+
+    portENTER_CRITICAL(&state_lock);
+    prev = state_name(state);
+    if(on)
+        state |= flag;
+    else
+        state &= ~flag;
+    cur = state_name(state);
+    name = state_changed();
+    portEXIT_CRITICAL(&state_lock);
+
+    /* The component copy the value and send an announcement */
+    if(name != NULL)
+        mdns_service_txt_item_set(GATE_MDNS_SERVICE, GATE_MDNS_PROTO, "state", name);
+
+    /* Retained on MQTT too, it read gate_mdns_state() when sent */
+    if(prev != cur)
+        gate_mqtt_state_changed();
+}
+
+const char* gate_mdns_state(void)
+{
+    const char *name;
+
+    portENTER_CRITICAL(&state_lock);
+    name = state_name(state);
+    portEXIT_CRITICAL(&state_lock);
+
+    return name;
+}
@@ -0,0 +1,37 @@
+#ifndef _GATE_MDNS_H_
+#define _GATE_MDNS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * mDNS services: _http._tcp and _gate._tcp on port 80
+ *
+ * _gate._tcp TXT:
+ *   fw=1.4  api=1  lines=p1,p2  state=ready|opening|ota  id=a1b2c3
+ *
+ * `id` is the end of the STA MAC, stay the same when the name change.
+ * `state` is updated as it change, the mDNS component announce it: a
+ * single browse of _gate._tcp list every board and what it's doing
+ * (tools/gate_scan).
+ */
+
+#define GATE_MDNS_SERVICE   "_gate"
+#define GATE_MDNS_PROTO     "_tcp"
+/* Version of /api/vN */
+#define GATE_MDNS_API       "1"
+
+enum GateMdnsState {
+    GATE_MDNS_OPENING   = (1 << 0),
+    GATE_MDNS_OTA       = (1 << 1),
+};
+
+/* After mdns_hostname_set() */
+void gate_mdns_register(const char *hostname);
+
+/* Any task, not ISR. Before gate_mdns_register() is only recorded */
+void gate_mdns_set_state(enum GateMdnsState flag, bool on);
+/* "ready", "opening" or "ota", also retained on MQTT */
+const char* gate_mdns_state(void);
+
+#endif
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "mqtt_client.h"
+#include "cJSON.h"
+#include "config.h"
+#include "event_bus.h"
+#include "gate_mdns.h"
+#include "gate_mqtt.h"
+#include "http_body.h"
+#include "lan_door.h"
+
+static const char *TAG = "gate mqtt";
+
+#define GATE_MQTT_STACK         3072
+#define GATE_MQTT_PRIO          3       /* Publish only, under the client task */
+#define GATE_MQTT_PREFIX_SZ     (sizeof(GATE_MQTT_ROOT) + APP_CFG_MDNS_SZ)
+#define GATE_MQTT_TOPIC_SZ      (GATE_MQTT_PREFIX_SZ + 24)
+
+/* Message waiting for the publish task, topic is after the prefix */
+struct MqttMsg_st {
+    char topic[24];
+    char data[GATE_MQTT_MSG_SZ];
+    uint16_t len;
+    bool state;     /* Retained state, read when sent: always the last one */
+};
+
+/* `client` is changed by gate_mqtt_restart(), used with `client_lock` */
+static esp_mqtt_client_handle_t client;
+static SemaphoreHandle_t client_lock;
+static QueueHandle_t pub_queue;
+static volatile bool enabled;
+
+static char prefix[GATE_MQTT_PREFIX_SZ];
+static char status_topic[GATE_MQTT_TOPIC_SZ];
+static char client_id[16];
+static char url[APP_CFG_URL_SZ];
+
+/* Client task only */
+static int last_msg_id = -1;
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct GateMqttStats_st stats;
+static struct DoorStats_st cmd_stats;
+
+void gate_mqtt_get_stats(struct GateMqttStats_st *st)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *st = stats;
+    portEXIT_CRITICAL(&stats_lock);
+    door_stats_get(&cmd_stats, &st->cmd);
+}
+
+static void stats_count(uint32_t *cnt)
+{
+    portENTER_CRITICAL(&stats_lock);
+    (*cnt)++;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static enum DoorResult command_check(esp_mqtt_event_handle_t ev, uint8_t *lines)
+{
+    char name[16], payload[GATE_MQTT_PAYLOAD_MAX + 1];
+    size_t plen = strlen(prefix);
+    struct JsonSpan_st root, v;
+    struct timeval tv;
+    int64_t t, now;
+    int n;
+
+    n = ev->topic_len - (int)plen - 1;
+    if(n <= 0 || n >= sizeof(name) || memcmp(ev->topic, prefix, plen) || ev->topic[plen] != '/')
+        return DOOR_BAD_REQUEST;
+
+    memcpy(name, &ev->topic[plen + 1], n);
+    name[n] = '\0';
+
+    if(strcmp(name, POWER_LINE_1_NAME "/open") == 0)
+        *lines = 1 << POWER_LINE_1;
+    else if(strcmp(name, POWER_LINE_2_NAME "/open") == 0)
+        *lines = 1 << POWER_LINE_2;
+    else if(strcmp(name, "all/open") == 0)
+        *lines = (1 << POWER_LINE_1) | (1 << POWER_LINE_2);
+    else
+        return DOOR_BAD_REQUEST;
+
+    /* A retained open would run at each subscribe */
+    if(ev->retain)
+        return DOOR_REPLAY;
+
+    /* QoS 1 may deliver twice, the second time with the same id */
+    if(ev->dup && ev->msg_id == last_msg_id)
+        return DOOR_REPLAY;
+    last_msg_id = ev->msg_id;
+
+    if(ev->data_len != ev->total_data_len || ev->data_len > GATE_MQTT_PAYLOAD_MAX)
+        return DOOR_BAD_REQUEST;
+
+    /* Without `t` an open sent long ago look like a new one */
+    memcpy(payload, ev->data, ev->data_len);
+    payload[ev->data_len] = '\0';
+    json_root(payload, ev->data_len, &root);
+    if(!json_field(&root, "t", &v) || !json_int(&v, &t))
+        return DOOR_BAD_REQUEST;
+
+    /* Without SNTP the age can't be checked, refused as the LAN door */
+    gettimeofday(&tv, NULL);
+    if(tv.tv_sec < LAN_DOOR_EPOCH_MIN)
+        return DOOR_NO_CLOCK;
+
+    now = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    if(llabs(now - t) > GATE_MQTT_CMD_MAX_AGE_MS)
+        return DOOR_STALE;
+
+    return DOOR_OK;
+}
+
+static void on_command(esp_mqtt_event_handle_t ev)
+{
+    enum DoorResult r;
+    uint8_t lines = 0;
+    int pl;
+
+    /* Rest of a long payload, refused with the first part */
+    if(ev->current_data_offset != 0)
+        return;
+
+    r = command_check(ev, &lines);
+
+    for(pl = 0; r == DOOR_OK && pl < POWER_LINE_CNT; pl++)
+        if((lines & (1 << pl)) && drive_door_open_nowait(pl, POWER_SRC_MQTT) != ESP_OK)
+            r = DOOR_BUSY;
+
+    door_stats_add(&cmd_stats, r, 0);
+
+    if(r != DOOR_OK)
+        ESP_LOGW(TAG, "Command %.*s refused:%s", ev->topic_len, ev->topic, door_result_name(r));
+    /* Published back on event/mqtt: the answer of the command */
+    event_bus_publish("mqtt", "\"result\":\"%s\"", door_result_name(r));
+}
+
+/* Client task */
+static void mqtt_event_handler(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    esp_mqtt_event_handle_t ev = data;
+    char topic[GATE_MQTT_TOPIC_SZ];
+
+    switch((esp_mqtt_event_id_t)id) {
+    case MQTT_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "Connected, session present:%d", ev->session_present);
+
+        /* Clean session: nothing is kept by the broker, subscribe each time */
+        snprintf(topic, sizeof(topic), "%s/+/open", prefix);
+        esp_mqtt_client_subscribe(ev->client, topic, 1);
+        esp_mqtt_client_publish(ev->client, status_topic, "online", 0, 1, 1);
+
+        portENTER_CRITICAL(&stats_lock);
+        stats.connects++;
+        stats.connected = true;
+        portEXIT_CRITICAL(&stats_lock);
+
+        gate_mqtt_state_changed();
+        break;
+
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGW(TAG, "Disconnected, outbox:%d byte", esp_mqtt_client_get_outbox_size(ev->client));
+        portENTER_CRITICAL(&stats_lock);
+        stats.connected = false;
+        portEXIT_CRITICAL(&stats_lock);
+        break;
+
+    case MQTT_EVENT_DATA:
+        on_command(ev);
+        break;
+
+    case MQTT_EVENT_ERROR:
+        if(ev->error_handle != NULL)
+            ESP_LOGW(TAG, "Error type:%d code:%d", ev->error_handle->error_type,
+                            ev->error_handle->connect_return_code);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * The client API lock is held while the client task write the socket:
+ * event from the power task or an ISR path can't wait for it, they are
+ * queued and given to the client here.
+ */
+static void mqtt_pub_task(void *arg)
+{
+    char topic[GATE_MQTT_TOPIC_SZ];
+    struct MqttMsg_st m;
+    const char *data;
+    int len, ret;
+
+    for(;;) {
+        xQueueReceive(pub_queue, &m, portMAX_DELAY);
+
+        if(m.state) {
+            data = gate_mdns_state();
+            len = strlen(data);
+        } else {
+            data = m.data;
+            len = m.len;
+        }
+        snprintf(topic, sizeof(topic), "%s/%s", prefix, m.topic);
+
+        xSemaphoreTake(client_lock, portMAX_DELAY);
+        if(client == NULL) {
+            xSemaphoreGive(client_lock);
+            continue;
+        }
+
+        /* Stored also when not connected, sent after the reconnect */
+        if(esp_mqtt_client_get_outbox_size(client) > GATE_MQTT_OUTBOX_MAX)
+            ret = -1;
+        else
+            ret = esp_mqtt_client_enqueue(client, topic, data, len, 1, m.state, true);
+        xSemaphoreGive(client_lock);
+
+        stats_count(ret < 0 ? &stats.dropped : &stats.published);
+    }
+}
+
+static void pub_queue_send(const struct MqttMsg_st *m)
+{
+    if(xQueueSend(pub_queue, m, 0) != pdTRUE)
+        stats_count(&stats.dropped);
+}
+
+void gate_mqtt_event(const char *event, const char *json, size_t len)
+{
+    struct MqttMsg_st m = { .len = len };
+
+    if(!enabled)
+        return;
+
+    if(len > sizeof(m.data)) {
+        stats_count(&stats.dropped);
+        return;
+    }
+
+    snprintf(m.topic, sizeof(m.topic), "event/%s", event);
+    memcpy(m.data, json, len);
+    pub_queue_send(&m);
+}
+
+void gate_mqtt_state_changed(void)
+{
+    struct MqttMsg_st m = { .topic = "state", .state = true };
+
+    if(enabled)
+        pub_queue_send(&m);
+}
+
+/* Call with `client_lock` held */
+static void client_start(void)
+{
+    const struct AppConfig_t *cfg = app_config_get();
+    esp_err_t err;
+
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .broker.address.uri = url,
+        .credentials.client_id = client_id,
+        .session.last_will = {
+            .topic = status_topic,
+            .msg = "offline",
+            .qos = 1,
+            .retain = 1,
+        },
+        /* Command queued while offline are dropped, not replayed after an outage */
+        .session.disable_clean_session = false,
+        .session.keepalive = GATE_MQTT_KEEPALIVE_S,
+        .network.reconnect_timeout_ms = GATE_MQTT_RECONNECT_MS,
+    };
+
+    if(!(cfg->valid & APP_CFG_MQTT_URL) || cfg->mqtt_url[0] == '\0') {
+        ESP_LOGI(TAG, "No broker, MQTT disabled");
+        return;
+    }
+    strlcpy(url, cfg->mqtt_url, sizeof(url));
+
+    client = esp_mqtt_client_init(&mqtt_cfg);
+    if(client == NULL) {
+        ESP_LOGE(TAG, "Client init failed, check the URL");
+        return;
+    }
+
+    esp_mqtt_client_register_event(client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+
+    err = esp_mqtt_client_start(client);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Client start:%s", esp_err_to_name(err));
+        esp_mqtt_client_destroy(client);
+        client = NULL;
+        return;
+    }
+
+    enabled = true;
+    /* The URL may have a password, not logged */
+    ESP_LOGI(TAG, "Client %s started, topics %s/#", client_id, prefix);
+}
+
+void gate_mqtt_init(void)
+{
+    uint8_t mac[6];
+
+    /* Same id across reboot: the broker close a stale connection of this board */
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(client_id, sizeof(client_id), "gate-%02x%02x%02x", mac[3], mac[4], mac[5]);
+    snprintf(prefix, sizeof(prefix), GATE_MQTT_ROOT "/%s", app_config_hostname());
+    snprintf(status_topic, sizeof(status_topic), "%s/status", prefix);
+
+    client_lock = xSemaphoreCreateMutex();
+    pub_queue = xQueueCreate(GATE_MQTT_QUEUE_LEN, sizeof(struct MqttMsg_st));
+    xTaskCreate(mqtt_pub_task, "mqtt-pub", GATE_MQTT_STACK, NULL, GATE_MQTT_PRIO, NULL);
+
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+    client_start();
+    xSemaphoreGive(client_lock);
+}
+
+void gate_mqtt_restart(void)
+{
+    if(client_lock == NULL)
+        return;
+
+    xSemaphoreTake(client_lock, portMAX_DELAY);
+
+    if(client != NULL) {
+        enabled = false;
+        /* A clean disconnect does not send the last will */
+        esp_mqtt_client_publish(client, status_topic, "offline", 0, 1, 1);
+        esp_mqtt_client_destroy(client);
+        client = NULL;
+
+        portENTER_CRITICAL(&stats_lock);
+        stats.connected = false;
+        portEXIT_CRITICAL(&stats_lock);
+    }
+
+    client_start();
+
+    xSemaphoreGive(client_lock);
+}
+
+void gate_mqtt_add_json(cJSON *root)
+{
+    cJSON *o = cJSON_AddObjectToObject(root, "mqtt");
+    struct GateMqttStats_st st;
+
+    gate_mqtt_get_stats(&st);
+
+    cJSON_AddBoolToObject(o, "enabled", enabled);
+    cJSON_AddBoolToObject(o, "connected", st.connected);
+    cJSON_AddStringToObject(o, "client_id", client_id);
+    cJSON_AddStringToObject(o, "prefix", prefix);
+}
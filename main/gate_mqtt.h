@@ -0,0 +1,63 @@
+#ifndef _GATE_MQTT_H_
+#define _GATE_MQTT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "door_result.h"
+
+/*
+ * MQTT client for home automation, broker on the LAN
+ *
+ * Topics under gate/<mdns name>:
+ *   p1/open  p2/open  all/open     command, subscribed with QoS 1
+ *                                  payload {"t": <unix ms>}
+ *   status          online | offline, retained, offline is the last will
+ *   state           ready | opening | ota, retained
+ *   event/<name>    every event of the event bus (gate, button, mqtt ...)
+ *
+ * The session is clean: command sent while the board is offline are not
+ * kept by the broker, an outage never replay queued open. A command must
+ * carry `t`, it is refused when older than GATE_MQTT_CMD_MAX_AGE_MS or
+ * while the board clock is not set (SNTP). Retained command are always
+ * refused.
+ *
+ * Published messages are QoS 1. They wait in a queue, then in the client
+ * outbox while the broker is not reachable, up to GATE_MQTT_OUTBOX_MAX.
+ */
+
+#define GATE_MQTT_ROOT              "gate"
+#define GATE_MQTT_KEEPALIVE_S       30
+#define GATE_MQTT_RECONNECT_MS      2000
+#define GATE_MQTT_CMD_MAX_AGE_MS    30000
+#define GATE_MQTT_PAYLOAD_MAX       64
+/* Byte in the client outbox, above new messages are dropped */
+#define GATE_MQTT_OUTBOX_MAX        8192
+#define GATE_MQTT_QUEUE_LEN         16
+#define GATE_MQTT_MSG_SZ            128
+
+struct GateMqttStats_st {
+    struct DoorStats_st cmd;    /* Replay: retained or duplicate delivery */
+    uint32_t connects;
+    uint32_t published;     /* Given to the client */
+    uint32_t dropped;       /* Queue or outbox full */
+    bool connected;
+};
+
+/* After start_config_server(), reconnect by itself when the link come back */
+void gate_mqtt_init(void);
+/* New broker URL in the configuration */
+void gate_mqtt_restart(void);
+
+/* Any task, not ISR, never wait: `json` is the event object */
+void gate_mqtt_event(const char *event, const char *json, size_t len);
+/* gate_mdns_state() changed */
+void gate_mqtt_state_changed(void);
+
+void gate_mqtt_get_stats(struct GateMqttStats_st *st);
+
+/* Add `mqtt` state to `root` */
+struct cJSON;
+void gate_mqtt_add_json(struct cJSON *root);
+
+#endif
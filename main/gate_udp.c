@@ -0,0 +1,210 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+#include "mbedtls/md.h"
+#include "config.h"
+#include "event_bus.h"
+#include "lan_door.h"
+#include "gate_udp.h"
+
+static const char *TAG = "gate udp";
+
+#define GATE_UDP_STACK      3072
+/*
+ * Below the power task: a flood of frame (HMAC each) can't delay or stretch
+ * a pulse. The queued open preempt this task, the answer follow the first edge
+ */
+#define GATE_UDP_PRIO       9
+#define GATE_UDP_SIGNED_SZ  24
+
+/* UDP task only */
+static uint64_t session;
+static uint64_t last_nonce;
+/* HMAC context keyed once, rebuilt when the key change */
+static mbedtls_md_context_t hmac;
+static uint8_t hmac_key[APP_CFG_LAN_KEY_SZ];
+static bool hmac_ready;
+
+static struct DoorStats_st stats;
+/* UDP task only write it */
+static volatile uint32_t ping_cnt;
+
+void gate_udp_get_stats(struct GateUdpStats_st *st)
+{
+    door_stats_get(&stats, &st->frame);
+    st->ping = ping_cnt;
+}
+
+static uint64_t get_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+    int i;
+
+    for(i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+/* HMAC of the first GATE_UDP_SIGNED_SZ byte, no allocation after the first */
+static bool frame_mac(const uint8_t *key, const uint8_t *data, uint8_t *out)
+{
+    if(!hmac_ready || memcmp(hmac_key, key, sizeof(hmac_key)) != 0) {
+        memcpy(hmac_key, key, sizeof(hmac_key));
+        hmac_ready = mbedtls_md_hmac_starts(&hmac, hmac_key, sizeof(hmac_key)) == 0;
+    } else {
+        hmac_ready = mbedtls_md_hmac_reset(&hmac) == 0;
+    }
+
+    return hmac_ready &&
+           mbedtls_md_hmac_update(&hmac, data, GATE_UDP_SIGNED_SZ) == 0 &&
+           mbedtls_md_hmac_finish(&hmac, out) == 0;
+}
+
+static enum DoorResult frame_open(const uint8_t *rx)
+{
+    uint8_t lines = rx[4];
+    int pl;
+
+    if(lines == 0 || lines >= (1 << POWER_LINE_CNT))
+        return DOOR_BAD_REQUEST;
+    if(get_be64(&rx[8]) != session)
+        return DOOR_BAD_SESSION;
+    if(get_be64(&rx[16]) <= last_nonce)
+        return DOOR_REPLAY;
+
+    /* Used even when busy, the retry take a new one */
+    last_nonce = get_be64(&rx[16]);
+
+    for(pl = 0; pl < POWER_LINE_CNT; pl++)
+        if((lines & (1 << pl)) && drive_door_open_nowait(pl, POWER_SRC_UDP) != ESP_OK)
+            return DOOR_BUSY;
+
+    return DOOR_OK;
+}
+
+/* Fill `tx` when an answer must be sent, return its size or 0 */
+static int frame_handle(const uint8_t *rx, int len, uint8_t *tx, enum DoorResult *r)
+{
+    const struct AppConfig_t *cfg = app_config_get();
+    uint8_t mac[LAN_DOOR_MAC_SZ];
+
+    if(len != GATE_UDP_REQ_SZ || rx[0] != 'G' || rx[1] != 'U' || rx[2] != GATE_UDP_VERSION ||
+       (rx[3] != GATE_UDP_OPEN && rx[3] != GATE_UDP_PING)) {
+        *r = DOOR_BAD_REQUEST;
+        return 0;
+    }
+
+    if(!(cfg->valid & APP_CFG_LAN_KEY)) {
+        *r = DOOR_NO_KEY;
+        return 0;
+    }
+
+    /* No answer without the key: nothing to learn, nothing to reflect */
+    if(!frame_mac(cfg->lan_key, rx, mac) || !lan_door_mac_equal(mac, &rx[GATE_UDP_SIGNED_SZ], sizeof(mac))) {
+        *r = DOOR_BAD_MAC;
+        return 0;
+    }
+
+    *r = rx[3] == GATE_UDP_OPEN ? frame_open(rx) : DOOR_OK;
+
+    memset(tx, 0, GATE_UDP_ACK_SZ);
+    tx[0] = 'G';
+    tx[1] = 'U';
+    tx[2] = GATE_UDP_VERSION;
+    tx[3] = rx[3] | 0x80;
+    tx[4] = *r;
+    put_be64(&tx[8], session);
+    memcpy(&tx[16], &rx[16], 8);
+
+    if(!frame_mac(cfg->lan_key, tx, mac))
+        return 0;
+    memcpy(&tx[GATE_UDP_SIGNED_SZ], mac, GATE_UDP_ACK_MAC_SZ);
+
+    return GATE_UDP_ACK_SZ;
+}
+
+static void gate_udp_task(void *arg)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(GATE_UDP_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    /* One more byte: a longer datagram is not taken for a good one */
+    uint8_t rx[GATE_UDP_REQ_SZ + 1], tx[GATE_UDP_ACK_SZ];
+    struct sockaddr_in from;
+    socklen_t from_len;
+    enum DoorResult r;
+    int64_t start;
+    int sock, len, tx_len;
+    bool ping;
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "Socket on port %d failed, errno:%d", GATE_UDP_PORT, errno);
+        if(sock >= 0)
+            close(sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Listen on port %d, session %016llx", GATE_UDP_PORT, session);
+
+    for(;;) {
+        from_len = sizeof(from);
+        len = recvfrom(sock, rx, sizeof(rx), 0, (struct sockaddr*)&from, &from_len);
+        if(len < 0) {
+            ESP_LOGW(TAG, "recvfrom errno:%d", errno);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        start = esp_timer_get_time();
+        tx_len = frame_handle(rx, len, tx, &r);
+        if(tx_len > 0)
+            sendto(sock, tx, tx_len, 0, (struct sockaddr*)&from, from_len);
+
+        ping = tx_len > 0 && rx[3] == GATE_UDP_PING;
+        door_stats_add(&stats, r, start);
+        if(ping)
+            ping_cnt++;
+
+        /* Only signed open are logged and published, a flood of ping or junk is only counted */
+        if(tx_len == 0 || rx[3] != GATE_UDP_OPEN)
+            continue;
+
+        if(r != DOOR_OK)
+            ESP_LOGW(TAG, "Frame from %s refused:%s", inet_ntoa(from.sin_addr), door_result_name(r));
+        event_bus_publish("udp", "\"result\":\"%s\"", door_result_name(r));
+    }
+}
+
+void gate_udp_init(void)
+{
+    /* Never 0, the value of a sender that has no session yet */
+    do {
+        esp_fill_random(&session, sizeof(session));
+    } while(session == 0);
+
+    mbedtls_md_init(&hmac);
+    if(mbedtls_md_setup(&hmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0) {
+        ESP_LOGE(TAG, "HMAC setup failed, UDP door open disabled");
+        return;
+    }
+
+    xTaskCreate(gate_udp_task, "gate-udp", GATE_UDP_STACK, NULL, GATE_UDP_PRIO, NULL);
+}
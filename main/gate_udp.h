@@ -0,0 +1,52 @@
+#ifndef _GATE_UDP_H_
+#define _GATE_UDP_H_
+
+#include <stdint.h>
+#include "door_result.h"
+
+/*
+ * Door open over UDP for the intercom, one datagram each way
+ *
+ * Request, GATE_UDP_REQ_SZ byte, integer big endian:
+ *    0  'G' 'U' version type         type 1 open, 2 ping
+ *    4  lines 0 0 0                  bit 0 p1, bit 1 p2
+ *    8  session (8)                  from the last answer, 0 the first time
+ *   16  nonce (8)                    grow at each open
+ *   24  HMAC-SHA256(lan_key, byte 0-23)
+ *
+ * Answer, GATE_UDP_ACK_SZ byte, only to a request with a good MAC:
+ *    0  'G' 'U' version type|0x80
+ *    4  result 0 0 0                 enum DoorResult
+ *    8  session (8)
+ *   16  nonce (8) of the request
+ *   24  HMAC-SHA256(lan_key, byte 0-23), first 16 byte
+ *
+ * The key is the LAN door one (`/chiave_lan`). `session` is random at
+ * each boot, frames sent before a reboot can't be replayed after it: an
+ * open with another session get `bad_session` and the current one, the
+ * sender retry with it. In a session an open is accepted only with a
+ * nonce above the last accepted, one sender for each key. Ping check
+ * only the MAC, tools/gate_udp use it for round trip and rate.
+ */
+
+#define GATE_UDP_PORT       4210
+#define GATE_UDP_VERSION    1
+#define GATE_UDP_REQ_SZ     56
+#define GATE_UDP_ACK_SZ     40
+#define GATE_UDP_ACK_MAC_SZ 16
+
+enum GateUdpType {
+    GATE_UDP_OPEN   = 1,
+    GATE_UDP_PING   = 2,
+};
+
+struct GateUdpStats_st {
+    struct DoorStats_st frame;  /* Ping included */
+    uint32_t ping;
+};
+
+void gate_udp_init(void);
+
+void gate_udp_get_stats(struct GateUdpStats_st *st);
+
+#endif
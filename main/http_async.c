@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "event_bus.h"
+#include "http_async.h"
+
+static const char *TAG = "http async";
+
+/* httpd session, `seq` is the open order. httpd task only */
+struct HttpSess_st {
+    int fd;             /* -1: free */
+    uint32_t seq;
+};
+
+static struct HttpSess_st sess[HTTP_MAX_OPEN_SOCKETS];
+static uint32_t sess_seq;
+
+/* Socket of the request in each worker, -1: idle */
+static portMUX_TYPE busy_lock = portMUX_INITIALIZER_UNLOCKED;
+static int busy_fd[HTTP_ASYNC_WORKERS];
+
+static bool sess_busy(int fd)
+{
+    bool busy = false;
+    int i;
+
+    portENTER_CRITICAL(&busy_lock);
+    for(i = 0; i < HTTP_ASYNC_WORKERS && !busy; i++)
+        busy = busy_fd[i] == fd;
+    portEXIT_CRITICAL(&busy_lock);
+
+    return busy;
+}
+
+esp_err_t http_sess_open(httpd_handle_t hd, int sockfd)
+{
+    struct HttpSess_st *s, *slot = NULL, *old = NULL;
+    int i, used = 1;
+
+    for(i = 0; i < HTTP_MAX_OPEN_SOCKETS; i++) {
+        s = &sess[i];
+        if(s->fd < 0) {
+            if(slot == NULL)
+                slot = s;
+            continue;
+        }
+
+        used++;
+        if(event_bus_is_client(s->fd) || sess_busy(s->fd))
+            continue;
+        if(old == NULL || (int32_t)(s->seq - old->seq) < 0)
+            old = s;
+    }
+
+    if(slot != NULL) {
+        slot->fd = sockfd;
+        slot->seq = ++sess_seq;
+    }
+
+    /* Keep one socket free for the next client, as the httpd LRU purge */
+    if(used >= HTTP_MAX_OPEN_SOCKETS && old != NULL) {
+        ESP_LOGI(TAG, "All %d socket used, oldest fd:%d closed", HTTP_MAX_OPEN_SOCKETS, old->fd);
+        httpd_sess_trigger_close(hd, old->fd);
+    }
+
+    return ESP_OK;
+}
+
+void http_sess_close(httpd_handle_t hd, int sockfd)
+{
+    int i;
+
+    for(i = 0; i < HTTP_MAX_OPEN_SOCKETS; i++)
+        if(sess[i].fd == sockfd)
+            sess[i].fd = -1;
+
+    /* Close the socket too */
+    event_bus_sock_close(hd, sockfd);
+}
+
+static void sess_init(void)
+{
+    int i;
+
+    for(i = 0; i < HTTP_MAX_OPEN_SOCKETS; i++)
+        sess[i].fd = -1;
+    for(i = 0; i < HTTP_ASYNC_WORKERS; i++)
+        busy_fd[i] = -1;
+}
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+
+/* Replace `from` by `to` in busy_fd */
+static void sess_set_busy(int from, int to)
+{
+    int i;
+
+    portENTER_CRITICAL(&busy_lock);
+    for(i = 0; i < HTTP_ASYNC_WORKERS; i++) {
+        if(busy_fd[i] == from) {
+            busy_fd[i] = to;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&busy_lock);
+}
+
+struct HttpAsyncReq_st {
+    httpd_req_t *req;       /* Copy from httpd_req_async_handler_begin() */
+    http_async_handler_t handler;
+};
+
+static QueueHandle_t async_queue;
+/* One for each idle worker, taken before the request is queued */
+static SemaphoreHandle_t async_idle;
+
+static void http_async_worker(void *arg)
+{
+    struct HttpAsyncReq_st a;
+    int64_t start;
+    esp_err_t err;
+    int fd;
+
+    for(;;) {
+        xQueueReceive(async_queue, &a, portMAX_DELAY);
+
+        fd = httpd_req_to_sockfd(a.req);
+        start = esp_timer_get_time();
+        err = a.handler(a.req);
+        ESP_LOGI(TAG, "%s done in %lld ms:%s", a.req->uri, (esp_timer_get_time() - start) / 1000,
+                        esp_err_to_name(err));
+
+        /* As the server does for a failed handler: body may be left unread */
+        if(err != ESP_OK)
+            httpd_sess_trigger_close(a.req->handle, fd);
+
+        httpd_req_async_handler_complete(a.req);
+        sess_set_busy(fd, -1);
+        xSemaphoreGive(async_idle);
+    }
+}
+
+void http_async_init(void)
+{
+    char name[16];
+    int i;
+
+    sess_init();
+    async_queue = xQueueCreate(HTTP_ASYNC_WORKERS, sizeof(struct HttpAsyncReq_st));
+    async_idle = xSemaphoreCreateCounting(HTTP_ASYNC_WORKERS, HTTP_ASYNC_WORKERS);
+
+    for(i = 0; i < HTTP_ASYNC_WORKERS; i++) {
+        snprintf(name, sizeof(name), "http-async-%d", i);
+        xTaskCreate(http_async_worker, name, HTTP_ASYNC_STACK, NULL, HTTP_ASYNC_PRIO, NULL);
+    }
+
+    ESP_LOGI(TAG, "%d worker, %d socket", HTTP_ASYNC_WORKERS, HTTP_MAX_OPEN_SOCKETS);
+}
+
+esp_err_t http_async_submit(httpd_req_t *req, http_async_handler_t handler)
+{
+    struct HttpAsyncReq_st a = { .handler = handler };
+    esp_err_t err;
+
+    /* Never wait here, the server task would stop too */
+    if(xSemaphoreTake(async_idle, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "All worker busy, %s refused", req->uri);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_send(req, "Busy", HTTPD_RESP_USE_STRLEN);
+        /* Body not read: closed, or httpd would drain a whole image in the server task */
+        return ESP_FAIL;
+    }
+
+    err = httpd_req_async_handler_begin(req, &a.req);
+    if(err != ESP_OK) {
+        xSemaphoreGive(async_idle);
+        ESP_LOGE(TAG, "Async begin:%s", esp_err_to_name(err));
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Async request failed");
+        return ESP_FAIL;
+    }
+
+    /* Not purged while in the worker. Room is sure, a worker is idle */
+    sess_set_busy(-1, httpd_req_to_sockfd(a.req));
+    xQueueSend(async_queue, &a, 0);
+
+    return ESP_OK;
+}
+
+#else
+
+void http_async_init(void)
+{
+    sess_init();
+    ESP_LOGW(TAG, "No async request API before ESP-IDF 5.1, long handler block the server");
+}
+
+esp_err_t http_async_submit(httpd_req_t *req, http_async_handler_t handler)
+{
+    return handler(req);
+}
+
+#endif
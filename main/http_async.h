@@ -0,0 +1,47 @@
+#ifndef _HTTP_ASYNC_H_
+#define _HTTP_ASYNC_H_
+
+#include "sdkconfig.h"
+#include "esp_http_server.h"
+
+/*
+ * Worker pool for long handlers
+ *
+ * A handler started with http_async_submit() run in one of the
+ * HTTP_ASYNC_WORKERS task through the httpd async request API: the server
+ * task go on with the other request meanwhile. All worker busy: 503.
+ * The async request API is in ESP-IDF 5.1, before it the handler run in
+ * the server task as usual.
+ *
+ * Handler running here must not use http_body, its arena belong to the
+ * server task.
+ *
+ * Session purge: httpd LRU purge close the socket with the oldest request,
+ * that is always an event stream (one request, then open for hours). It is
+ * off, http_sess_open() do it instead: when the last socket is taken the
+ * oldest API session is closed, event stream and request in a worker are
+ * never. All of them in use: the next client wait in the listen backlog.
+ */
+
+#define HTTP_ASYNC_WORKERS      2
+#define HTTP_ASYNC_STACK        4096
+/* Under the server task (5): a flash write does not delay the API */
+#define HTTP_ASYNC_PRIO         4
+
+/* Socket used out of httpd: Telegram poll and send, pull OTA, SNTP, mDNS, MQTT, UDP door */
+#define HTTP_SOCK_RESERVED      7
+/* httpd keep 3 socket for itself */
+#define HTTP_MAX_OPEN_SOCKETS   (CONFIG_LWIP_MAX_SOCKETS - 3 - HTTP_SOCK_RESERVED)
+
+typedef esp_err_t (*http_async_handler_t)(httpd_req_t *req);
+
+void http_async_init(void);
+
+/* httpd_config_t open_fn and close_fn */
+esp_err_t http_sess_open(httpd_handle_t hd, int sockfd);
+void http_sess_close(httpd_handle_t hd, int sockfd);
+
+/* Call from the URI handler, return its result */
+esp_err_t http_async_submit(httpd_req_t *req, http_async_handler_t handler);
+
+#endif
@@ -0,0 +1,348 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "http_body.h"
+
+static const char *TAG = "http body";
+
+/* Body then decoded string, only the httpd task use it */
+static char arena[HTTP_BODY_ARENA_SZ];
+
+static const char* skip_ws(const char *p, const char *end)
+{
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+/* `p` on the opening quote, return after the closing one */
+static const char* skip_string(const char *p, const char *end)
+{
+    for(p++; p < end; p++) {
+        if(*p == '\\')
+            p++;
+        else if(*p == '"')
+            return p + 1;
+    }
+    return NULL;
+}
+
+/* End of the value starting at `p`, NULL if it's not complete */
+static const char* skip_value(const char *p, const char *end)
+{
+    const char *start = p;
+    int depth = 0;
+
+    if(p >= end)
+        return NULL;
+
+    if(*p == '"')
+        return skip_string(p, end);
+
+    /* Number or literal, checked when converted */
+    if(*p != '{' && *p != '[') {
+        while(p < end && !strchr(",]} \t\r\n", *p))
+            p++;
+        return p == start ? NULL : p;
+    }
+
+    while(p < end) {
+        if(*p == '"') {
+            p = skip_string(p, end);
+            if(p == NULL)
+                return NULL;
+            continue;
+        }
+
+        if(*p == '{' || *p == '[') {
+            depth++;
+        } else if(*p == '}' || *p == ']') {
+            if(--depth == 0)
+                return p + 1;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+esp_err_t http_body_read(httpd_req_t *req, struct HttpBody_st *body)
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)HTTP_BODY_TIMEOUT_MS * 1000;
+    size_t got = 0;
+    int ret;
+
+    memset(body, 0, sizeof(*body));
+
+    if(req->content_len > HTTP_BODY_MAX) {
+        ESP_LOGW(TAG, "Body of %u byte refused", req->content_len);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Body too long");
+        return ESP_FAIL;
+    }
+
+    /* httpd_req_recv() return what the socket has, a slow client is not a full body */
+    while(got < req->content_len) {
+        ret = httpd_req_recv(req, &arena[got], req->content_len - got);
+        if(ret > 0)
+            got += ret;
+        else if(ret != HTTPD_SOCK_ERR_TIMEOUT)
+            return ESP_FAIL;
+
+        if(got < req->content_len && esp_timer_get_time() > deadline) {
+            ESP_LOGW(TAG, "Body timeout, %u of %u byte", got, req->content_len);
+            httpd_resp_send_408(req);
+            return ESP_FAIL;
+        }
+    }
+
+    arena[got] = '\0';
+    body->data = arena;
+    body->len = got;
+    body->arena_used = got + 1;
+
+    json_root(arena, got, &body->root);
+
+    return ESP_OK;
+}
+
+void json_root(const char *data, size_t len, struct JsonSpan_st *root)
+{
+    const char *end;
+
+    /* Not JSON: root stay empty and every field is missing */
+    root->p = skip_ws(data, &data[len]);
+    root->len = 0;
+    end = skip_value(root->p, &data[len]);
+    if(end != NULL)
+        root->len = end - root->p;
+}
+
+bool json_field(const struct JsonSpan_st *obj, const char *key, struct JsonSpan_st *val)
+{
+    const char *p, *end, *k, *k_end, *v;
+    size_t key_len = strlen(key);
+
+    if(obj->len < 2 || obj->p[0] != '{')
+        return false;
+
+    p = obj->p + 1;
+    end = obj->p + obj->len - 1;
+
+    for(;;) {
+        p = skip_ws(p, end);
+        if(p >= end || *p != '"')
+            return false;
+
+        k = p + 1;
+        p = skip_string(p, end);
+        if(p == NULL)
+            return false;
+        k_end = p - 1;
+
+        p = skip_ws(p, end);
+        if(p >= end || *p != ':')
+            return false;
+
+        v = skip_ws(p + 1, end);
+        p = skip_value(v, end);
+        if(p == NULL)
+            return false;
+
+        /* Key compared as written, the API has no key with escape */
+        if(k_end - k == key_len && memcmp(k, key, key_len) == 0) {
+            val->p = v;
+            val->len = p - v;
+            return true;
+        }
+
+        p = skip_ws(p, end);
+        if(p >= end || *p != ',')
+            return false;
+        p++;
+    }
+}
+
+bool json_index(const struct JsonSpan_st *arr, int idx, struct JsonSpan_st *val)
+{
+    const char *p, *end, *v;
+    int i;
+
+    if(!json_is_array(arr) || idx < 0)
+        return false;
+
+    p = arr->p + 1;
+    end = arr->p + arr->len - 1;
+
+    for(i = 0; ; i++) {
+        v = skip_ws(p, end);
+        p = skip_value(v, end);
+        if(p == NULL)
+            return false;
+
+        if(i == idx) {
+            val->p = v;
+            val->len = p - v;
+            return true;
+        }
+
+        p = skip_ws(p, end);
+        if(p >= end || *p != ',')
+            return false;
+        p++;
+    }
+}
+
+bool json_is_array(const struct JsonSpan_st *v)
+{
+    return v->len >= 2 && v->p[0] == '[';
+}
+
+static int hex_nibble(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool hex_to_bin(const char *hex, uint8_t *out, size_t len)
+{
+    size_t i;
+    int hi, lo;
+
+    if(hex == NULL || strlen(hex) != len * 2)
+        return false;
+
+    for(i = 0; i < len; i++) {
+        hi = hex_nibble(hex[2 * i]);
+        lo = hex_nibble(hex[2 * i + 1]);
+        if(hi < 0 || lo < 0)
+            return false;
+        out[i] = (hi << 4) | lo;
+    }
+
+    return true;
+}
+
+bool json_str(struct HttpBody_st *body, const struct JsonSpan_st *v, const char **out)
+{
+    const char *p, *end;
+    char *o = &arena[body->arena_used];
+    /* One byte left for the terminator */
+    char *o_end = &arena[HTTP_BODY_ARENA_SZ - 1];
+    uint32_t cp;
+    int i, n;
+    char c;
+
+    if(v->len < 2 || v->p[0] != '"')
+        return false;
+
+    p = v->p + 1;
+    end = v->p + v->len - 1;
+
+    while(p < end) {
+        c = *p++;
+
+        if(c == '\\') {
+            if(p >= end)
+                return false;
+
+            switch(c = *p++) {
+            case '"':
+            case '\\':
+            case '/':
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+                /* Basic plane only, a surrogate pair give two '?' */
+                if(end - p < 4)
+                    return false;
+                for(cp = 0, i = 0; i < 4; i++) {
+                    n = hex_nibble(*p++);
+                    if(n < 0)
+                        return false;
+                    cp = (cp << 4) | n;
+                }
+                if(cp == 0)
+                    return false;
+                if(cp >= 0xd800 && cp <= 0xdfff)
+                    cp = '?';
+
+                if(o_end - o < 3)
+                    return false;
+                if(cp < 0x80) {
+                    *o++ = cp;
+                } else if(cp < 0x800) {
+                    *o++ = 0xc0 | (cp >> 6);
+                    *o++ = 0x80 | (cp & 0x3f);
+                } else {
+                    *o++ = 0xe0 | (cp >> 12);
+                    *o++ = 0x80 | ((cp >> 6) & 0x3f);
+                    *o++ = 0x80 | (cp & 0x3f);
+                }
+                continue;
+            default:
+                return false;
+            }
+        }
+
+        if(o >= o_end)
+            return false;
+        *o++ = c;
+    }
+
+    *o++ = '\0';
+    *out = &arena[body->arena_used];
+    body->arena_used = o - arena;
+
+    return true;
+}
+
+bool json_int(const struct JsonSpan_st *v, int64_t *out)
+{
+    char *e;
+    long long n;
+
+    /* The body is NUL terminated, strtoll() stop at the delimiter */
+    if(v->len == 0 || (v->p[0] != '-' && (v->p[0] < '0' || v->p[0] > '9')))
+        return false;
+
+    errno = 0;
+    n = strtoll(v->p, &e, 10);
+    if(errno != 0 || e != v->p + v->len)
+        return false;
+
+    *out = n;
+    return true;
+}
+
+bool json_bool(const struct JsonSpan_st *v, bool *out)
+{
+    if(v->len == 4 && memcmp(v->p, "true", 4) == 0)
+        *out = true;
+    else if(v->len == 5 && memcmp(v->p, "false", 5) == 0)
+        *out = false;
+    else
+        return false;
+
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef _HTTP_BODY_H_
+#define _HTTP_BODY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_http_server.h"
+
+/*
+ * Request body of the config API
+ *
+ * The whole body is read in a static arena, up to HTTP_BODY_MAX byte and
+ * HTTP_BODY_TIMEOUT_MS, with as many httpd_req_recv() as needed. String
+ * values are decoded in the rest of the arena, nothing is allocated.
+ * Handlers run one at time in the httpd task: the arena is reused by the
+ * next request, don't keep pointer to it.
+ *
+ * JSON values are read in place, no tree is built:
+ *
+ *   struct JsonSpan_st v;
+ *   if(json_field(&body.root, "ssid", &v) && json_str(&body, &v, &ssid)) ...
+ */
+
+#define HTTP_BODY_MAX           1536
+#define HTTP_BODY_ARENA_SZ      (2 * HTTP_BODY_MAX)
+#define HTTP_BODY_TIMEOUT_MS    5000
+
+/* A JSON value inside the body, `p` is the first character */
+struct JsonSpan_st {
+    const char *p;
+    size_t len;
+};
+
+struct HttpBody_st {
+    const char *data;   /* NUL terminated */
+    size_t len;
+    struct JsonSpan_st root;
+    size_t arena_used;
+};
+
+/*
+ * Read the body of `req`. On error the answer is already sent (400, 408)
+ * and the handler must return ESP_FAIL so the socket is closed.
+ */
+esp_err_t http_body_read(httpd_req_t *req, struct HttpBody_st *body);
+
+/* Top value of `data`, NUL terminated and not only a body: MQTT payload */
+void json_root(const char *data, size_t len, struct JsonSpan_st *root);
+
+/* Value of `key` in the object `obj`, false if not an object or missing */
+bool json_field(const struct JsonSpan_st *obj, const char *key, struct JsonSpan_st *val);
+/* Item `idx` of the array `arr` */
+bool json_index(const struct JsonSpan_st *arr, int idx, struct JsonSpan_st *val);
+
+bool json_is_array(const struct JsonSpan_st *v);
+/* String unescaped in the arena, false if not a string or no room */
+bool json_str(struct HttpBody_st *body, const struct JsonSpan_st *v, const char **out);
+/* Integer only, chat id do not fit a double */
+bool json_int(const struct JsonSpan_st *v, int64_t *out);
+bool json_bool(const struct JsonSpan_st *v, bool *out);
+
+/* Exactly `len` * 2 hex digit, either case, to `len` byte. Used for header too */
+bool hex_to_bin(const char *hex, uint8_t *out, size_t len);
+
+#endif
@@ -0,0 +1,233 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "mbedtls/md.h"
+#include "config.h"
+#include "event_bus.h"
+#include "http_body.h"
+#include "lan_door.h"
+
+static const char *TAG = "lan-door";
+
+/* Only a prefix of the MAC is kept, enough to tell two request apart */
+#define SEEN_MAC_SZ     8
+
+struct SeenMac_st {
+    int64_t time_ms;
+    uint8_t mac[SEEN_MAC_SZ];
+};
+
+static struct SeenMac_st seen[LAN_DOOR_REPLAY_CNT];
+static int seen_head, seen_cnt;
+/* Time of the last evicted entry, request up to it can't be checked anymore */
+static int64_t seen_floor_ms;
+
+/* Random at boot, for the request without clock. httpd task only */
+static char session_hex[LAN_DOOR_SESSION_SZ * 2 + 1];
+/* Last nonce accepted in the session, with `lan_door_lock` */
+static int64_t session_nonce;
+
+static struct DoorStats_st stats;
+static portMUX_TYPE lan_door_lock = portMUX_INITIALIZER_UNLOCKED;
+
+bool lan_door_mac_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint8_t diff = 0;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+
+    return diff == 0;
+}
+
+/* Accept `mac` once, remember it until LAN_DOOR_REPLAY_CNT newer are accepted */
+static bool seen_add(int64_t time_ms, const uint8_t *mac)
+{
+    bool fresh = true;
+    int i;
+
+    portENTER_CRITICAL(&lan_door_lock);
+
+    if(time_ms <= seen_floor_ms)
+        fresh = false;
+
+    for(i = 0; fresh && i < seen_cnt; i++)
+        if(memcmp(seen[i].mac, mac, SEEN_MAC_SZ) == 0)
+            fresh = false;
+
+    if(fresh) {
+        if(seen_cnt == LAN_DOOR_REPLAY_CNT) {
+            if(seen[seen_head].time_ms > seen_floor_ms)
+                seen_floor_ms = seen[seen_head].time_ms;
+        } else {
+            seen_cnt++;
+        }
+
+        seen[seen_head].time_ms = time_ms;
+        memcpy(seen[seen_head].mac, mac, SEEN_MAC_SZ);
+        seen_head = (seen_head + 1) % LAN_DOOR_REPLAY_CNT;
+    }
+
+    portEXIT_CRITICAL(&lan_door_lock);
+
+    return fresh;
+}
+
+/* Accept `nonce` only above the last one of the session */
+static bool session_nonce_add(int64_t nonce)
+{
+    bool fresh;
+
+    portENTER_CRITICAL(&lan_door_lock);
+    fresh = nonce > session_nonce;
+    if(fresh)
+        session_nonce = nonce;
+    portEXIT_CRITICAL(&lan_door_lock);
+
+    return fresh;
+}
+
+static const char* session_get(void)
+{
+    uint8_t rnd[LAN_DOOR_SESSION_SZ];
+    int i;
+
+    if(session_hex[0] == '\0') {
+        esp_fill_random(rnd, sizeof(rnd));
+        for(i = 0; i < sizeof(rnd); i++)
+            sprintf(&session_hex[i * 2], "%02x", rnd[i]);
+    }
+
+    return session_hex;
+}
+
+enum DoorResult lan_door_check(const char *msg, int64_t time_ms, const char *mac_hex, const char *session)
+{
+    const struct AppConfig_t *cfg = app_config_get();
+    uint8_t mac[LAN_DOOR_MAC_SZ], expect[LAN_DOOR_MAC_SZ];
+    struct timeval tv;
+    int64_t now_ms;
+
+    if(!(cfg->valid & APP_CFG_LAN_KEY))
+        return DOOR_NO_KEY;
+
+    if(!hex_to_bin(mac_hex, mac, sizeof(mac)))
+        return DOOR_BAD_REQUEST;
+
+    if(session != NULL) {
+        /* Frame of a previous boot: the nonce can't be checked */
+        if(strcmp(session, session_get()) != 0)
+            return DOOR_BAD_SESSION;
+    } else {
+        gettimeofday(&tv, NULL);
+        if(tv.tv_sec < LAN_DOOR_EPOCH_MIN)
+            return DOOR_NO_CLOCK;
+
+        now_ms = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        if(time_ms < now_ms - LAN_DOOR_WINDOW_MS || time_ms > now_ms + LAN_DOOR_WINDOW_MS)
+            return DOOR_STALE;
+    }
+
+    if(mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), cfg->lan_key, sizeof(cfg->lan_key),
+                       (const unsigned char*)msg, strlen(msg), expect) != 0)
+        return DOOR_BAD_MAC;
+
+    if(!lan_door_mac_equal(mac, expect, sizeof(mac)))
+        return DOOR_BAD_MAC;
+
+    /* Only after the MAC: a forged request must not fill the cache or move the nonce */
+    if(session != NULL ? !session_nonce_add(time_ms) : !seen_add(time_ms, mac))
+        return DOOR_REPLAY;
+
+    return DOOR_OK;
+}
+
+void lan_door_get_stats(struct DoorStats_st *st)
+{
+    door_stats_get(&stats, st);
+}
+
+static const char* result_status(enum DoorResult r)
+{
+    switch(r) {
+    case DOOR_OK:
+        return HTTPD_200;
+    case DOOR_BAD_REQUEST:
+        return HTTPD_400;
+    case DOOR_STALE:
+    case DOOR_BAD_MAC:
+    case DOOR_BAD_SESSION:
+    case DOOR_REPLAY:
+        return "401 Unauthorized";
+    default:
+        return "503 Service Unavailable";
+    }
+}
+
+/* Small and fixed answer: no cJSON on this path */
+esp_err_t lan_door_open_handler(httpd_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    char line[8], time_str[24], mac_hex[LAN_DOOR_MAC_SZ * 2 + 1], msg[64], rpl[96];
+    char session[LAN_DOOR_SESSION_SZ * 2 + 1];
+    enum DoorResult r = DOOR_BAD_REQUEST;
+    bool has_session;
+    int64_t time_ms = 0;
+    uint8_t lines = 0;
+    char *end;
+    int pl;
+
+    if(httpd_req_get_hdr_value_str(req, "X-Gate-Line", line, sizeof(line)) == ESP_OK &&
+       httpd_req_get_hdr_value_str(req, "X-Gate-Time", time_str, sizeof(time_str)) == ESP_OK &&
+       httpd_req_get_hdr_value_str(req, "X-Gate-Mac", mac_hex, sizeof(mac_hex)) == ESP_OK) {
+        time_ms = strtoll(time_str, &end, 10);
+
+        if(strcmp(line, POWER_LINE_1_NAME) == 0)
+            lines = 1 << POWER_LINE_1;
+        else if(strcmp(line, POWER_LINE_2_NAME) == 0)
+            lines = 1 << POWER_LINE_2;
+        else if(strcmp(line, "all") == 0)
+            lines = (1 << POWER_LINE_1) | (1 << POWER_LINE_2);
+
+        has_session = httpd_req_get_hdr_value_str(req, "X-Gate-Session", session, sizeof(session)) == ESP_OK;
+
+        /* The time is signed as it was sent */
+        if(lines && end != time_str && *end == '\0') {
+            if(has_session)
+                snprintf(msg, sizeof(msg), "open:%s:%s:%s", line, time_str, session);
+            else
+                snprintf(msg, sizeof(msg), "open:%s:%s", line, time_str);
+            r = lan_door_check(msg, time_ms, mac_hex, has_session ? session : NULL);
+        }
+    }
+
+    for(pl = 0; r == DOOR_OK && pl < POWER_LINE_CNT; pl++)
+        if((lines & (1 << pl)) && drive_door_open_nowait(pl, POWER_SRC_LAN) != ESP_OK)
+            r = DOOR_BUSY;
+
+    /* The session is not secret, given to who need it to retry */
+    if(r == DOOR_NO_CLOCK || r == DOOR_BAD_SESSION)
+        snprintf(rpl, sizeof(rpl), "{\"okay\":false,\"result\":\"%s\",\"session\":\"%s\"}",
+                    door_result_name(r), session_get());
+    else
+        snprintf(rpl, sizeof(rpl), "{\"okay\":%s,\"result\":\"%s\"}",
+                    r == DOOR_OK ? "true" : "false", door_result_name(r));
+
+    httpd_resp_set_status(req, result_status(r));
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, rpl, strlen(rpl));
+
+    door_stats_add(&stats, r, start);
+
+    if(r != DOOR_OK)
+        ESP_LOGW(TAG, "Door open refused:%s", door_result_name(r));
+    event_bus_publish("lan", "\"result\":\"%s\"", door_result_name(r));
+
+    return ESP_OK;
+}
@@ -0,0 +1,53 @@
+#ifndef _LAN_DOOR_H_
+#define _LAN_DOOR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_http_server.h"
+#include "door_result.h"
+
+/*
+ * Door open from the LAN, no cloud in the path
+ *
+ *   POST /api/v1/door/open
+ *   X-Gate-Line: p1 | p2 | all
+ *   X-Gate-Time: 1700000000123         unix time in ms
+ *   X-Gate-Mac:  <64 hex digit>        HMAC-SHA256(lan_key, "open:<line>:<time>")
+ *
+ * The key is made on the board with Telegram `/chiave_lan`. A request is
+ * accepted only within LAN_DOOR_WINDOW_MS of the board clock (SNTP) and
+ * only once: the last LAN_DOOR_REPLAY_CNT MAC are remembered, anything
+ * older than the evicted one is refused. The answer is sent as soon as
+ * the request is queued, tools/lan_door send and time it.
+ *
+ * Without the clock (power cut and no uplink, SNTP never synced) the
+ * answer is `no_clock` with the board session, random at each boot:
+ *
+ *   X-Gate-Session: <16 hex digit>     from the answer
+ *   X-Gate-Mac:     HMAC-SHA256(lan_key, "open:<line>:<time>:<session>")
+ *
+ * With a session the time is a nonce, accepted only above the last one
+ * (as the UDP door): the board clock is not needed. Another session get
+ * `bad_session` and the current one, the sender retry with it.
+ */
+
+#define LAN_DOOR_WINDOW_MS      30000
+#define LAN_DOOR_REPLAY_CNT     16
+#define LAN_DOOR_MAC_SZ         32
+#define LAN_DOOR_SESSION_SZ     8
+/* Before this the clock was never set, 2023-01-01 */
+#define LAN_DOOR_EPOCH_MIN      1672531200
+
+/*
+ * Check the MAC of `msg` and its time, an accepted request can't be used
+ * again. `session` from X-Gate-Session or NULL: then the clock is needed
+ */
+enum DoorResult lan_door_check(const char *msg, int64_t time_ms, const char *mac_hex, const char *session);
+/* Time taken does not depend on where the first difference is */
+bool lan_door_mac_equal(const uint8_t *a, const uint8_t *b, size_t len);
+void lan_door_get_stats(struct DoorStats_st *st);
+
+esp_err_t lan_door_open_handler(httpd_req_t *req);
+
+#endif
@@ -0,0 +1,211 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "cJSON.h"
+#include "config.h"
+#include "wifi_config.h"
+#include "link_monitor.h"
+
+static const char *TAG = "link-mon";
+
+/* Distinct disconnect reasons kept, the rest go in `other` */
+#define REASON_SLOT_CNT     12
+
+/*
+ * Bucket i count values below edge[i], the last one values from the last
+ * edge up. Edges are fixed: histograms of two devices can be summed.
+ */
+struct Histogram_st {
+    const char *name;
+    const int32_t *edge;
+    uint8_t edge_cnt;
+    uint32_t *cnt;          /* edge_cnt + 1 */
+    uint32_t n;
+    int32_t min, max, last;
+};
+
+#define HISTOGRAM(_name, ...) \
+    static const int32_t _name##_edge[] = { __VA_ARGS__ }; \
+    static uint32_t _name##_cnt[ARRAY_SIZE(_name##_edge) + 1]; \
+    static struct Histogram_st _name = { \
+        .name = #_name, \
+        .edge = _name##_edge, \
+        .edge_cnt = ARRAY_SIZE(_name##_edge), \
+        .cnt = _name##_cnt, \
+    }
+
+/* dBm */
+HISTOGRAM(rssi, -85, -80, -75, -70, -67, -60, -50);
+/* ms */
+HISTOGRAM(connect, 500, 1000, 2000, 3000, 5000, 10000, 20000);
+HISTOGRAM(outage, 1000, 3000, 10000, 30000, 60000, 300000, 1800000);
+HISTOGRAM(cloud, 250, 500, 1000, 2000, 5000, 10000, 30000);
+
+struct ReasonCnt_st {
+    uint8_t reason;
+    uint32_t cnt;
+};
+
+static SemaphoreHandle_t lock;
+static struct ReasonCnt_st reason_cnt[REASON_SLOT_CNT];
+static uint32_t reason_other;
+static uint32_t disconnect_cnt;
+static uint32_t cloud_err;
+
+static void hist_add(struct Histogram_st *h, int32_t v)
+{
+    int i;
+
+    for(i = 0; i < h->edge_cnt && v >= h->edge[i]; i++)
+        ;
+
+    h->cnt[i]++;
+    if(h->n == 0 || v < h->min)
+        h->min = v;
+    if(h->n == 0 || v > h->max)
+        h->max = v;
+    h->last = v;
+    h->n++;
+}
+
+static void hist_add_locked(struct Histogram_st *h, int32_t v)
+{
+    if(lock == NULL)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    hist_add(h, v);
+    xSemaphoreGive(lock);
+}
+
+static void hist_add_json(cJSON *root, const struct Histogram_st *h)
+{
+    cJSON *obj, *buckets, *b;
+    int i;
+
+    obj = cJSON_AddObjectToObject(root, h->name);
+    cJSON_AddNumberToObject(obj, "n", h->n);
+    if(h->n) {
+        cJSON_AddNumberToObject(obj, "min", h->min);
+        cJSON_AddNumberToObject(obj, "max", h->max);
+        cJSON_AddNumberToObject(obj, "last", h->last);
+    }
+
+    buckets = cJSON_AddArrayToObject(obj, "buckets");
+    for(i = 0; i <= h->edge_cnt; i++) {
+        b = cJSON_CreateObject();
+        if(i < h->edge_cnt)
+            cJSON_AddNumberToObject(b, "lt", h->edge[i]);
+        else
+            cJSON_AddNumberToObject(b, "ge", h->edge[i - 1]);
+        cJSON_AddNumberToObject(b, "n", h->cnt[i]);
+        cJSON_AddItemToArray(buckets, b);
+    }
+}
+
+static void link_monitor_task(void *arg)
+{
+    wifi_ap_record_t ap;
+
+    for(;;) {
+        vTaskDelay(pdMS_TO_TICKS(LINK_MONITOR_SAMPLE_MS));
+
+        if(!(xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT))
+            continue;
+
+        if(esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+            hist_add_locked(&rssi, ap.rssi);
+    }
+}
+
+void link_monitor_init(void)
+{
+    lock = xSemaphoreCreateMutex();
+    xTaskCreate(link_monitor_task, "link-mon", 2048, NULL, 2, NULL);
+}
+
+void link_monitor_disconnect(uint8_t reason)
+{
+    int i;
+
+    if(lock == NULL)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    disconnect_cnt++;
+    for(i = 0; i < REASON_SLOT_CNT; i++) {
+        if(reason_cnt[i].cnt == 0)
+            reason_cnt[i].reason = reason;
+
+        if(reason_cnt[i].reason == reason) {
+            reason_cnt[i].cnt++;
+            break;
+        }
+    }
+
+    if(i == REASON_SLOT_CNT)
+        reason_other++;
+
+    xSemaphoreGive(lock);
+}
+
+void link_monitor_connect_time(uint32_t ms)
+{
+    hist_add_locked(&connect, ms);
+}
+
+void link_monitor_outage(uint32_t ms)
+{
+    hist_add_locked(&outage, ms);
+}
+
+void link_monitor_cloud_rtt(uint32_t ms, bool ok)
+{
+    if(lock == NULL)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if(ok)
+        hist_add(&cloud, ms);
+    else
+        cloud_err++;
+    xSemaphoreGive(lock);
+
+    if(!ok)
+        ESP_LOGD(TAG, "Cloud request failed after %lu ms", ms);
+}
+
+void link_monitor_add_json(struct cJSON *root)
+{
+    cJSON *link, *reasons, *r;
+    int i;
+
+    if(lock == NULL)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    link = cJSON_AddObjectToObject(root, "link");
+    cJSON_AddNumberToObject(link, "sample_ms", LINK_MONITOR_SAMPLE_MS);
+    hist_add_json(link, &rssi);
+    hist_add_json(link, &connect);
+    hist_add_json(link, &outage);
+    hist_add_json(link, &cloud);
+    cJSON_AddNumberToObject(link, "cloud_errors", cloud_err);
+
+    cJSON_AddNumberToObject(link, "disconnects", disconnect_cnt);
+    reasons = cJSON_AddArrayToObject(link, "reasons");
+    for(i = 0; i < REASON_SLOT_CNT && reason_cnt[i].cnt; i++) {
+        r = cJSON_CreateObject();
+        cJSON_AddNumberToObject(r, "reason", reason_cnt[i].reason);
+        cJSON_AddNumberToObject(r, "n", reason_cnt[i].cnt);
+        cJSON_AddItemToArray(reasons, r);
+    }
+    cJSON_AddNumberToObject(link, "reasons_other", reason_other);
+
+    xSemaphoreGive(lock);
+}
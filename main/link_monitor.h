@@ -0,0 +1,32 @@
+#ifndef _LINK_MONITOR_H_
+#define _LINK_MONITOR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Wi-Fi link quality monitor
+ *
+ * RSSI is sampled in background while the station is connected, disconnect
+ * reasons and reconnect times are pushed by wifi_config.c, Telegram round
+ * trip by telegram.c. Everything is kept in fixed bucket histograms in RAM,
+ * since boot, and served on /api/v1/system/link.
+ */
+
+#define LINK_MONITOR_SAMPLE_MS  5000
+
+void link_monitor_init(void);
+
+/* Station lost the AP, any reason except our own disconnect */
+void link_monitor_disconnect(uint8_t reason);
+/* esp_wifi_connect() to IP */
+void link_monitor_connect_time(uint32_t ms);
+/* First disconnect to IP again */
+void link_monitor_outage(uint32_t ms);
+/* One HTTPS request to the bot API, `ok` false on transport error */
+void link_monitor_cloud_rtt(uint32_t ms, bool ok);
+
+struct cJSON;
+void link_monitor_add_json(struct cJSON *root);
+
+#endif
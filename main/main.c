@@ -10,34 +10,56 @@
 
 #include "wifi_config.h"
 #include "config.h"
+#include "boot_profile.h"
+#include "power_policy.h"
 
 #define EXAMPLE_MDNS_INSTANCE CONFIG_MDNS_INSTANCE
 static const char *TAG = "mdns-test";
 
+/*
+ * Wi-Fi bring up and recovery run here for the whole uptime, out of
+ * app_main so the power driver and the button are usable meanwhile.
+ */
+static void network_task(void *arg)
+{
+    bool provisioning;
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+
+    /* Last boot ended in recovery AP: keep it up from the start */
+    provisioning = power_up_get_mode() == STARTUP_MODE__AP;
+    ESP_LOGI(TAG,"Start in %s MODE", provisioning ? "AP" : "STA");
+
+    wifi_connectivity_run(provisioning);
+}
+
 void app_main(void)
 {
-    esp_err_t err = nvs_flash_init();
+    esp_err_t err;
+
+    boot_profile_mark(BOOT_PHASE_APP_MAIN);
+
+    err = nvs_flash_init();
     if (err != ESP_OK) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         err = nvs_flash_init();
     }
     ESP_ERROR_CHECK(err);
+    boot_profile_mark(BOOT_PHASE_NVS_INIT);
+    boot_profile_init();
 
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    /* All configuration is read once here, then served from RAM */
+    app_config_load();
 
     power_up_init();
+    boot_profile_mark(BOOT_PHASE_POWER_UP_INIT);
 
-    switch (power_up_get_mode()) {
-    case STARTUP_MODE__STA:
-        ESP_LOGI(TAG,"Start in STA MODE");
-        wifi_init_sta();
-        break;
-    case STARTUP_MODE__AP:
-        ESP_LOGI(TAG,"Start in AP MODE");
-        wifi_init_softap();
-        break;
-    }
+    /* Clock and sleep policy from configuration, Wi-Fi power save is applied once it start */
+    power_policy_init();
 
+    /* Gate control first: it need only GPIO and the configuration cache */
     power_driver_init();
+
+    xTaskCreate(network_task, "net-start", 4096, NULL, 5, NULL);
 }
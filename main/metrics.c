@@ -0,0 +1,282 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_wifi.h"
+#include "config.h"
+#include "metrics.h"
+#include "door_result.h"
+#include "lan_door.h"
+#include "gate_mqtt.h"
+#include "gate_udp.h"
+#include "tls_mem.h"
+
+static const char *TAG = "metrics";
+
+#define METRICS_CHUNK_SZ    1024
+/* Room for task created while the snapshot is taken */
+#define METRICS_TASK_EXTRA  4
+
+struct MetricsOut_st {
+    httpd_req_t *req;
+    char *buf;
+    size_t len;
+    esp_err_t err;
+};
+
+static void out_flush(struct MetricsOut_st *o)
+{
+    if(o->len && o->err == ESP_OK)
+        o->err = httpd_resp_send_chunk(o->req, o->buf, o->len);
+    o->len = 0;
+}
+
+static void out_printf(struct MetricsOut_st *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if(o->err != ESP_OK)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(&o->buf[o->len], METRICS_CHUNK_SZ - o->len, fmt, ap);
+    va_end(ap);
+
+    if(n >= 0 && o->len + n < METRICS_CHUNK_SZ) {
+        o->len += n;
+        return;
+    }
+
+    /* Did not fit: send what we have and write the line again at the start */
+    out_flush(o);
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf, METRICS_CHUNK_SZ, fmt, ap);
+    va_end(ap);
+    o->len = n < METRICS_CHUNK_SZ ? n : METRICS_CHUNK_SZ - 1;
+}
+
+static void out_head(struct MetricsOut_st *o, const char *name, const char *type, const char *help)
+{
+    out_printf(o, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", name, help, name, type);
+}
+
+static void out_value(struct MetricsOut_st *o, const char *name, const char *type, const char *help, uint64_t v)
+{
+    out_head(o, name, type, help);
+    out_printf(o, METRICS_PREFIX "%s %llu\n", name, v);
+}
+
+static void metrics_system(struct MetricsOut_st *o)
+{
+    wifi_ap_record_t ap;
+
+    out_value(o, "uptime_seconds", "gauge", "Time since boot", esp_timer_get_time() / 1000000);
+    out_value(o, "heap_free_bytes", "gauge", "Free heap", esp_get_free_heap_size());
+    out_value(o, "heap_min_free_bytes", "gauge", "Lowest free heap since boot", esp_get_minimum_free_heap_size());
+    out_value(o, "heap_largest_block_bytes", "gauge", "Largest allocatable block",
+                    heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+    if(esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        out_head(o, "wifi_rssi_dbm", "gauge", "RSSI of the AP in use");
+        out_printf(o, METRICS_PREFIX "wifi_rssi_dbm %d\n", ap.rssi);
+    }
+}
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+static void metrics_tasks(struct MetricsOut_st *o)
+{
+    TaskStatus_t *tasks;
+    UBaseType_t cnt, i;
+    uint32_t total_rt = 0;
+
+    cnt = uxTaskGetNumberOfTasks() + METRICS_TASK_EXTRA;
+    tasks = malloc(cnt * sizeof(*tasks));
+    if(tasks == NULL) {
+        ESP_LOGW(TAG, "No memory for %u task", cnt);
+        return;
+    }
+
+    cnt = uxTaskGetSystemState(tasks, cnt, &total_rt);
+
+    out_value(o, "tasks", "gauge", "FreeRTOS task count", cnt);
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    /* 32 bit microsecond counter: wrap every ~71 minutes, seen as a counter reset */
+    out_head(o, "task_cpu_seconds_total", "counter", "CPU time of the task, FreeRTOS run time stats");
+    for(i = 0; i < cnt; i++)
+        out_printf(o, METRICS_PREFIX "task_cpu_seconds_total{task=\"%s\"} %lu.%06lu\n",
+                        tasks[i].pcTaskName, tasks[i].ulRunTimeCounter / 1000000,
+                        tasks[i].ulRunTimeCounter % 1000000);
+#endif
+
+    out_head(o, "task_stack_free_min_bytes", "gauge", "Stack high-water mark, lowest free stack since start");
+    for(i = 0; i < cnt; i++)
+        out_printf(o, METRICS_PREFIX "task_stack_free_min_bytes{task=\"%s\"} %lu\n",
+                        tasks[i].pcTaskName, (uint32_t)tasks[i].usStackHighWaterMark);
+
+    free(tasks);
+}
+#endif
+
+static void metrics_queues(struct MetricsOut_st *o)
+{
+    struct TelegramStats_st tg;
+
+    telegram_get_stats(&tg);
+
+    out_head(o, "queue_depth", "gauge", "Item waiting in the queue");
+    out_printf(o, METRICS_PREFIX "queue_depth{queue=\"cmd_queue\"} %lu\n", tg.cmd_queue);
+    out_printf(o, METRICS_PREFIX "queue_depth{queue=\"tx_msg_queue\"} %lu\n", tg.tx_msg_queue);
+    out_printf(o, METRICS_PREFIX "queue_depth{queue=\"gpio_evt_queue\"} %lu\n", power_driver_queue_depth());
+
+    out_value(o, "telegram_polls_total", "counter", "getUpdates request", tg.polls);
+    out_value(o, "telegram_poll_errors_total", "counter", "getUpdates failed or not 200", tg.poll_err);
+    out_value(o, "telegram_sent_total", "counter", "sendMessage request", tg.sent);
+    out_value(o, "telegram_send_errors_total", "counter", "sendMessage failed or not 200", tg.send_err);
+    out_value(o, "telegram_commands_total", "counter", "Command executed", tg.commands);
+}
+
+static void out_seconds(struct MetricsOut_st *o, const char *name, const char *label, uint64_t us)
+{
+    out_printf(o, METRICS_PREFIX "%s{%s} %llu.%06llu\n", name, label, us / 1000000, us % 1000000);
+}
+
+/* Door command by result, then the worst handler time if `max_name` */
+static void out_door(struct MetricsOut_st *o, const char *name, const char *help,
+                     const char *max_name, const char *max_help, const struct DoorStats_st *st)
+{
+    int i;
+
+    out_head(o, name, "counter", help);
+    for(i = 0; i < DOOR_RESULT_CNT; i++)
+        out_printf(o, METRICS_PREFIX "%s{result=\"%s\"} %lu\n", name, door_result_name(i), st->result[i]);
+
+    if(max_name == NULL)
+        return;
+    out_head(o, max_name, "gauge", max_help);
+    out_printf(o, METRICS_PREFIX "%s %lu.%06lu\n", max_name,
+                    st->handler_max_us / 1000000, st->handler_max_us % 1000000);
+}
+
+/* Actuation latency for each source, LAN door open requests */
+static void metrics_door(struct MetricsOut_st *o)
+{
+    struct PowerSourceStats_st st[POWER_SRC_CNT];
+    struct DoorStats_st lan;
+    char label[32];
+    int i;
+
+    for(i = 0; i < POWER_SRC_CNT; i++)
+        power_driver_get_stats(i, &st[i]);
+
+    out_head(o, "actuation_latency_seconds", "summary", "Request to first edge on the power line, queue wait included");
+    for(i = 0; i < POWER_SRC_CNT; i++) {
+        snprintf(label, sizeof(label), "source=\"%s\"", power_source_name(i));
+        out_seconds(o, "actuation_latency_seconds_sum", label, st[i].lat_sum_us);
+        out_printf(o, METRICS_PREFIX "actuation_latency_seconds_count{%s} %lu\n", label, st[i].cnt);
+    }
+
+    out_head(o, "actuation_latency_max_seconds", "gauge", "Worst request to first edge since boot");
+    for(i = 0; i < POWER_SRC_CNT; i++) {
+        snprintf(label, sizeof(label), "source=\"%s\"", power_source_name(i));
+        out_seconds(o, "actuation_latency_max_seconds", label, st[i].lat_max_us);
+    }
+
+    lan_door_get_stats(&lan);
+
+    out_door(o, "lan_door_requests_total", "LAN door open request by result",
+                "lan_door_handler_max_seconds", "Worst LAN door open handler time since boot, request to answer sent", &lan);
+}
+
+static void metrics_mqtt(struct MetricsOut_st *o)
+{
+    struct GateMqttStats_st st;
+
+    gate_mqtt_get_stats(&st);
+
+    out_value(o, "mqtt_connected", "gauge", "Connected to the broker", st.connected);
+    out_value(o, "mqtt_connects_total", "counter", "Connection accepted by the broker", st.connects);
+    out_value(o, "mqtt_published_total", "counter", "Message given to the client, QoS 1", st.published);
+    out_value(o, "mqtt_dropped_total", "counter", "Message dropped, queue or outbox full", st.dropped);
+
+    out_door(o, "mqtt_commands_total", "Open command by result", NULL, NULL, &st.cmd);
+}
+
+static void metrics_udp(struct MetricsOut_st *o)
+{
+    struct GateUdpStats_st st;
+
+    gate_udp_get_stats(&st);
+
+    out_door(o, "udp_frames_total", "UDP door open frame by result, ping included",
+                "udp_handler_max_seconds", "Worst UDP frame time since boot, received to answer sent", &st.frame);
+    out_value(o, "udp_pings_total", "counter", "UDP ping answered", st.ping);
+}
+
+/* mbedtls heap: rx/tx are the Telegram sessions */
+static void metrics_tls(struct MetricsOut_st *o)
+{
+    struct TlsMemStats_st st[TLS_MEM_SESSION_CNT];
+    const char *name;
+    int i;
+
+    for(i = 0; i < TLS_MEM_SESSION_CNT; i++)
+        tls_mem_get_stats(i, &st[i]);
+
+    out_head(o, "tls_heap_bytes", "gauge", "mbedtls heap now, last session peak and steady, peak since boot");
+    for(i = 0; i < TLS_MEM_SESSION_CNT; i++) {
+        name = tls_mem_session_name(i);
+        out_printf(o, METRICS_PREFIX "tls_heap_bytes{session=\"%s\",kind=\"current\"} %lu\n", name, st[i].cur);
+        out_printf(o, METRICS_PREFIX "tls_heap_bytes{session=\"%s\",kind=\"peak\"} %lu\n", name, st[i].peak);
+        out_printf(o, METRICS_PREFIX "tls_heap_bytes{session=\"%s\",kind=\"steady\"} %lu\n", name, st[i].steady);
+        out_printf(o, METRICS_PREFIX "tls_heap_bytes{session=\"%s\",kind=\"peak_max\"} %lu\n", name, st[i].peak_max);
+    }
+
+    out_head(o, "tls_heap_freed_bytes", "gauge", "Last session peak minus steady, given back after the handshake");
+    for(i = 0; i < TLS_MEM_SESSION_CNT; i++)
+        out_printf(o, METRICS_PREFIX "tls_heap_freed_bytes{session=\"%s\"} %lu\n", tls_mem_session_name(i),
+                        st[i].peak > st[i].steady ? st[i].peak - st[i].steady : 0);
+
+    out_head(o, "tls_sessions_total", "counter", "TLS session closed");
+    for(i = 0; i < TLS_MEM_SESSION_CNT; i++)
+        out_printf(o, METRICS_PREFIX "tls_sessions_total{session=\"%s\"} %lu\n", tls_mem_session_name(i), st[i].sessions);
+}
+
+esp_err_t metrics_get_handler(httpd_req_t *req)
+{
+    struct MetricsOut_st o = { .req = req };
+
+    o.buf = malloc(METRICS_CHUNK_SZ);
+    if(o.buf == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    metrics_system(&o);
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    metrics_tasks(&o);
+#endif
+    metrics_queues(&o);
+    metrics_door(&o);
+    metrics_mqtt(&o);
+    metrics_udp(&o);
+    metrics_tls(&o);
+
+    out_flush(&o);
+    free(o.buf);
+
+    /* Empty chunk end the response */
+    if(o.err == ESP_OK)
+        o.err = httpd_resp_send_chunk(req, NULL, 0);
+
+    return o.err;
+}
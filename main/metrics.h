@@ -0,0 +1,18 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "esp_http_server.h"
+
+/*
+ * GET /metrics, Prometheus text format
+ *
+ * Heap, FreeRTOS task run time and stack high-water mark, queue depths
+ * and Telegram counters. Written with httpd_resp_send_chunk() while it's
+ * generated through a small buffer, nothing is built in memory.
+ */
+
+#define METRICS_PREFIX  "gate_"
+
+esp_err_t metrics_get_handler(httpd_req_t *req);
+
+#endif
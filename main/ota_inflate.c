@@ -0,0 +1,215 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "ota_inflate.h"
+
+static const char *TAG = "inflate";
+
+enum InflateState {
+    HS_HDR,
+    HS_TAG,
+    HS_LITERAL,
+    HS_INDEX,
+    HS_COUNT,
+    HS_COPY,
+    HS_DONE,
+};
+
+struct OtaInflate_st {
+    enum InflateState state;
+    esp_err_t err;
+
+    uint8_t hdr[OTA_INFLATE_HDR_SZ];
+    size_t hdr_fill;
+
+    uint8_t window_sz2;
+    uint8_t lookahead_sz2;
+    size_t size;
+    size_t produced;
+
+    /* Bit reader, MSB first */
+    uint32_t acc;
+    uint8_t acc_bits;
+
+    /* Last 2^window_sz2 byte of output */
+    uint8_t *window;
+    uint16_t mask;
+    uint16_t head;
+
+    uint16_t index;
+    uint16_t count;
+};
+
+bool ota_inflate_is_compressed(const uint8_t *data, size_t len)
+{
+    return len >= 4 && memcmp(data, OTA_INFLATE_MAGIC, 4) == 0;
+}
+
+esp_err_t ota_inflate_begin(struct OtaInflate_st **inflate)
+{
+    struct OtaInflate_st *z;
+
+    z = calloc(1, sizeof(*z));
+    if(z == NULL)
+        return ESP_ERR_NO_MEM;
+
+    z->state = HS_HDR;
+    *inflate = z;
+
+    return ESP_OK;
+}
+
+static esp_err_t header_parse(struct OtaInflate_st *z)
+{
+    const uint8_t *h = z->hdr;
+
+    if(!ota_inflate_is_compressed(h, 4) || h[4] != OTA_INFLATE_VERSION) {
+        ESP_LOGE(TAG, "Unknown stream version");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    z->window_sz2 = h[5];
+    z->lookahead_sz2 = h[6];
+    z->size = h[8] | (h[9] << 8) | (h[10] << 16) | ((uint32_t)h[11] << 24);
+
+    if(z->window_sz2 < 4 || z->window_sz2 > OTA_INFLATE_MAX_WINDOW_SZ2 ||
+       z->lookahead_sz2 < 3 || z->lookahead_sz2 >= z->window_sz2) {
+        ESP_LOGE(TAG, "Window 2^%u lookahead 2^%u not supported", z->window_sz2, z->lookahead_sz2);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    /* Zeroed: a back-reference before the start read zeros, as the encoder */
+    z->window = calloc(1, 1 << z->window_sz2);
+    if(z->window == NULL)
+        return ESP_ERR_NO_MEM;
+    z->mask = (1 << z->window_sz2) - 1;
+
+    ESP_LOGI(TAG, "Heatshrink w%u l%u, %u byte", z->window_sz2, z->lookahead_sz2, z->size);
+
+    return ESP_OK;
+}
+
+/* `n` bit from the stream, false if more input is needed */
+static bool get_bits(struct OtaInflate_st *z, uint8_t n, const uint8_t **in, size_t *in_len, uint16_t *v)
+{
+    while(z->acc_bits < n) {
+        if(*in_len == 0)
+            return false;
+        z->acc = (z->acc << 8) | **in;
+        z->acc_bits += 8;
+        (*in)++;
+        (*in_len)--;
+    }
+
+    z->acc_bits -= n;
+    *v = (z->acc >> z->acc_bits) & ((1 << n) - 1);
+
+    return true;
+}
+
+static void emit(struct OtaInflate_st *z, uint8_t c, uint8_t *out)
+{
+    z->window[z->head++ & z->mask] = c;
+    *out = c;
+    z->produced++;
+}
+
+size_t ota_inflate_run(struct OtaInflate_st *z, const uint8_t *in, size_t in_len, size_t *used,
+                       uint8_t *out, size_t out_sz)
+{
+    const uint8_t *start = in;
+    size_t n = 0, k;
+    uint16_t v;
+
+    while(z->err == ESP_OK && n < out_sz && z->state != HS_DONE) {
+        if(z->state == HS_HDR) {
+            if(in_len == 0)
+                break;
+            k = OTA_INFLATE_HDR_SZ - z->hdr_fill;
+            if(k > in_len)
+                k = in_len;
+            memcpy(&z->hdr[z->hdr_fill], in, k);
+            z->hdr_fill += k;
+            in += k;
+            in_len -= k;
+
+            if(z->hdr_fill == OTA_INFLATE_HDR_SZ) {
+                z->err = header_parse(z);
+                z->state = z->size ? HS_TAG : HS_DONE;
+            }
+            continue;
+        }
+
+        if(z->state == HS_COPY) {
+            while(z->count && n < out_sz && z->produced < z->size) {
+                emit(z, z->window[(z->head - z->index) & z->mask], &out[n++]);
+                z->count--;
+            }
+
+            if(z->produced == z->size)
+                z->state = HS_DONE;
+            else if(z->count == 0)
+                z->state = HS_TAG;
+            continue;
+        }
+
+        /* Padding bit after the last byte are never read */
+        switch(z->state) {
+        case HS_TAG:
+            if(!get_bits(z, 1, &in, &in_len, &v))
+                goto out;
+            z->state = v ? HS_LITERAL : HS_INDEX;
+            break;
+
+        case HS_LITERAL:
+            if(!get_bits(z, 8, &in, &in_len, &v))
+                goto out;
+            emit(z, v, &out[n++]);
+            z->state = z->produced == z->size ? HS_DONE : HS_TAG;
+            break;
+
+        case HS_INDEX:
+            if(!get_bits(z, z->window_sz2, &in, &in_len, &v))
+                goto out;
+            z->index = v + 1;
+            z->state = HS_COUNT;
+            break;
+
+        case HS_COUNT:
+            if(!get_bits(z, z->lookahead_sz2, &in, &in_len, &v))
+                goto out;
+            z->count = v + 1;
+            z->state = HS_COPY;
+            break;
+
+        default:
+            z->err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+    }
+
+out:
+    *used = in - start;
+    return n;
+}
+
+esp_err_t ota_inflate_error(const struct OtaInflate_st *z)
+{
+    return z->err;
+}
+
+size_t ota_inflate_size(const struct OtaInflate_st *z)
+{
+    return z->size;
+}
+
+bool ota_inflate_done(const struct OtaInflate_st *z)
+{
+    return z->state == HS_DONE;
+}
+
+void ota_inflate_end(struct OtaInflate_st *z)
+{
+    free(z->window);
+    free(z);
+}
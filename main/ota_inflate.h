@@ -0,0 +1,49 @@
+#ifndef _OTA_INFLATE_H_
+#define _OTA_INFLATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/*
+ * Compressed OTA body: heatshrink (LZSS) stream behind a small header,
+ * made by tools/ota_compress. Decoded with a window of 2^window_sz2 byte
+ * (at most OTA_INFLATE_MAX_WINDOW_SZ2), so RAM use is fixed whatever the
+ * image size. The payload is a full image or a delta patch.
+ *
+ *   header  "GHSZ" u8 version u8 window_sz2 u8 lookahead_sz2 u8 flags
+ *           u32 size (little endian, decompressed byte)
+ */
+
+#define OTA_INFLATE_MAGIC           "GHSZ"
+#define OTA_INFLATE_VERSION         1
+#define OTA_INFLATE_HDR_SZ          12
+#define OTA_INFLATE_MAX_WINDOW_SZ2  12
+
+struct OtaInflate_st;
+
+esp_err_t ota_inflate_begin(struct OtaInflate_st **inflate);
+
+/*
+ * Decompress from `in` into `out`, stop when `out` is full or `in` is
+ * consumed. `*used` get the input byte consumed, return the byte produced.
+ * Check ota_inflate_error() when nothing is produced.
+ */
+size_t ota_inflate_run(struct OtaInflate_st *z, const uint8_t *in, size_t in_len, size_t *used,
+                       uint8_t *out, size_t out_sz);
+
+esp_err_t ota_inflate_error(const struct OtaInflate_st *z);
+
+/* Decompressed size from the header, 0 until the header is parsed */
+size_t ota_inflate_size(const struct OtaInflate_st *z);
+
+/* True once all the `size` byte were produced */
+bool ota_inflate_done(const struct OtaInflate_st *z);
+
+void ota_inflate_end(struct OtaInflate_st *z);
+
+/* True if the first 4 byte of a body are a compressed stream */
+bool ota_inflate_is_compressed(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,487 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "cJSON.h"
+#include "config.h"
+#include "wifi_config.h"
+#include "http_body.h"
+#include "ota_update.h"
+#include "ota_pull.h"
+
+static const char *TAG = "ota-pull";
+
+#define OTA_PULL_STACK          6144
+#define OTA_PULL_PRIO           4       /* Below httpd and Telegram */
+#define OTA_PULL_TIMEOUT_MS     10000
+#define OTA_PULL_MANIFEST_SZ    1024
+#define OTA_PULL_VERSION_SZ     32
+#define OTA_PULL_URL_SZ         256
+#define OTA_PULL_RANGE_SZ       64
+/* Attempts in a row without a single new byte, then the update is dropped */
+#define OTA_PULL_RETRY_MAX      6
+#define OTA_PULL_RETRY_MS       2000
+
+enum OtaPullState {
+    OTA_PULL_IDLE,
+    OTA_PULL_CHECKING,
+    OTA_PULL_DOWNLOADING,
+    OTA_PULL_UP_TO_DATE,
+    OTA_PULL_DONE,
+    OTA_PULL_FAILED,
+};
+
+static const char *state_name[] = {
+    [OTA_PULL_IDLE] = "idle",
+    [OTA_PULL_CHECKING] = "checking",
+    [OTA_PULL_DOWNLOADING] = "downloading",
+    [OTA_PULL_UP_TO_DATE] = "up_to_date",
+    [OTA_PULL_DONE] = "done",
+    [OTA_PULL_FAILED] = "failed",
+};
+
+struct OtaManifest_st {
+    char version[OTA_PULL_VERSION_SZ];
+    char url[OTA_PULL_URL_SZ];
+    size_t size;
+    uint8_t sha256[OTA_SHA256_SZ];
+};
+
+/* Download in progress, survive reconnections */
+struct OtaPull_st {
+    const struct OtaManifest_st *m;
+    struct OtaSession_st *ota;
+    uint8_t *buff;                  /* Session buffer being filled */
+    size_t fill;
+    size_t offset;                  /* Image byte received, all in order */
+    bool fatal;                     /* Writer failed, no point to retry */
+};
+
+static TaskHandle_t s_task;
+static SemaphoreHandle_t lock;
+
+/* Last check, served on /api/v1/system/info */
+static struct {
+    enum OtaPullState state;
+    int64_t check_us;
+    char version[OTA_PULL_VERSION_SZ];
+    size_t offset;
+    size_t size;
+    uint32_t resumes;
+    esp_err_t err;
+} s_stat;
+
+static uint8_t s_running_sha[OTA_SHA256_SZ];
+static size_t s_running_len;
+static bool s_running_sha_valid;
+
+static void stat_set(enum OtaPullState state, esp_err_t err)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    s_stat.state = state;
+    s_stat.err = err;
+    xSemaphoreGive(lock);
+}
+
+/* Keep Content-Range of the answer, `user_data` is a OTA_PULL_RANGE_SZ buffer */
+static esp_err_t client_event(esp_http_client_event_t *evt)
+{
+    if(evt->event_id == HTTP_EVENT_ON_HEADER && evt->user_data &&
+       strcasecmp(evt->header_key, "Content-Range") == 0)
+        strlcpy(evt->user_data, evt->header_value, OTA_PULL_RANGE_SZ);
+
+    return ESP_OK;
+}
+
+/* `content_range` (optional) get the header of the answer */
+static esp_http_client_handle_t client_open(const char *url, const char *range, char *content_range)
+{
+    esp_http_client_config_t config;
+    esp_http_client_handle_t client;
+    esp_err_t err;
+
+    memset(&config, 0, sizeof(config));
+    config.url = url;
+    config.timeout_ms = OTA_PULL_TIMEOUT_MS;
+    config.event_handler = client_event;
+    config.user_data = content_range;
+    if(content_range)
+        content_range[0] = '\0';
+    /* LAN server is plain HTTP, the image digest is what is trusted */
+    if(strncmp(url, "https://", 8) == 0)
+        config.crt_bundle_attach = esp_crt_bundle_attach;
+
+    client = esp_http_client_init(&config);
+    if(client == NULL)
+        return NULL;
+
+    if(range)
+        esp_http_client_set_header(client, "Range", range);
+
+    err = esp_http_client_open(client, 0);
+    if(err != ESP_OK) {
+        ESP_LOGW(TAG, "Connect %s failed:%s", url, esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        return NULL;
+    }
+
+    esp_http_client_fetch_headers(client);
+
+    return client;
+}
+
+static void client_close(esp_http_client_handle_t client)
+{
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+}
+
+/* `image` relative to the manifest URL, as a browser would */
+static bool url_resolve(const char *base, const char *image, char *out, size_t sz)
+{
+    const char *host, *p;
+    int n;
+
+    if(strstr(image, "://"))
+        return snprintf(out, sz, "%s", image) < sz;
+
+    host = strstr(base, "://");
+    if(host == NULL)
+        return false;
+    host += 3;
+
+    if(image[0] == '/') {
+        p = strchr(host, '/');
+        n = p ? p - base : strlen(base);
+    } else {
+        p = strrchr(host, '/');
+        n = p ? p - base + 1 : strlen(base);
+        if(p == NULL)
+            return snprintf(out, sz, "%s/%s", base, image) < sz;
+    }
+
+    return snprintf(out, sz, "%.*s%s", n, base, image) < sz;
+}
+
+static esp_err_t manifest_fetch(const char *url, struct OtaManifest_st *m)
+{
+    esp_http_client_handle_t client;
+    cJSON *root = NULL;
+    const char *version, *image, *sha;
+    double size;
+    char *body;
+    int len = 0, n, status;
+    esp_err_t err = ESP_ERR_INVALID_RESPONSE;
+
+    body = malloc(OTA_PULL_MANIFEST_SZ);
+    if(body == NULL)
+        return ESP_ERR_NO_MEM;
+
+    client = client_open(url, NULL, NULL);
+    if(client == NULL) {
+        free(body);
+        return ESP_FAIL;
+    }
+
+    status = esp_http_client_get_status_code(client);
+    if(status != 200) {
+        ESP_LOGE(TAG, "Manifest %s status:%d", url, status);
+        goto exit;
+    }
+
+    while(len < OTA_PULL_MANIFEST_SZ - 1) {
+        n = esp_http_client_read(client, &body[len], OTA_PULL_MANIFEST_SZ - 1 - len);
+        if(n <= 0)
+            break;
+        len += n;
+    }
+    body[len] = '\0';
+
+    root = cJSON_Parse(body);
+    version = cJSON_GetStringValue(cJSON_GetObjectItem(root, "version"));
+    image = cJSON_GetStringValue(cJSON_GetObjectItem(root, "image"));
+    sha = cJSON_GetStringValue(cJSON_GetObjectItem(root, "sha256"));
+    size = cJSON_GetNumberValue(cJSON_GetObjectItem(root, "size"));
+
+    /* Size and digest are mandatory: Range need the first, trust the second */
+    if(version == NULL || image == NULL || !hex_to_bin(sha, m->sha256, OTA_SHA256_SZ) || !(size > 0)) {
+        ESP_LOGE(TAG, "Manifest not valid, need version, image, size, sha256");
+        goto exit;
+    }
+
+    if(!url_resolve(url, image, m->url, sizeof(m->url))) {
+        ESP_LOGE(TAG, "Image URL too long");
+        goto exit;
+    }
+
+    strlcpy(m->version, version, sizeof(m->version));
+    m->size = size;
+    err = ESP_OK;
+
+exit:
+    cJSON_Delete(root);
+    client_close(client);
+    free(body);
+
+    return err;
+}
+
+/* One GET from `p->offset` to the end of the image or the first error */
+static esp_err_t image_get(struct OtaPull_st *p)
+{
+    esp_http_client_handle_t client;
+    char range[32], *rng = NULL;
+    char content_range[OTA_PULL_RANGE_SZ];
+    unsigned long start;
+    size_t skip = 0, want;
+    esp_err_t err = ESP_OK;
+    int status, n;
+
+    if(p->offset) {
+        snprintf(range, sizeof(range), "bytes=%u-", p->offset);
+        rng = range;
+    }
+
+    client = client_open(p->m->url, rng, content_range);
+    if(client == NULL)
+        return ESP_FAIL;
+
+    status = esp_http_client_get_status_code(client);
+    if(status == 200 && p->offset) {
+        /* Server without Range support: read again what we already have */
+        ESP_LOGW(TAG, "Range ignored by server, skip %u byte", p->offset);
+        skip = p->offset;
+    } else if(status == 206 &&
+              (sscanf(content_range, "bytes %lu-", &start) != 1 || start > p->offset)) {
+        /* Data of another place would go in the image, digest fail only at the end */
+        ESP_LOGE(TAG, "Asked from %u, answer Content-Range:`%s`", p->offset, content_range);
+        p->fatal = true;
+        client_close(client);
+        return ESP_ERR_INVALID_RESPONSE;
+    } else if(status == 206 && start < p->offset) {
+        ESP_LOGW(TAG, "Range from %lu, asked %u: skip %lu byte", start, p->offset, p->offset - start);
+        skip = p->offset - start;
+    } else if(status != 206 && status != 200) {
+        ESP_LOGE(TAG, "Image %s status:%d", p->m->url, status);
+        /* Missing or changed image won't come back retrying */
+        p->fatal = status >= 400 && status < 500;
+        client_close(client);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    while(p->offset < p->m->size) {
+        if(p->buff == NULL) {
+            p->buff = ota_session_get_buffer(p->ota);
+            p->fill = 0;
+            if(p->buff == NULL) {
+                p->fatal = true;
+                err = ESP_FAIL;
+                break;
+            }
+        }
+
+        want = OTA_BUF_SZ - p->fill;
+        if(want > p->m->size - p->offset)
+            want = p->m->size - p->offset;
+        /* Byte to skip land in the free part of the buffer, then overwritten */
+        if(skip && want > skip)
+            want = skip;
+
+        n = esp_http_client_read(client, (char *)&p->buff[p->fill], want);
+        if(n <= 0) {
+            ESP_LOGW(TAG, "Connection lost at %u of %u byte", p->offset, p->m->size);
+            err = ESP_FAIL;
+            break;
+        }
+
+        if(skip) {
+            skip -= n;
+            continue;
+        }
+
+        p->fill += n;
+        p->offset += n;
+
+        if(p->fill == OTA_BUF_SZ || p->offset == p->m->size) {
+            err = ota_session_push(p->ota, p->fill);
+            p->buff = NULL;
+            if(err != ESP_OK) {
+                p->fatal = true;
+                break;
+            }
+        }
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        s_stat.offset = p->offset;
+        xSemaphoreGive(lock);
+    }
+
+    client_close(client);
+
+    return err;
+}
+
+static esp_err_t image_download(const struct OtaManifest_st *m)
+{
+    struct OtaPull_st p = { .m = m };
+    size_t last;
+    int fails = 0;
+    esp_err_t err;
+
+    err = ota_session_begin(&p.ota, m->size, m->sha256);
+    if(err != ESP_OK)
+        return err;
+
+    for(;;) {
+        last = p.offset;
+        err = image_get(&p);
+        if(err == ESP_OK || p.fatal)
+            break;
+
+        /* Any progress reset the retry count, a slow link is not a dead one */
+        fails = p.offset > last ? 0 : fails + 1;
+        if(fails >= OTA_PULL_RETRY_MAX)
+            break;
+
+        vTaskDelay(pdMS_TO_TICKS(OTA_PULL_RETRY_MS * (fails + 1)));
+        xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        s_stat.resumes++;
+        xSemaphoreGive(lock);
+        ESP_LOGI(TAG, "Resume from %u byte", p.offset);
+    }
+
+    if(err != ESP_OK) {
+        ota_session_abort(p.ota);
+        return err;
+    }
+
+    /* Size, digest and image checksum */
+    return ota_session_end(p.ota, NULL);
+}
+
+static void ota_pull_check(const char *url)
+{
+    struct OtaManifest_st *m;
+    char hex[OTA_SHA256_SZ * 2 + 1];
+    esp_err_t err;
+
+    m = calloc(1, sizeof(*m));
+    if(m == NULL)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    s_stat.state = OTA_PULL_CHECKING;
+    s_stat.check_us = esp_timer_get_time();
+    xSemaphoreGive(lock);
+
+    err = manifest_fetch(url, m);
+    if(err != ESP_OK) {
+        stat_set(OTA_PULL_FAILED, err);
+        free(m);
+        return;
+    }
+
+    /* Digest of the image actually running, the version string can lie. Same definition of the manifest */
+    if(!s_running_sha_valid)
+        s_running_sha_valid = ota_running_image_sha256(&s_running_len, s_running_sha) == ESP_OK;
+
+    if(s_running_sha_valid && s_running_len == m->size && memcmp(s_running_sha, m->sha256, OTA_SHA256_SZ) == 0) {
+        ESP_LOGI(TAG, "Up to date, version %s", esp_app_get_description()->version);
+        stat_set(OTA_PULL_UP_TO_DATE, ESP_OK);
+        free(m);
+        return;
+    }
+
+    ota_sha256_to_hex(m->sha256, hex);
+    ESP_LOGI(TAG, "Update %s -> %s, %u byte sha256:%s from %s",
+                    esp_app_get_description()->version, m->version, m->size, hex, m->url);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    s_stat.state = OTA_PULL_DOWNLOADING;
+    strlcpy(s_stat.version, m->version, sizeof(s_stat.version));
+    s_stat.size = m->size;
+    s_stat.offset = 0;
+    s_stat.resumes = 0;
+    xSemaphoreGive(lock);
+
+    err = image_download(m);
+    free(m);
+
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Update failed:%s", esp_err_to_name(err));
+        stat_set(OTA_PULL_FAILED, err);
+        return;
+    }
+
+    stat_set(OTA_PULL_DONE, ESP_OK);
+    ESP_LOGI(TAG, "Update done, restart");
+    xTaskCreate(wait_and_restart_task, "Restart", 1024, NULL, 10, NULL);
+}
+
+static void ota_pull_task(void *arg)
+{
+    char url[APP_CFG_URL_SZ];
+
+    for(;;) {
+        xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+
+        strlcpy(url, app_config_get()->ota_url, sizeof(url));
+        if(url[0])
+            ota_pull_check(url);
+
+        /* Period or on demand, whichever come first */
+        ulTaskNotifyTake(pdTRUE, (TickType_t)OTA_PULL_PERIOD_S * configTICK_RATE_HZ);
+    }
+}
+
+void ota_pull_init(void)
+{
+    if(s_task)
+        return;
+
+    lock = xSemaphoreCreateMutex();
+    xTaskCreate(ota_pull_task, "ota-pull", OTA_PULL_STACK, NULL, OTA_PULL_PRIO, &s_task);
+}
+
+bool ota_pull_check_now(void)
+{
+    if(s_task == NULL || app_config_get()->ota_url[0] == '\0')
+        return false;
+
+    xTaskNotifyGive(s_task);
+    return true;
+}
+
+void ota_pull_add_json(cJSON *root)
+{
+    cJSON *o = cJSON_AddObjectToObject(root, "ota");
+
+    cJSON_AddStringToObject(o, "url", app_config_get()->ota_url);
+    if(lock == NULL)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    cJSON_AddStringToObject(o, "state", state_name[s_stat.state]);
+    if(s_stat.check_us)
+        cJSON_AddNumberToObject(o, "last_check_s", (esp_timer_get_time() - s_stat.check_us) / 1000000);
+    if(s_stat.size) {
+        cJSON_AddStringToObject(o, "version", s_stat.version);
+        cJSON_AddNumberToObject(o, "offset", s_stat.offset);
+        cJSON_AddNumberToObject(o, "size", s_stat.size);
+        cJSON_AddNumberToObject(o, "resumes", s_stat.resumes);
+    }
+    if(s_stat.err != ESP_OK)
+        cJSON_AddStringToObject(o, "error", esp_err_to_name(s_stat.err));
+    xSemaphoreGive(lock);
+}
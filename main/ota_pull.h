@@ -0,0 +1,33 @@
+#ifndef _OTA_PULL_H_
+#define _OTA_PULL_H_
+
+#include <stdbool.h>
+
+/*
+ * Pull OTA from a LAN update server
+ *
+ * The manifest at `ota_url` (configuration) is checked after the first
+ * connection, every OTA_PULL_PERIOD_S and on demand. It's a small JSON:
+ *
+ *   {"version": "1.4", "image": "Apri-cancello.bin", "size": 912384,
+ *    "sha256": "<64 hex digit>"}
+ *
+ * `image` is absolute or relative to the manifest URL. When the digest
+ * differ from the running image, the image is downloaded with HTTP Range
+ * requests: a dropped connection resume from the last byte received,
+ * the image is then verified, marked bootable and the board restart.
+ * tools/ota_server serve a directory this way.
+ */
+
+#define OTA_PULL_PERIOD_S   (6 * 3600)
+
+void ota_pull_init(void);
+
+/* Start a check now, false if no server is configured */
+bool ota_pull_check_now(void);
+
+/* Add `ota` state of the last check to `root` */
+struct cJSON;
+void ota_pull_add_json(struct cJSON *root);
+
+#endif
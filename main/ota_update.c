@@ -0,0 +1,374 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_image_format.h"
+#include "mbedtls/sha256.h"
+#include "ota_update.h"
+#include "gate_mdns.h"
+
+static const char *TAG = "ota";
+
+#define OTA_WRITER_STACK    4096
+#define OTA_WRITER_PRIO     6       /* Above httpd: flash must not starve */
+#define OTA_READ_BUF_SZ     4096
+
+struct OtaBuf_st {
+    uint8_t *data;
+    size_t len;                     /* 0: end of stream */
+};
+
+struct OtaSession_st {
+    const esp_partition_t *part;
+    esp_ota_handle_t handle;
+    size_t image_sz;
+
+    struct OtaBuf_st buf[OTA_BUF_CNT];
+    struct OtaBuf_st *cur;          /* Owned by the transport */
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    SemaphoreHandle_t done;
+
+    mbedtls_sha256_context sha;
+    uint8_t sha_expect[OTA_SHA256_SZ];
+    bool sha_check;
+
+    volatile esp_err_t err;         /* First writer error */
+    size_t written;
+
+    int64_t start_us;
+    int64_t wait_free_us;           /* Transport blocked on flash */
+    int64_t wait_data_us;           /* Flash idle waiting transport */
+    int64_t flash_us;
+};
+
+/* Only one update at a time: push upload and pull client can race */
+static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool ota_running;
+
+static bool ota_try_start(void)
+{
+    bool ok;
+
+    portENTER_CRITICAL(&ota_lock);
+    ok = !ota_running;
+    ota_running = true;
+    portEXIT_CRITICAL(&ota_lock);
+
+    if(ok)
+        gate_mdns_set_state(GATE_MDNS_OTA, true);
+
+    return ok;
+}
+
+static void ota_release(void)
+{
+    portENTER_CRITICAL(&ota_lock);
+    ota_running = false;
+    portEXIT_CRITICAL(&ota_lock);
+
+    gate_mdns_set_state(GATE_MDNS_OTA, false);
+}
+
+static void ota_writer_task(void *arg)
+{
+    struct OtaSession_st *s = arg;
+    struct OtaBuf_st *b;
+    int64_t t;
+
+    for(;;) {
+        t = esp_timer_get_time();
+        xQueueReceive(s->full_q, &b, portMAX_DELAY);
+        s->wait_data_us += esp_timer_get_time() - t;
+
+        if(b == NULL)
+            break;
+
+        /* After an error keep draining, the transport must never block */
+        if(s->err == ESP_OK) {
+            t = esp_timer_get_time();
+            mbedtls_sha256_update(&s->sha, b->data, b->len);
+            s->err = esp_ota_write(s->handle, b->data, b->len);
+            s->flash_us += esp_timer_get_time() - t;
+
+            if(s->err == ESP_OK)
+                s->written += b->len;
+            else
+                ESP_LOGE(TAG, "Write at %u failed:%s", s->written, esp_err_to_name(s->err));
+        }
+
+        xQueueSend(s->free_q, &b, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(s->done);
+    vTaskDelete(NULL);
+}
+
+static void ota_session_free(struct OtaSession_st *s)
+{
+    int i;
+
+    for(i = 0; i < OTA_BUF_CNT; i++)
+        free(s->buf[i].data);
+
+    if(s->free_q)
+        vQueueDelete(s->free_q);
+    if(s->full_q)
+        vQueueDelete(s->full_q);
+    if(s->done)
+        vSemaphoreDelete(s->done);
+
+    mbedtls_sha256_free(&s->sha);
+    free(s);
+
+    ota_release();
+}
+
+esp_err_t ota_session_begin(struct OtaSession_st **session, size_t image_sz, const uint8_t *sha256)
+{
+    struct OtaSession_st *s;
+    struct OtaBuf_st *b;
+    esp_err_t err;
+    int i;
+
+    if(!ota_try_start())
+        return ESP_ERR_INVALID_STATE;
+
+    s = calloc(1, sizeof(*s));
+    if(s == NULL) {
+        ota_release();
+        return ESP_ERR_NO_MEM;
+    }
+
+    mbedtls_sha256_init(&s->sha);
+    mbedtls_sha256_starts(&s->sha, 0);
+    if(sha256) {
+        memcpy(s->sha_expect, sha256, OTA_SHA256_SZ);
+        s->sha_check = true;
+    }
+
+    s->image_sz = image_sz;
+    s->free_q = xQueueCreate(OTA_BUF_CNT, sizeof(struct OtaBuf_st*));
+    s->full_q = xQueueCreate(OTA_BUF_CNT + 1, sizeof(struct OtaBuf_st*));
+    s->done = xSemaphoreCreateBinary();
+    if(s->free_q == NULL || s->full_q == NULL || s->done == NULL) {
+        ota_session_free(s);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for(i = 0; i < OTA_BUF_CNT; i++) {
+        b = &s->buf[i];
+        b->data = malloc(OTA_BUF_SZ);
+        if(b->data == NULL) {
+            ota_session_free(s);
+            return ESP_ERR_NO_MEM;
+        }
+        xQueueSend(s->free_q, &b, 0);
+    }
+
+    s->part = esp_ota_get_next_update_partition(NULL);
+    if(s->part == NULL) {
+        ota_session_free(s);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if(image_sz > s->part->size) {
+        ESP_LOGE(TAG, "Image %u byte, partition %s only %lu", image_sz, s->part->label, s->part->size);
+        ota_session_free(s);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    /* Erase sector by sector while writing, not the whole partition up front */
+    err = esp_ota_begin(s->part, OTA_WITH_SEQUENTIAL_WRITES, &s->handle);
+    if(err != ESP_OK) {
+        ota_session_free(s);
+        return err;
+    }
+
+    if(xTaskCreate(ota_writer_task, "ota-writer", OTA_WRITER_STACK, s, OTA_WRITER_PRIO, NULL) != pdPASS) {
+        esp_ota_abort(s->handle);
+        ota_session_free(s);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Update %s, %u byte%s", s->part->label, image_sz, s->sha_check ? ", SHA-256 check" : "");
+    s->start_us = esp_timer_get_time();
+    *session = s;
+
+    return ESP_OK;
+}
+
+uint8_t *ota_session_get_buffer(struct OtaSession_st *s)
+{
+    int64_t t;
+
+    if(s->cur == NULL) {
+        t = esp_timer_get_time();
+        xQueueReceive(s->free_q, &s->cur, portMAX_DELAY);
+        s->wait_free_us += esp_timer_get_time() - t;
+    }
+
+    if(s->err != ESP_OK)
+        return NULL;
+
+    return s->cur->data;
+}
+
+esp_err_t ota_session_push(struct OtaSession_st *s, size_t len)
+{
+    if(s->cur == NULL || len > OTA_BUF_SZ)
+        return ESP_ERR_INVALID_STATE;
+
+    if(len) {
+        s->cur->len = len;
+        xQueueSend(s->full_q, &s->cur, portMAX_DELAY);
+        s->cur = NULL;
+    }
+
+    return s->err;
+}
+
+/* Stop the writer and wait for it */
+static void ota_session_flush(struct OtaSession_st *s)
+{
+    struct OtaBuf_st *end = NULL;
+
+    xQueueSend(s->full_q, &end, portMAX_DELAY);
+    xSemaphoreTake(s->done, portMAX_DELAY);
+}
+
+static void ota_session_log(struct OtaSession_st *s)
+{
+    int64_t total_us = esp_timer_get_time() - s->start_us;
+
+    if(total_us <= 0)
+        total_us = 1;
+
+    ESP_LOGI(TAG, "%u byte in %lld ms, %lld KB/s; flash busy %lld ms, transport wait flash %lld ms, flash wait transport %lld ms",
+                    s->written, total_us / 1000, (int64_t)s->written * 1000000 / 1024 / total_us,
+                    s->flash_us / 1000, s->wait_free_us / 1000, s->wait_data_us / 1000);
+}
+
+esp_err_t ota_session_end(struct OtaSession_st *s, uint8_t *sha256_out)
+{
+    uint8_t sha[OTA_SHA256_SZ];
+    char hex[OTA_SHA256_SZ * 2 + 1];
+    esp_err_t err;
+
+    ota_session_flush(s);
+    ota_session_log(s);
+
+    err = s->err;
+    if(err != ESP_OK) {
+        esp_ota_abort(s->handle);
+        goto exit;
+    }
+
+    mbedtls_sha256_finish(&s->sha, sha);
+    ota_sha256_to_hex(sha, hex);
+    ESP_LOGI(TAG, "Image SHA-256 %s", hex);
+    if(sha256_out)
+        memcpy(sha256_out, sha, OTA_SHA256_SZ);
+
+    if(s->image_sz && s->written != s->image_sz) {
+        ESP_LOGE(TAG, "Image truncated %u of %u byte", s->written, s->image_sz);
+        esp_ota_abort(s->handle);
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+
+    if(s->sha_check && memcmp(sha, s->sha_expect, OTA_SHA256_SZ) != 0) {
+        ESP_LOGE(TAG, "SHA-256 mismatch, image discarded");
+        esp_ota_abort(s->handle);
+        err = ESP_ERR_INVALID_CRC;
+        goto exit;
+    }
+
+    /* Check image header and the checksum appended by esptool */
+    err = esp_ota_end(s->handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Image not valid:%s", esp_err_to_name(err));
+        goto exit;
+    }
+
+    err = esp_ota_set_boot_partition(s->part);
+    if(err == ESP_OK)
+        ESP_LOGI(TAG, "Next boot from %s", s->part->label);
+
+exit:
+    ota_session_free(s);
+    return err;
+}
+
+void ota_session_abort(struct OtaSession_st *s)
+{
+    ota_session_flush(s);
+    ota_session_log(s);
+    esp_ota_abort(s->handle);
+    ESP_LOGW(TAG, "Update aborted");
+    ota_session_free(s);
+}
+
+esp_err_t ota_partition_sha256(const esp_partition_t *part, size_t len, uint8_t *sha256)
+{
+    mbedtls_sha256_context ctx;
+    esp_err_t err = ESP_OK;
+    uint8_t *buf;
+    size_t pos, n;
+
+    if(len > part->size)
+        return ESP_ERR_INVALID_SIZE;
+
+    buf = malloc(OTA_READ_BUF_SZ);
+    if(buf == NULL)
+        return ESP_ERR_NO_MEM;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    for(pos = 0; pos < len && err == ESP_OK; pos += n) {
+        n = len - pos;
+        if(n > OTA_READ_BUF_SZ)
+            n = OTA_READ_BUF_SZ;
+
+        err = esp_partition_read(part, pos, buf, n);
+        mbedtls_sha256_update(&ctx, buf, n);
+    }
+    mbedtls_sha256_finish(&ctx, sha256);
+    mbedtls_sha256_free(&ctx);
+    free(buf);
+
+    return err;
+}
+
+esp_err_t ota_running_image_sha256(size_t *len, uint8_t *sha256)
+{
+    const esp_partition_t *part = esp_ota_get_running_partition();
+    esp_partition_pos_t pos = {
+        .offset = part->address,
+        .size = part->size,
+    };
+    esp_image_metadata_t meta;
+    esp_err_t err;
+
+    /* Header, segments, checksum padding and appended digest */
+    err = esp_image_get_metadata(&pos, &meta);
+    if(err != ESP_OK)
+        return err;
+
+    *len = meta.image_len;
+    return ota_partition_sha256(part, meta.image_len, sha256);
+}
+
+void ota_sha256_to_hex(const uint8_t *sha256, char *hex)
+{
+    int i;
+
+    for(i = 0; i < OTA_SHA256_SZ; i++)
+        sprintf(&hex[i * 2], "%02x", sha256[i]);
+}
@@ -0,0 +1,59 @@
+#ifndef _OTA_UPDATE_H_
+#define _OTA_UPDATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+/*
+ * Pipelined OTA writer
+ *
+ * The transport (HTTP upload, pull client, ...) fills one buffer while a
+ * writer task hashes and writes the previous one to flash, so receive and
+ * flash erase/write overlap. The image is checked against the expected
+ * SHA-256 before it's marked bootable.
+ *
+ *   ota_session_begin()
+ *   loop: buf = ota_session_get_buffer(); fill it; ota_session_push(len)
+ *   ota_session_end() or ota_session_abort()
+ */
+
+#define OTA_BUF_SZ      (8 * 1024)
+#define OTA_BUF_CNT     2
+#define OTA_SHA256_SZ   32
+
+struct OtaSession_st;
+
+/* `image_sz` only for progress, can be 0. `sha256` NULL: no check */
+esp_err_t ota_session_begin(struct OtaSession_st **session, size_t image_sz, const uint8_t *sha256);
+
+/* Wait a free buffer of OTA_BUF_SZ byte, NULL if the writer failed */
+uint8_t *ota_session_get_buffer(struct OtaSession_st *s);
+
+/* Hand the buffer of last ota_session_get_buffer() to the writer */
+esp_err_t ota_session_push(struct OtaSession_st *s, size_t len);
+
+/*
+ * Flush, validate the image and the digest, set the boot partition.
+ * `sha256_out` (optional) get the digest of the written image.
+ * Session is freed in any case.
+ */
+esp_err_t ota_session_end(struct OtaSession_st *s, uint8_t *sha256_out);
+void ota_session_abort(struct OtaSession_st *s);
+
+/* SHA-256 of the first `len` byte of `part` */
+esp_err_t ota_partition_sha256(const esp_partition_t *part, size_t len, uint8_t *sha256);
+
+/*
+ * Length of the running image on flash and its SHA-256, the same of
+ * sha256sum of the .bin. Not esp_partition_get_sha256(): that is the
+ * digest appended to the image, it does not cover its own 32 byte.
+ */
+esp_err_t ota_running_image_sha256(size_t *len, uint8_t *sha256);
+
+/* 64 hex digit and NUL, parsed back with hex_to_bin() of http_body.h */
+void ota_sha256_to_hex(const uint8_t *sha256, char *hex);
+
+#endif
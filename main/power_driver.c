@@ -7,14 +7,17 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "driver/gpio.h"
+#include "esp_sleep.h"
 #include "esp_log.h"
-#include "nvs.h"
+#include "esp_timer.h"
 #include "config.h"
+#include "boot_profile.h"
+#include "power_policy.h"
+#include "event_bus.h"
+#include "gate_mdns.h"
 
 static const char TAG[]="POW-DRV";
 
-#define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
-
 #define GPIO_POWER_P1   26
 #define GPIO_POWER_P2   27
 #define GPIO_OUTPUT_PIN_SEL     ((1ULL<<GPIO_POWER_P1) | (1ULL<<GPIO_POWER_P2))
@@ -23,6 +26,16 @@ static const char TAG[]="POW-DRV";
 #define GPIO_INPUT_PIN_SEL      (1ULL<<GPIO_INPUT_SW2)
 
 #define ESP_INTR_FLAG_DEFAULT 0
+/* Button released poll, also the debounce time */
+#define SW2_RELEASE_POLL_MS 50
+
+/*
+ * Task stack, byte. Deepest path is the actuation: event_bus_publish (event
+ * format, MQTT message copy, httpd_queue_work), mDNS TXT update and ESP_LOG
+ * vprintf. Free space is checked after each actuation.
+ */
+#define POWER_TASK_STACK        4096
+#define POWER_TASK_STACK_MIN    512
 
 #define TIME_DEFAULT 175
 #define CYCLE_DEFAULT 5
@@ -37,49 +50,153 @@ struct PowerLine_st {
     char name[8];
 };
 
+/* Item of `gpio_evt_queue` */
+struct PowerRequest_st {
+    struct PowerLine_st *p;
+    int64_t t_us;           /* When it was asked, for the latency */
+    enum PowerSource src;
+};
+
 static QueueHandle_t gpio_evt_queue = NULL;
 static struct PowerLine_st *p1, *p2;
 struct PowerLine_st *pl_arr[2];
+static volatile bool sw2_masked;
+
+static struct PowerSourceStats_st src_stats[POWER_SRC_CNT];
+static portMUX_TYPE src_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *power_source_names[POWER_SRC_CNT] = {
+    [POWER_SRC_BUTTON]      = "button",
+    [POWER_SRC_TELEGRAM]    = "telegram",
+    [POWER_SRC_LAN]         = "lan",
+    [POWER_SRC_MQTT]        = "mqtt",
+    [POWER_SRC_UDP]         = "udp",
+};
 
+/*
+ * Low level interrupt, the only one able to wake up from light sleep: mask
+ * it at first call, power_task enable it again once the button is released.
+ * Contact bounce is filtered in the same way.
+ */
 static void IRAM_ATTR gpio_isr_handler(void* arg)
 {
-    xQueueSendFromISR(gpio_evt_queue, &p1, NULL);
-    xQueueSendFromISR(gpio_evt_queue, &p2, NULL);
+    struct PowerRequest_st req = {
+        .t_us = esp_timer_get_time(),
+        .src = POWER_SRC_BUTTON,
+    };
+
+    gpio_intr_disable(GPIO_INPUT_SW2);
+    sw2_masked = true;
+
+    req.p = p1;
+    xQueueSendFromISR(gpio_evt_queue, &req, NULL);
+    req.p = p2;
+    xQueueSendFromISR(gpio_evt_queue, &req, NULL);
 }
 
-void drive_door_open(enum PowerLine pl)
+uint32_t power_driver_queue_depth(void)
 {
-    ESP_LOGI(TAG, "Enqued new door open request for pl[%d]", pl);
+    return gpio_evt_queue ? uxQueueMessagesWaiting(gpio_evt_queue) : 0;
+}
 
-    xQueueSend(gpio_evt_queue, &pl_arr[pl], portMAX_DELAY);
+const char* power_source_name(enum PowerSource src)
+{
+    return src < POWER_SRC_CNT ? power_source_names[src] : "unknown";
+}
+
+void power_driver_get_stats(enum PowerSource src, struct PowerSourceStats_st *st)
+{
+    portENTER_CRITICAL(&src_stats_lock);
+    *st = src_stats[src];
+    portEXIT_CRITICAL(&src_stats_lock);
+}
+
+static void source_stats_add(const struct PowerRequest_st *req)
+{
+    int64_t lat = esp_timer_get_time() - req->t_us;
+    struct PowerSourceStats_st *st = &src_stats[req->src];
+
+    portENTER_CRITICAL(&src_stats_lock);
+    st->cnt++;
+    st->lat_sum_us += lat;
+    if(lat > st->lat_max_us)
+        st->lat_max_us = lat;
+    portEXIT_CRITICAL(&src_stats_lock);
+}
+
+static BaseType_t door_request(enum PowerLine pl, enum PowerSource src, TickType_t wait)
+{
+    struct PowerRequest_st req = {
+        .p = pl_arr[pl],
+        .t_us = esp_timer_get_time(),
+        .src = src,
+    };
+
+    ESP_LOGI(TAG, "Enqued new door open request for pl[%d] from %s", pl, power_source_name(src));
+
+    return xQueueSend(gpio_evt_queue, &req, wait);
+}
+
+void drive_door_open(enum PowerLine pl, enum PowerSource src)
+{
+    door_request(pl, src, portMAX_DELAY);
+}
+
+esp_err_t drive_door_open_nowait(enum PowerLine pl, enum PowerSource src)
+{
+    return door_request(pl, src, 0) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
 }
 
-static void drive_door_open_run(struct PowerLine_st *p)
+static void drive_door_open_run(const struct PowerRequest_st *req)
 {
+    struct PowerLine_st *p = req->p;
+    static bool first = true;
+    TickType_t edge;
+    int64_t start;
     int cnt;
 
-    ESP_LOGI(TAG, "Drive door IO:%ld, level-now:%d", p->io_num, gpio_get_level(p->io_num));
+    start = esp_timer_get_time();
 
     /* Door open command */
     for(cnt = 0; cnt < p->cycle_cnt; cnt++) {
         gpio_set_level(p->io_num, 1);
+        edge = xTaskGetTickCount();
+        /* Latency is up to the first edge, before any log. Event and state (rings, mDNS lock, MQTT queue) after it */
+        if(cnt == 0) {
+            source_stats_add(req);
+            /* Policy lock, esp_pm and esp_wifi_set_ps: the pulse is timed from the edge, sleep can't stretch it */
+            power_policy_command();
+            power_policy_set_actuating(true);
+            if(first) {
+                first = false;
+                boot_profile_mark(BOOT_PHASE_FIRST_ACTUATION);
+                ESP_LOGI(TAG, "First actuation %lld ms after reset", esp_timer_get_time() / 1000);
+            }
+            ESP_LOGI(TAG, "Drive door IO:%ld, cycles:%lu", p->io_num, p->cycle_cnt);
+            event_bus_publish("gate", "\"line\":\"%s\",\"state\":\"start\",\"cycles\":%lu,\"src\":\"%s\"",
+                                p->name, p->cycle_cnt, power_source_name(req->src));
+            gate_mdns_set_state(GATE_MDNS_OPENING, true);
+        }
         ESP_LOGD(TAG, "Drive door IO:%ld Drive:1", p->io_num);
-        vTaskDelay(pdMS_TO_TICKS(p->up_time_ms));
+        /* Up time from the edge, the work above don't make the pulse longer */
+        vTaskDelayUntil(&edge, pdMS_TO_TICKS(p->up_time_ms));
 
         ESP_LOGD(TAG, "Drive door IO:%ld Drive:0", p->io_num);
         gpio_set_level(p->io_num, 0);
         vTaskDelay(pdMS_TO_TICKS(p->down_time_ms));
     }
 
+    event_bus_publish("gate", "\"line\":\"%s\",\"state\":\"stop\",\"ms\":%lld",
+                        p->name, (esp_timer_get_time() - start) / 1000);
+
     vTaskDelay(200);
 }
 
 esp_err_t PowerLine_ConfigSetParams(char *name, uint32_t down_time_ms, uint32_t up_time_ms, uint32_t cycle_count, char**err_txt)
 {
+    struct PowerLineConfig_t cfg;
     struct PowerLine_st *p = NULL;
-    nvs_handle_t hdl;
     esp_err_t err;
-    char key[64];
     int i;
 
     for(i = 0; i < ARRAY_SIZE(pl_arr); i++) {
@@ -106,91 +223,107 @@ esp_err_t PowerLine_ConfigSetParams(char *name, uint32_t down_time_ms, uint32_t
         return ESP_ERR_NOT_FOUND;
     }
 
-    err = nvs_open(NVS_NAME, NVS_READWRITE, &hdl);
-    if(err != ESP_OK) {
-        asprintf(err_txt, "Impossibile aprire NVS");
-        return err;
-    }
-
-    snprintf(key, sizeof(key), "%s%s", NVS_POWER_LINE_DOWN_TIME__KEY, name);
-    err = nvs_set_u32(hdl, key, down_time_ms);
-    if(err != ESP_OK) {
-        p->down_time_ms = TIME_DEFAULT;
-        asprintf(err_txt, "Impossibile scrivere DownTime");
-        goto close_and_exit;
-    }
+    cfg.down_time_ms = down_time_ms;
+    cfg.up_time_ms = up_time_ms;
+    cfg.cycle_cnt = cycle_count;
 
-    snprintf(key, sizeof(key), "%s%s", NVS_POWER_LINE_UP_TIME__KEY, name);
-    err = nvs_set_u32(hdl, key, up_time_ms);
+    app_config_set_power_line((enum PowerLine) i, &cfg);
+    err = app_config_commit();
     if(err != ESP_OK) {
-        p->up_time_ms = TIME_DEFAULT;
-        asprintf(err_txt, "Impossibile scrivere UpTime");
-        goto close_and_exit;
+        asprintf(err_txt, "Impossibile salvare la configurazione");
+        return err;
     }
 
-    snprintf(key, sizeof(key), "%s%s", NVS_POWER_LINE_COUNT, name);
-    err = nvs_set_u32(hdl, key, cycle_count);
-    if(err != ESP_OK) {
-        p->cycle_cnt = CYCLE_DEFAULT;
-        asprintf(err_txt, "Impossibile scrivere Cycle");
-        goto close_and_exit;
-    }
+    p->down_time_ms = down_time_ms;
+    p->up_time_ms = up_time_ms;
     p->cycle_cnt = cycle_count;
 
     *err_txt=NULL;
 
-close_and_exit:
-    nvs_close(hdl);
-    return err;
+    return ESP_OK;
 }
 
-static struct PowerLine_st* PowerLine_init(uint32_t io_num, char *name)
+static struct PowerLine_st* PowerLine_init(enum PowerLine pl, uint32_t io_num, char *name)
 {
+    const struct AppConfig_t *cfg = app_config_get();
+    const struct PowerLineConfig_t *c = &cfg->power_line[pl];
     struct PowerLine_st *p;
-    nvs_handle_t hdl;
-    esp_err_t err;
-    char key[64];
 
     p = malloc(sizeof(struct PowerLine_st));
     p->io_num = io_num;
     strcpy(p->name, name);
 
-    err = nvs_open(NVS_NAME, NVS_READONLY, &hdl);
-    ESP_ERROR_CHECK_WITHOUT_ABORT(err);
-
-    snprintf(key, sizeof(key), "%s%s", NVS_POWER_LINE_DOWN_TIME__KEY, name);
-    err = nvs_get_u32(hdl, key, &p->down_time_ms);
-    if(err != ESP_OK) {
+    if(cfg->valid & APP_CFG_PL_DOWN(pl)) {
+        p->down_time_ms = c->down_time_ms;
+    } else {
         p->down_time_ms = TIME_DEFAULT;
         ESP_LOGW(TAG, "Time down %s set to default:%d", p->name, TIME_DEFAULT);
     }
 
-    snprintf(key, sizeof(key), "%s%s", NVS_POWER_LINE_UP_TIME__KEY, name);
-    err = nvs_get_u32(hdl, key, &p->up_time_ms);
-    if(err != ESP_OK) {
+    if(cfg->valid & APP_CFG_PL_UP(pl)) {
+        p->up_time_ms = c->up_time_ms;
+    } else {
         p->up_time_ms = TIME_DEFAULT;
         ESP_LOGW(TAG, "Time up %s set to default:%d", p->name, TIME_DEFAULT);
     }
 
-    snprintf(key, sizeof(key), "%s%s", NVS_POWER_LINE_COUNT, name);
-    err = nvs_get_u32(hdl, key, &p->cycle_cnt);
-    if(err != ESP_OK) {
+    if(cfg->valid & APP_CFG_PL_CYCLE(pl)) {
+        p->cycle_cnt = c->cycle_cnt;
+    } else {
         p->cycle_cnt = CYCLE_DEFAULT;
         ESP_LOGW(TAG, "Cycle %s set to default:%d", p->name, CYCLE_DEFAULT);
     }
 
-    nvs_close(hdl);
-
     return p;
 }
 
+/* Log when the free stack reach a new minimum, warn under POWER_TASK_STACK_MIN */
+static void stack_check(void)
+{
+    static UBaseType_t low = POWER_TASK_STACK;
+    UBaseType_t left = uxTaskGetStackHighWaterMark(NULL);
+
+    if(left >= low)
+        return;
+    low = left;
+
+    if(left < POWER_TASK_STACK_MIN)
+        ESP_LOGW(TAG, "Stack free %u of %d byte", left, POWER_TASK_STACK);
+    else
+        ESP_LOGD(TAG, "Stack free %u of %d byte", left, POWER_TASK_STACK);
+}
+
 static void power_task(void* arg)
 {
-    struct PowerLine_st *p;
+    struct PowerRequest_st req;
+    bool sw2_pressed = false;
+    TickType_t wait;
 
     for(;;) {
-        if(xQueueReceive(gpio_evt_queue, &p, portMAX_DELAY)) {
-            drive_door_open_run(p);
+        /* While SW2 is masked poll for its release, a stuck button must not block other requests */
+        wait = sw2_masked ? pdMS_TO_TICKS(SW2_RELEASE_POLL_MS) : portMAX_DELAY;
+
+        if(xQueueReceive(gpio_evt_queue, &req, wait)) {
+            /* The ISR masked itself: the button is the source of this request */
+            if(sw2_masked && !sw2_pressed) {
+                sw2_pressed = true;
+                event_bus_publish("button", "\"state\":\"press\"");
+            }
+
+            drive_door_open_run(&req);
+
+            if(uxQueueMessagesWaiting(gpio_evt_queue) == 0) {
+                power_policy_set_actuating(false);
+                gate_mdns_set_state(GATE_MDNS_OPENING, false);
+            }
+            stack_check();
+        } else if(gpio_get_level(GPIO_INPUT_SW2)) {
+            sw2_masked = false;
+            gpio_intr_enable(GPIO_INPUT_SW2);
+            if(sw2_pressed) {
+                sw2_pressed = false;
+                event_bus_publish("button", "\"state\":\"release\"");
+            }
         }
     }
 }
@@ -206,22 +339,28 @@ void power_driver_init(void)
     io_conf.pull_up_en = 0;
     gpio_config(&io_conf);
 
-    /* Enable interrupt on Sw2 */
-    io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    /* Enable interrupt on Sw2, low level so it wake up from light sleep too */
+    io_conf.intr_type = GPIO_INTR_LOW_LEVEL;
     io_conf.pin_bit_mask = GPIO_INPUT_PIN_SEL;
     io_conf.mode = GPIO_MODE_INPUT;
     io_conf.pull_up_en = 1;
     gpio_config(&io_conf);
+    gpio_wakeup_enable(GPIO_INPUT_SW2, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
 
-    p1 = PowerLine_init(GPIO_POWER_P1, "p1");
-    p2 = PowerLine_init(GPIO_POWER_P2, "p2");
+    p1 = PowerLine_init(POWER_LINE_1, GPIO_POWER_P1, POWER_LINE_1_NAME);
+    p2 = PowerLine_init(POWER_LINE_2, GPIO_POWER_P2, POWER_LINE_2_NAME);
 
     pl_arr[0] = p1;
     pl_arr[1] = p2;
 
-    gpio_evt_queue = xQueueCreate(10, sizeof(struct PowerLine_st*));
-    xTaskCreate(power_task, "power-task", 2048, NULL, 10, NULL);
+    memset(src_stats, 0, sizeof(src_stats));
+    gpio_evt_queue = xQueueCreate(10, sizeof(struct PowerRequest_st));
+    xTaskCreate(power_task, "power-task", POWER_TASK_STACK, NULL, 10, NULL);
 
     gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
     gpio_isr_handler_add(GPIO_INPUT_SW2, gpio_isr_handler, (void*) GPIO_INPUT_SW2);
+
+    boot_profile_mark(BOOT_PHASE_POWER_DRIVER);
+    ESP_LOGI(TAG, "Power driver ready %lld ms after reset", esp_timer_get_time() / 1000);
 }
@@ -0,0 +1,264 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_pm.h"
+#include "esp_wifi.h"
+#include "sdkconfig.h"
+#include "cJSON.h"
+#include "config.h"
+#include "power_policy.h"
+
+static const char *TAG = "power-policy";
+
+/*
+ * Wake latency probe: a task aligned on the tick sleep a known number of
+ * ticks, the extra time is what light sleep (clock switch, flash and PLL
+ * power up) add to every wake up. Stats are kept for each profile.
+ * It run below the power task, a sample that wait for busier tasks count
+ * as late: `min` is the clean wake latency.
+ */
+#define WAKE_PROBE_PERIOD_MS    10000
+#define WAKE_PROBE_TICKS        10
+#define WAKE_PROBE_PRIO         5
+/* DTIM period of most AP: 1 beacon, 102.4 ms */
+#define DTIM_PERIOD_US          102400
+
+struct WakeStat_st {
+    uint32_t n;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+};
+
+static SemaphoreHandle_t policy_lock;
+static struct PowerPolicyInput_st input = {
+    .profile = POWER_PROFILE_BALANCED,
+    .ms_since_cmd = UINT32_MAX,
+};
+static struct PowerPolicyOutput_st current;
+static bool applied;
+static bool wifi_ready;
+static int64_t last_cmd_us;
+static esp_timer_handle_t burst_timer;
+static struct WakeStat_st wake_stat[POWER_PROFILE_CNT];
+
+/* Call with `policy_lock` taken */
+static void policy_apply(void)
+{
+    struct PowerPolicyOutput_st out;
+    int64_t since;
+
+    if(last_cmd_us) {
+        since = (esp_timer_get_time() - last_cmd_us) / 1000;
+        input.ms_since_cmd = (since > UINT32_MAX) ? UINT32_MAX : since;
+    }
+
+    power_policy_decide(&input, &out);
+
+    if(!applied || out.cpu_max_mhz != current.cpu_max_mhz || out.cpu_min_mhz != current.cpu_min_mhz ||
+                   out.light_sleep != current.light_sleep) {
+#if CONFIG_PM_ENABLE
+        esp_pm_config_esp32_t pm = {
+            .max_freq_mhz = out.cpu_max_mhz,
+            .min_freq_mhz = out.cpu_min_mhz,
+            .light_sleep_enable = out.light_sleep,
+        };
+
+        ESP_ERROR_CHECK_WITHOUT_ABORT( esp_pm_configure(&pm) );
+#endif
+    }
+
+    if(wifi_ready && (!applied || out.ps != current.ps))
+        ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_set_ps((wifi_ps_type_t)out.ps) );
+
+    /* Re-evaluate when the burst window close */
+    if(out.burst) {
+        esp_timer_stop(burst_timer);
+        esp_timer_start_once(burst_timer, (uint64_t)(POWER_POLICY_BURST_MS - input.ms_since_cmd) * 1000 + 1000);
+    }
+
+    if(!applied || memcmp(&out, &current, sizeof(out)) != 0)
+        ESP_LOGI(TAG, "%s%s: cpu %u-%u MHz light-sleep:%d ps:%d listen:%u",
+                        power_profile_name(input.profile), out.burst ? " (burst)" : "",
+                        out.cpu_min_mhz, out.cpu_max_mhz, out.light_sleep, out.ps, out.listen_interval);
+
+    current = out;
+    applied = true;
+}
+
+static void policy_update(void)
+{
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+    policy_apply();
+    xSemaphoreGive(policy_lock);
+}
+
+static void burst_timer_cb(void *arg)
+{
+    policy_update();
+}
+
+static void wake_probe_task(void *arg)
+{
+    int64_t start, late;
+    struct WakeStat_st *s;
+
+    for(;;) {
+        vTaskDelay(pdMS_TO_TICKS(WAKE_PROBE_PERIOD_MS));
+
+        /* Start on a tick boundary: the delay below is exactly WAKE_PROBE_TICKS */
+        vTaskDelay(1);
+        start = esp_timer_get_time();
+        vTaskDelay(WAKE_PROBE_TICKS);
+        late = esp_timer_get_time() - start - WAKE_PROBE_TICKS * portTICK_PERIOD_MS * 1000;
+        if(late < 0)
+            late = 0;
+
+        xSemaphoreTake(policy_lock, portMAX_DELAY);
+        s = &wake_stat[input.profile];
+        if(s->n == 0 || late < s->min_us)
+            s->min_us = late;
+        if(late > s->max_us)
+            s->max_us = late;
+        s->sum_us += late;
+        s->n++;
+        xSemaphoreGive(policy_lock);
+
+        ESP_LOGD(TAG, "Wake latency %lld us", late);
+    }
+}
+
+void power_policy_init(void)
+{
+    const struct AppConfig_t *cfg = app_config_get();
+    esp_timer_create_args_t timer_args = {
+        .callback = burst_timer_cb,
+        .name = "power-burst",
+    };
+
+    policy_lock = xSemaphoreCreateMutex();
+    ESP_ERROR_CHECK( esp_timer_create(&timer_args, &burst_timer) );
+
+    if((cfg->valid & APP_CFG_POWER_PROFILE) && cfg->power_profile < POWER_PROFILE_CNT)
+        input.profile = cfg->power_profile;
+
+#if !CONFIG_PM_ENABLE
+    ESP_LOGW(TAG, "CONFIG_PM_ENABLE not set, only Wi-Fi power save is applied");
+#endif
+
+    policy_update();
+    xTaskCreate(wake_probe_task, "wake-probe", 2048, NULL, WAKE_PROBE_PRIO, NULL);
+}
+
+void power_policy_set_profile(enum PowerProfile profile)
+{
+    if(profile >= POWER_PROFILE_CNT)
+        return;
+
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+    input.profile = profile;
+    policy_apply();
+    xSemaphoreGive(policy_lock);
+
+    app_config_set_power_profile(profile);
+    ESP_ERROR_CHECK_WITHOUT_ABORT( app_config_commit() );
+}
+
+enum PowerProfile power_policy_get_profile(void)
+{
+    enum PowerProfile profile;
+
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+    profile = input.profile;
+    xSemaphoreGive(policy_lock);
+
+    return profile;
+}
+
+void power_policy_set_link(bool sta_connected, bool ap_active)
+{
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+    if(!wifi_ready || input.sta_connected != sta_connected || input.ap_active != ap_active) {
+        /* esp_wifi_set_ps() was skipped until now, driver start with MIN_MODEM */
+        if(!wifi_ready && current.ps != POWER_PS_MIN_MODEM)
+            applied = false;
+
+        wifi_ready = true;
+        input.sta_connected = sta_connected;
+        input.ap_active = ap_active;
+        policy_apply();
+    }
+    xSemaphoreGive(policy_lock);
+}
+
+void power_policy_set_actuating(bool actuating)
+{
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+    if(input.actuating != actuating) {
+        input.actuating = actuating;
+        policy_apply();
+    }
+    xSemaphoreGive(policy_lock);
+}
+
+void power_policy_command(void)
+{
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+    last_cmd_us = esp_timer_get_time();
+    input.ms_since_cmd = 0;
+    policy_apply();
+    xSemaphoreGive(policy_lock);
+}
+
+uint8_t power_policy_listen_interval(void)
+{
+    struct PowerPolicyOutput_st out;
+
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+    power_policy_decide(&input, &out);
+    xSemaphoreGive(policy_lock);
+
+    return out.listen_interval;
+}
+
+void power_policy_add_json(struct cJSON *root)
+{
+    cJSON *power, *wake, *obj;
+    int i;
+
+    xSemaphoreTake(policy_lock, portMAX_DELAY);
+
+    power = cJSON_AddObjectToObject(root, "power");
+    cJSON_AddStringToObject(power, "profile", power_profile_name(input.profile));
+    cJSON_AddBoolToObject(power, "pm_enabled", CONFIG_PM_ENABLE);
+    cJSON_AddBoolToObject(power, "burst", current.burst);
+    cJSON_AddNumberToObject(power, "cpu_min_mhz", current.cpu_min_mhz);
+    cJSON_AddNumberToObject(power, "cpu_max_mhz", current.cpu_max_mhz);
+    cJSON_AddBoolToObject(power, "light_sleep", current.light_sleep);
+    cJSON_AddNumberToObject(power, "wifi_ps", current.ps);
+    cJSON_AddNumberToObject(power, "listen_interval", current.listen_interval);
+    /* Worst case extra delay of a packet for us buffered by the AP */
+    cJSON_AddNumberToObject(power, "rx_latency_max_ms",
+                            current.ps == POWER_PS_NONE ? 0 :
+                            current.ps == POWER_PS_MIN_MODEM ? DTIM_PERIOD_US / 1000 :
+                            current.listen_interval * DTIM_PERIOD_US / 1000);
+
+    wake = cJSON_AddObjectToObject(power, "wake_latency_us");
+    for(i = 0; i < POWER_PROFILE_CNT; i++) {
+        const struct WakeStat_st *s = &wake_stat[i];
+
+        if(s->n == 0)
+            continue;
+
+        obj = cJSON_AddObjectToObject(wake, power_profile_name(i));
+        cJSON_AddNumberToObject(obj, "n", s->n);
+        cJSON_AddNumberToObject(obj, "min", s->min_us);
+        cJSON_AddNumberToObject(obj, "avg", s->sum_us / s->n);
+        cJSON_AddNumberToObject(obj, "max", s->max_us);
+    }
+
+    xSemaphoreGive(policy_lock);
+}
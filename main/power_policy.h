@@ -0,0 +1,72 @@
+#ifndef _POWER_POLICY_H_
+#define _POWER_POLICY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Power management policy
+ *
+ * power_policy_decide() is pure: no IDF call, it build on the host too
+ * (tools/power_policy). power_policy.c apply its result with esp_pm and
+ * esp_wifi every time one of the inputs change.
+ */
+
+enum PowerProfile {
+    POWER_PROFILE_LATENCY,      /* No sleep at all, fixed CPU clock */
+    POWER_PROFILE_BALANCED,     /* Light sleep, wake on every DTIM */
+    POWER_PROFILE_LOW_POWER,    /* Light sleep, wake every few DTIM, lowest clock */
+    POWER_PROFILE_CNT,
+};
+
+/* Same value of `wifi_ps_type_t` */
+enum PowerPolicyPs {
+    POWER_PS_NONE,
+    POWER_PS_MIN_MODEM,
+    POWER_PS_MAX_MODEM,
+};
+
+struct PowerPolicyInput_st {
+    enum PowerProfile profile;
+    bool sta_connected;
+    bool ap_active;             /* Recovery AP up: clients need the radio on */
+    bool actuating;             /* Power line pulse running */
+    uint32_t ms_since_cmd;      /* Last command from any source, UINT32_MAX never */
+};
+
+struct PowerPolicyOutput_st {
+    uint16_t cpu_max_mhz;
+    uint16_t cpu_min_mhz;
+    bool light_sleep;
+    enum PowerPolicyPs ps;
+    uint8_t listen_interval;    /* In DTIM, applied at next association */
+    bool burst;                 /* Latency rules kept after a command */
+};
+
+/* After a command another one is likely: stay on latency rules for a while */
+#define POWER_POLICY_BURST_MS   30000
+
+void power_policy_decide(const struct PowerPolicyInput_st *in, struct PowerPolicyOutput_st *out);
+const char *power_profile_name(enum PowerProfile profile);
+bool power_profile_from_name(const char *name, enum PowerProfile *profile);
+
+/** Runtime, power_policy.c **/
+
+/* Apply the profile stored in configuration */
+void power_policy_init(void);
+void power_policy_set_profile(enum PowerProfile profile);
+enum PowerProfile power_policy_get_profile(void);
+
+/* Inputs, each call re-evaluate the policy if something changed */
+void power_policy_set_link(bool sta_connected, bool ap_active);
+void power_policy_set_actuating(bool actuating);
+void power_policy_command(void);
+
+/* Listen interval to use at next esp_wifi_set_config() */
+uint8_t power_policy_listen_interval(void);
+
+/* Add `power` (profile, decision, wake latency) to `root` */
+struct cJSON;
+void power_policy_add_json(struct cJSON *root);
+
+#endif
@@ -0,0 +1,90 @@
+#include <string.h>
+#include "power_policy.h"
+
+/*
+ * Decision table, no IDF dependency: built on the host by tools/power_policy.
+ *
+ * Listen interval is in DTIM period (~102 ms with the usual DTIM 1), it's
+ * the worst case extra delay before a packet for us leave the AP buffer.
+ */
+static const struct PowerPolicyOutput_st profile_base[POWER_PROFILE_CNT] = {
+    [POWER_PROFILE_LATENCY] = {
+        .cpu_max_mhz = 160,
+        .cpu_min_mhz = 160,
+        .light_sleep = false,
+        .ps = POWER_PS_NONE,
+        .listen_interval = 1,
+    },
+    [POWER_PROFILE_BALANCED] = {
+        .cpu_max_mhz = 160,
+        .cpu_min_mhz = 80,
+        .light_sleep = true,
+        .ps = POWER_PS_MIN_MODEM,
+        .listen_interval = 1,
+    },
+    [POWER_PROFILE_LOW_POWER] = {
+        .cpu_max_mhz = 160,
+        .cpu_min_mhz = 40,
+        .light_sleep = true,
+        .ps = POWER_PS_MAX_MODEM,
+        .listen_interval = 3,
+    },
+};
+
+static const char *profile_name[POWER_PROFILE_CNT] = {
+    [POWER_PROFILE_LATENCY]     = "latency",
+    [POWER_PROFILE_BALANCED]    = "balanced",
+    [POWER_PROFILE_LOW_POWER]   = "low_power",
+};
+
+void power_policy_decide(const struct PowerPolicyInput_st *in, struct PowerPolicyOutput_st *out)
+{
+    enum PowerProfile profile = in->profile;
+
+    if(profile >= POWER_PROFILE_CNT)
+        profile = POWER_PROFILE_BALANCED;
+
+    *out = profile_base[profile];
+
+    /* Soon after a command: no MAX_MODEM, reply and next command go out fast */
+    if(in->ms_since_cmd < POWER_POLICY_BURST_MS && profile != POWER_PROFILE_LATENCY) {
+        out->burst = true;
+        out->ps = POWER_PS_MIN_MODEM;
+        if(out->cpu_min_mhz < 80)
+            out->cpu_min_mhz = 80;
+    }
+
+    /* SoftAP does not support modem sleep, clients expect beacons on time */
+    if(in->ap_active) {
+        out->ps = POWER_PS_NONE;
+        out->light_sleep = false;
+        if(out->cpu_min_mhz < 80)
+            out->cpu_min_mhz = 80;
+    }
+
+    /* Keep the pulse timing independent of sleep wake up */
+    if(in->actuating)
+        out->light_sleep = false;
+}
+
+const char *power_profile_name(enum PowerProfile profile)
+{
+    if(profile >= POWER_PROFILE_CNT)
+        return "unknown";
+
+    return profile_name[profile];
+}
+
+bool power_profile_from_name(const char *name, enum PowerProfile *profile)
+{
+    int i;
+
+    for(i = 0; i < POWER_PROFILE_CNT; i++) {
+        if(strcmp(name, profile_name[i]) == 0) {
+            *profile = i;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -15,10 +15,17 @@
 #include "lwip/sys.h"
 #include "esp_wifi.h"
 #include "esp_http_client.h"
+#include "esp_timer.h"
+#include "esp_random.h"
 #include "driver/gpio.h"
 #include "freertos/event_groups.h"
 #include "cJSON.h"
 #include "wifi_config.h"
+#include "boot_profile.h"
+#include "power_policy.h"
+#include "link_monitor.h"
+#include "ota_pull.h"
+#include "tls_mem.h"
 
 #define URL_SIZE    512
 #define TOKEN_SZ    128
@@ -53,6 +60,9 @@ int64_t UpdateID;
 QueueHandle_t cmd_queue;
 QueueHandle_t tx_msg_queue;
 
+/* Each counter has a single writer task, read by /metrics */
+static struct TelegramStats_st stats;
+
 static bool parse_telegram_replay(char *data, int64_t *res)
 {
     cJSON *root, *item, *result;
@@ -126,6 +136,10 @@ esp_err_t client_event_tx_handler(esp_http_client_event_handle_t evt)
     struct Http_recv_st *ext = evt->user_data;
 
     switch (evt->event_id) {
+    case HTTP_EVENT_HEADERS_SENT:
+        tls_mem_session_steady(TLS_MEM_TX);
+        break;
+
     case HTTP_EVENT_ON_DATA:
         if (!esp_http_client_is_chunked_response(evt->client)) {
             if(ext->buff == NULL) {
@@ -178,6 +192,13 @@ esp_err_t client_event_rx_handler(esp_http_client_event_handle_t evt)
     struct Http_recv_st *ext = evt->user_data;
 
     switch (evt->event_id) {
+    case HTTP_EVENT_HEADERS_SENT:
+        /* Long poll may last 20 minutes: first poll is done when it reach the server */
+        boot_profile_mark(BOOT_PHASE_TELEGRAM_POLL);
+        /* What is kept during the long poll */
+        tls_mem_session_steady(TLS_MEM_RX);
+        break;
+
     case HTTP_EVENT_ON_DATA:
         if (!esp_http_client_is_chunked_response(evt->client)) {
             if(ext->buff == NULL) {
@@ -260,6 +281,7 @@ void telegram_tx_msg_task(void *pvParameters) {
     memset(&recvb, 0, sizeof(recvb));
 
     asprintf(&url, "https://api.telegram.org/bot%s/sendMessage", token);
+    tls_mem_bind(TLS_MEM_TX);
 
     config.url = url;
     config.transport_type = HTTP_TRANSPORT_OVER_SSL;
@@ -286,17 +308,25 @@ void telegram_tx_msg_task(void *pvParameters) {
         if(ret == pdTRUE) {
             esp_http_client_set_post_field(client, post_data, strlen(post_data));
 
+            int64_t start = esp_timer_get_time();
+            tls_mem_session_start(TLS_MEM_TX);
             esp_err_t err = esp_http_client_perform(client);
+            link_monitor_cloud_rtt((esp_timer_get_time() - start) / 1000, err == ESP_OK);
+            stats.sent++;
             if (err == ESP_OK) {
                 int status = esp_http_client_get_status_code(client);
                 int64_t len = esp_http_client_get_content_length(client);
 
+                if(status != 200)
+                    stats.send_err++;
                 ESP_LOGD(TAG, "HTTP POST Status = %d, content_length = %llu", status, len);
             } else {
+                stats.send_err++;
                 ESP_LOGE(TAG, "HTTP POST request failed: %s", esp_err_to_name(err));
             }
 
             esp_http_client_close(client);
+            tls_mem_session_end(TLS_MEM_TX);
             free(post_data);
 
             vTaskDelay(pdMS_TO_TICKS(250));
@@ -330,6 +360,7 @@ void telegram_rx_msg_task(void *pvParameters) {
     memset(&recvb, 0, sizeof(recvb));
 
     snprintf(url, URL_SIZE, "https://api.telegram.org/bot%s/getUpdates", token);
+    tls_mem_bind(TLS_MEM_RX);
     ESP_LOGD(TAG, "Set url:%s", url);
 
     config.url = url;
@@ -355,16 +386,23 @@ void telegram_rx_msg_task(void *pvParameters) {
         esp_http_client_set_header(client, "Content-Type", "application/json");
         esp_http_client_set_post_field(client, post_data, strlen(post_data));
 
+        tls_mem_session_start(TLS_MEM_RX);
         esp_err_t err = esp_http_client_perform(client);
+        stats.polls++;
         if (err == ESP_OK) {
+            if(esp_http_client_get_status_code(client) != 200)
+                stats.poll_err++;
             ESP_LOGD(TAG, "HTTP POST Status = %d, content_length = %llu",
                     esp_http_client_get_status_code(client),
                     esp_http_client_get_content_length(client));
         } else {
+            stats.poll_err++;
             ESP_LOGD(TAG, "HTTP POST request failed: %s", esp_err_to_name(err));
         }
 
+        /* The TLS context is freed here, a new handshake at each poll */
         esp_http_client_close(client);
+        tls_mem_session_end(TLS_MEM_RX);
 
         vTaskDelay(pdMS_TO_TICKS(250));
     }
@@ -375,8 +413,8 @@ void telegram_rx_msg_task(void *pvParameters) {
 static void door_open(char*cmd, int argc, char**argv)
 {
     /* Open all */
-    drive_door_open(POWER_LINE_1);
-    drive_door_open(POWER_LINE_2);
+    drive_door_open(POWER_LINE_1, POWER_SRC_TELEGRAM);
+    drive_door_open(POWER_LINE_2, POWER_SRC_TELEGRAM);
 }
 
 static void reset_esp_cmd(char*cmd, int argc, char**argv)
@@ -435,6 +473,59 @@ static void cmd_set_mdns(char*cmd, int argc, char**argv) {
     }
 }
 
+static void cmd_power_profile(char*cmd, int argc, char**argv) {
+    enum PowerProfile profile;
+    char *txt;
+
+    if(argc == 2 && power_profile_from_name(argv[1], &profile)) {
+        power_policy_set_profile(profile);
+        asprintf(&txt, "Profilo energia: %s", power_profile_name(profile));
+    } else {
+        asprintf(&txt, "Profilo energia: %s\nValori: latency, balanced, low_power",
+                        power_profile_name(power_policy_get_profile()));
+    }
+
+    telegram_send_text(txt);
+}
+
+static void cmd_ota_check(char*cmd, int argc, char**argv) {
+    if(ota_pull_check_now())
+        telegram_send_text("Controllo aggiornamenti avviato, se c'e' una nuova versione la scheda si riavvia da sola");
+    else
+        telegram_send_text("Server aggiornamenti non configurato, vedi /api/v1/config/ota");
+}
+
+/* The key is made here and only sent to the configured chat */
+static void cmd_lan_key(char*cmd, int argc, char**argv) {
+    uint8_t key[APP_CFG_LAN_KEY_SZ];
+    char txt[160];
+    size_t wrt;
+    int i;
+
+    if(argc == 2 && !strcmp(argv[1], "off")) {
+        app_config_set_lan_key(NULL);
+        if(app_config_commit() == ESP_OK)
+            telegram_send_text("Apertura da rete locale disattivata");
+        else
+            telegram_send_text("Impossibile salvare la configurazione");
+        return;
+    }
+
+    esp_fill_random(key, sizeof(key));
+    app_config_set_lan_key(key);
+    if(app_config_commit() != ESP_OK) {
+        telegram_send_text("Impossibile salvare la configurazione");
+        return;
+    }
+
+    wrt = snprintf(txt, sizeof(txt), "Nuova chiave apertura da rete locale, la precedente non vale piu':\n");
+    for(i = 0; i < sizeof(key); i++)
+        wrt += snprintf(&txt[wrt], sizeof(txt) - wrt, "%02x", key[i]);
+    memset(key, 0, sizeof(key));
+
+    telegram_send_text(txt);
+}
+
 const struct command_row_t command_table[] = {
     {
         .cmd = "/apri",
@@ -456,6 +547,21 @@ const struct command_row_t command_table[] = {
         .cb = cmd_set_mdns,
         .help = "Imposta il valore del record mDNS del apri cancello /set-mdns [nome]",
     },
+    {
+        .cmd = "/energia",
+        .cb = cmd_power_profile,
+        .help = "Imposta il profilo di risparmio energetico /energia [latency|balanced|low_power]\nlatency: risposta immediata, consumo massimo\nlow_power: consumo minimo, risposta fino a ~300 ms piu' lenta",
+    },
+    {
+        .cmd = "/aggiorna",
+        .cb = cmd_ota_check,
+        .help = "Controlla subito se il server aggiornamenti ha una nuova versione e la installa",
+    },
+    {
+        .cmd = "/chiave_lan",
+        .cb = cmd_lan_key,
+        .help = "Genera una nuova chiave per aprire dalla rete locale senza passare da internet (tools/lan_door)\n/chiave_lan off la disattiva",
+    },
 };
 
 static void TelegramMsg_Delete(struct TelegramMsg_t *msg)
@@ -473,6 +579,9 @@ void telegram_commands_exec(void *pvParameters) {
 
         resp = xQueueReceive(cmd_queue, &msg, pdMS_TO_TICKS(2500));
         if(resp == pdTRUE) {
+            stats.commands++;
+            power_policy_command();
+
             char *save_ptr, *in, *argsv[TELEGRAM_CMD_ARG_MAX_CNT];
             int argc = 0;
             int i;
@@ -533,6 +642,13 @@ void telegram_commands_exec(void *pvParameters) {
     }
 }
 
+void telegram_get_stats(struct TelegramStats_st *st)
+{
+    *st = stats;
+    st->cmd_queue = cmd_queue ? uxQueueMessagesWaiting(cmd_queue) : 0;
+    st->tx_msg_queue = tx_msg_queue ? uxQueueMessagesWaiting(tx_msg_queue) : 0;
+}
+
 void telegram_send_keyboard() {
     char *ret;
     cJSON *root = cJSON_CreateObject();
@@ -567,26 +683,21 @@ void telegram_send_keyboard() {
 }
 
 static inline bool read_telegram_token() {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    size_t sz;
+    const struct AppConfig_t *cfg = app_config_get();
     bool okay = true;
 
-    err = nvs_open(NVS_NAME, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
-
-    sz = sizeof(token);
-    err = nvs_get_str(nvs_handle, NVS_TELEGRAM_TOKEN, (char*) token, &sz);
-    if(err != ESP_OK) {
+    if(cfg->valid & APP_CFG_TELEGRAM_TOKEN) {
+        strlcpy(token, cfg->telegram_token, sizeof(token));
+    } else {
         okay = false;
     }
 
-    err = nvs_get_i64(nvs_handle, NVS_TELEGRAM_CHATID, &chatid);
-    if(err != ESP_OK) {
+    if(cfg->valid & APP_CFG_TELEGRAM_CHATID) {
+        chatid = cfg->telegram_chatid;
+    } else {
         okay = false;
     }
 
-    nvs_close(nvs_handle);
     ESP_LOGD(TAG, "Telegram info token:%s - chatid:%lld", token, chatid);
 
     return okay;
@@ -0,0 +1,155 @@
+#include <string.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "tls_mem.h"
+
+static const char *TAG = "tls mem";
+
+#define TLS_MEM_BIND_MAX    4
+
+/* In front of each block, keep the payload 8 byte aligned */
+struct TlsMemHdr_st {
+    uint32_t size;
+    uint32_t session;
+};
+
+struct TlsMemBind_st {
+    TaskHandle_t task;
+    enum TlsMemSession session;
+};
+
+static const char *session_names[TLS_MEM_SESSION_CNT] = {
+    [TLS_MEM_RX]    = "rx",
+    [TLS_MEM_TX]    = "tx",
+    [TLS_MEM_OTHER] = "other",
+};
+
+static struct TlsMemBind_st task_bind[TLS_MEM_BIND_MAX];
+static struct TlsMemStats_st stats[TLS_MEM_SESSION_CNT];
+static portMUX_TYPE tls_mem_lock = portMUX_INITIALIZER_UNLOCKED;
+
+const char* tls_mem_session_name(enum TlsMemSession s)
+{
+    return s < TLS_MEM_SESSION_CNT ? session_names[s] : "unknown";
+}
+
+void tls_mem_get_stats(enum TlsMemSession s, struct TlsMemStats_st *st)
+{
+    portENTER_CRITICAL(&tls_mem_lock);
+    *st = stats[s];
+    portEXIT_CRITICAL(&tls_mem_lock);
+}
+
+void tls_mem_bind(enum TlsMemSession s)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    int i;
+
+    portENTER_CRITICAL(&tls_mem_lock);
+    for(i = 0; i < TLS_MEM_BIND_MAX; i++) {
+        if(task_bind[i].task == NULL || task_bind[i].task == task) {
+            task_bind[i].task = task;
+            task_bind[i].session = s;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&tls_mem_lock);
+
+    if(i == TLS_MEM_BIND_MAX)
+        ESP_LOGW(TAG, "No room to bind %s, counted as other", tls_mem_session_name(s));
+}
+
+/* Call with `tls_mem_lock` held */
+static enum TlsMemSession session_of_task(void)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    int i;
+
+    for(i = 0; i < TLS_MEM_BIND_MAX && task_bind[i].task != NULL; i++)
+        if(task_bind[i].task == task)
+            return task_bind[i].session;
+
+    return TLS_MEM_OTHER;
+}
+
+void tls_mem_session_start(enum TlsMemSession s)
+{
+    portENTER_CRITICAL(&tls_mem_lock);
+    stats[s].peak = stats[s].cur;
+    portEXIT_CRITICAL(&tls_mem_lock);
+}
+
+void tls_mem_session_steady(enum TlsMemSession s)
+{
+    portENTER_CRITICAL(&tls_mem_lock);
+    stats[s].steady = stats[s].cur;
+    portEXIT_CRITICAL(&tls_mem_lock);
+}
+
+void tls_mem_session_end(enum TlsMemSession s)
+{
+    struct TlsMemStats_st st;
+
+    portENTER_CRITICAL(&tls_mem_lock);
+    stats[s].sessions++;
+    st = stats[s];
+    portEXIT_CRITICAL(&tls_mem_lock);
+
+    ESP_LOGI(TAG, "Session %s: peak %lu B, steady %lu B, freed after handshake %lu B, internal free %u B",
+                    tls_mem_session_name(s), st.peak, st.steady,
+                    st.peak > st.steady ? st.peak - st.steady : 0,
+                    heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+}
+
+/*
+ * Allocator of mbedtls, same placement as CONFIG_MBEDTLS_INTERNAL_MEM_ALLOC.
+ * Also called by WiFi and other components: short and no wait.
+ */
+void *esp_mbedtls_mem_calloc(size_t n, size_t size)
+{
+    struct TlsMemHdr_st *h;
+    struct TlsMemStats_st *st;
+    size_t len;
+
+    if(size != 0 && n > (SIZE_MAX - sizeof(*h)) / size)
+        return NULL;
+    len = n * size;
+
+    h = heap_caps_calloc(1, sizeof(*h) + len, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if(h == NULL)
+        return NULL;
+
+    h->size = len;
+
+    portENTER_CRITICAL(&tls_mem_lock);
+    h->session = session_of_task();
+    st = &stats[h->session];
+    st->cur += len;
+    if(st->cur > st->peak)
+        st->peak = st->cur;
+    if(st->cur > st->peak_max)
+        st->peak_max = st->cur;
+    portEXIT_CRITICAL(&tls_mem_lock);
+
+    return h + 1;
+}
+
+void esp_mbedtls_mem_free(void *ptr)
+{
+    struct TlsMemHdr_st *h;
+
+    if(ptr == NULL)
+        return;
+
+    /* Charged to who allocated it, whatever task free it */
+    h = (struct TlsMemHdr_st*)ptr - 1;
+
+    portENTER_CRITICAL(&tls_mem_lock);
+    stats[h->session].cur -= h->size;
+    portEXIT_CRITICAL(&tls_mem_lock);
+
+    heap_caps_free(h);
+}
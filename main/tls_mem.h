@@ -0,0 +1,50 @@
+#ifndef _TLS_MEM_H_
+#define _TLS_MEM_H_
+
+#include <stdint.h>
+
+/*
+ * mbedtls heap for each TLS session (CONFIG_MBEDTLS_CUSTOM_MEM_ALLOC)
+ *
+ * Every mbedtls allocation go through esp_mbedtls_mem_calloc() here and
+ * is charged to the session bound to the calling task, anything else
+ * (pull OTA, MQTT over TLS, WPA3) to TLS_MEM_OTHER. For a session:
+ *
+ *   peak    most held from connect to close: handshake, record buffers
+ *   steady  held once the request is sent, kept while waiting the answer
+ *           (20 minutes for the getUpdates long poll)
+ *
+ * With CONFIG_MBEDTLS_DYNAMIC_BUFFER the record buffers are allocated
+ * only while a record is read or written, CA, config and handshake state
+ * are freed after the handshake: `peak - steady` is given back.
+ */
+
+enum TlsMemSession {
+    TLS_MEM_RX,         /* Telegram getUpdates */
+    TLS_MEM_TX,         /* Telegram sendMessage */
+    TLS_MEM_OTHER,
+    TLS_MEM_SESSION_CNT,
+};
+
+struct TlsMemStats_st {
+    uint32_t cur;
+    uint32_t peak;          /* Last session */
+    uint32_t steady;        /* Last session */
+    uint32_t peak_max;      /* Since boot */
+    uint32_t sessions;
+};
+
+/* Allocations of the calling task are charged to `s` from now */
+void tls_mem_bind(enum TlsMemSession s);
+
+/* Before connect, restart the peak */
+void tls_mem_session_start(enum TlsMemSession s);
+/* Request sent, record what the session keep */
+void tls_mem_session_steady(enum TlsMemSession s);
+/* After close, log and count it */
+void tls_mem_session_end(enum TlsMemSession s);
+
+const char* tls_mem_session_name(enum TlsMemSession s);
+void tls_mem_get_stats(enum TlsMemSession s, struct TlsMemStats_st *st);
+
+#endif
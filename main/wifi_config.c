@@ -14,11 +14,23 @@
 #include "esp_event.h"
 #include "lwip/err.h"
 #include "lwip/sys.h"
+#include "lwip/dhcp.h"
+#include "lwip/etharp.h"
+#include "lwip/priv/tcpip_priv.h"
 #include "mdns.h"
 
 #include "esp_sntp.h"
+#include "esp_timer.h"
+#include "cJSON.h"
 #include "wifi_config.h"
 #include "config.h"
+#include "boot_profile.h"
+#include "power_policy.h"
+#include "link_monitor.h"
+#include "ota_pull.h"
+#include "gate_mqtt.h"
+#include "gate_udp.h"
+#include "event_bus.h"
 
 static const char *TAG = "WiFi";
 
@@ -28,46 +40,311 @@ static const char *TAG = "WiFi";
 EventGroupHandle_t s_wifi_event_group;
 // struct AppConfig_t config;
 
-#define ESP_MAXIMUM_RETRY 3
-static int s_retry_num = 0;
+/*
+ * Connectivity state machine, run by the net-start task:
+ *
+ *   CONNECTING ---> CONNECTED ---(disconnect)---> CONNECTING
+ *        |
+ *        +--(fail)--> BACKOFF ---(timeout)------> CONNECTING
+ *        |
+ *        +--(ESP_MAXIMUM_RETRY fails, wrong password, no SSID)
+ *                 --> PROVISIONING (APSTA, recovery AP up)
+ *
+ * In PROVISIONING the STA keep retrying with the same exponential backoff,
+ * after a wrong password at the longest one, the AP is shut down as soon as the STA get an IP. No state change reboot
+ * the chip: HTTP server, TLS session and Telegram offset survive an outage.
+ */
+enum WifiState {
+    WIFI_STATE_CONNECTING,
+    WIFI_STATE_CONNECTED,
+    WIFI_STATE_BACKOFF,
+    WIFI_STATE_PROVISIONING,
+};
+
+static const char *state_name[] = {
+    [WIFI_STATE_CONNECTING]     = "connecting",
+    [WIFI_STATE_CONNECTED]      = "connected",
+    [WIFI_STATE_BACKOFF]        = "backoff",
+    [WIFI_STATE_PROVISIONING]   = "provisioning",
+};
+
+#define ESP_MAXIMUM_RETRY       3
+#define WIFI_CONNECT_TIMEOUT_MS 20000
+#define WIFI_BACKOFF_MIN_MS     1000
+#define WIFI_BACKOFF_MAX_MS     (5 * 60 * 1000)
+
+static enum WifiState s_state;
+static int s_retry_num;
+static uint32_t s_backoff_ms = WIFI_BACKOFF_MIN_MS;
+static bool s_have_credential;
+static bool s_ap_active;
+
+/* Outage: from the loss of the IP to the next one */
+#define WIFI_OUTAGE_HISTORY 8
+
+struct WifiOutage_st {
+    uint32_t at_s;          /* Uptime at disconnect */
+    uint32_t duration_ms;
+    uint8_t reason;
+    uint8_t attempts;
+    bool provisioning;      /* Recovery AP was needed */
+};
+
+static struct WifiOutage_st s_outage[WIFI_OUTAGE_HISTORY];
+static unsigned s_outage_cnt;
+static uint64_t s_downtime_ms;
+static int64_t s_outage_start_us;
+static uint8_t s_outage_reason;
+static volatile uint8_t s_last_reason;
+
+/* Directed connect on cached channel and BSSID in progress */
+static bool s_fast_connect;
+static int64_t s_connect_start_us;
+
+/* DHCP server silent for this long after association: probe the cached lease */
+#define DHCP_FALLBACK_MS  1000
+/* Wait for the ARP answers of the probe */
+#define LEASE_PROBE_MS    200
+
+/* ARP probe of the cached lease, run in the lwIP thread */
+struct LeaseProbe_st {
+    struct tcpip_api_call_data call;
+    struct netif *netif;
+    ip4_addr_t gw;
+    ip4_addr_t ip;
+    bool gw_seen;
+    bool ip_seen;
+};
+
+static esp_netif_t *s_sta_netif;
+static esp_timer_handle_t s_lease_timer;
+static int64_t s_assoc_us;
+static bool s_lease_cached;
+static bool s_lease_probe;
+static bool s_static_lease;
+
+/*
+ * Known networks: `wifi_ssid` first, then the extra profiles. With more than
+ * one the strongest in a scan is used; the driver then pick the strongest
+ * BSS of that SSID (sort by signal). Below `wifi_rssi_min` the link is
+ * checked every ROAM_CHECK_MS for an AP stronger by ROAM_HYSTERESIS_DB.
+ * APs with 802.11k/v steer the station themselves (rm/btm enabled).
+ */
+#define WIFI_PROFILE_MAX    (APP_CFG_WIFI_PROFILE_CNT + 1)
+#define ROAM_HYSTERESIS_DB  8
+#define ROAM_CHECK_MS       60000
+#define ROAM_SCAN_MAX_AP    16
+
+static struct WifiProfile_t s_profile[WIFI_PROFILE_MAX];
+static int s_profile_cnt;
+static int8_t s_rssi_min = APP_CFG_RSSI_MIN_DEFAULT;
+static wifi_ap_record_t s_scan_rec[ROAM_SCAN_MAX_AP];
+static bool s_weak_link;
+static bool s_roaming;
+static unsigned s_roam_cnt;
+
+static wifi_config_t wifi_config = {
+    .sta = {
+        .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+        .scan_method = WIFI_ALL_CHANNEL_SCAN,
+        .sort_method = WIFI_CONNECT_AP_BY_SIGNAL,
+        .rm_enabled = 1,
+        .btm_enabled = 1,
+        .pmf_cfg = {
+            .capable = true,
+            .required = false
+        },
+    },
+};
+
+static void fast_connect_fallback(void)
+{
+    ESP_LOGW(TAG, "Directed connect on ch:%d failed, full scan", wifi_config.sta.channel);
+
+    s_fast_connect = false;
+    power_up_clear_wifi_hint();
+
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_connect() );
+}
+
+/*
+ * The interface has no address yet: the requests go out with sender
+ * 0.0.0.0, an RFC 5227 probe. etharp_query() keep a pending entry, the
+ * answer make it stable.
+ */
+static err_t lease_probe_send(struct tcpip_api_call_data *call)
+{
+    struct LeaseProbe_st *p = (struct LeaseProbe_st*)call;
+
+    etharp_query(p->netif, &p->gw, NULL);
+    etharp_query(p->netif, &p->ip, NULL);
+
+    return ERR_OK;
+}
+
+static err_t lease_probe_check(struct tcpip_api_call_data *call)
+{
+    struct LeaseProbe_st *p = (struct LeaseProbe_st*)call;
+    const ip4_addr_t *ip;
+    struct eth_addr *eth;
+
+    p->gw_seen = etharp_find_addr(p->netif, &p->gw, &eth, &ip) >= 0;
+    p->ip_seen = etharp_find_addr(p->netif, &p->ip, &eth, &ip) >= 0;
+
+    return ERR_OK;
+}
+
+static void lease_probe(const struct PowerUpLease_st *lease, tcpip_api_call_fn fn, struct LeaseProbe_st *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->netif = esp_netif_get_netif_impl(s_sta_netif);
+    p->gw.addr = lease->gw;
+    p->ip.addr = lease->ip;
+
+    tcpip_api_call(fn, &p->call);
+}
+
+static void lease_timer_cb(void *arg)
+{
+    struct PowerUpLease_st lease;
+    struct LeaseProbe_st probe;
+    esp_netif_dns_info_t dns;
+    esp_netif_ip_info_t ip;
+
+    if(s_static_lease) {
+        /* Half of the cached lease elapsed, go back to DHCP */
+        ESP_LOGI(TAG, "Static lease renew, restart DHCP");
+        s_static_lease = false;
+        ESP_ERROR_CHECK_WITHOUT_ABORT( esp_netif_dhcpc_start(s_sta_netif) );
+        return;
+    }
+
+    if((xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT) || !power_up_get_lease(&lease)) {
+        s_lease_probe = false;
+        return;
+    }
+
+    /* First the probe, DHCP keep going meanwhile */
+    if(!s_lease_probe) {
+        ESP_LOGW(TAG, "No DHCP answer in %d ms, probe cached lease", DHCP_FALLBACK_MS);
+        lease_probe(&lease, lease_probe_send, &probe);
+        s_lease_probe = true;
+        esp_timer_start_once(s_lease_timer, LEASE_PROBE_MS * 1000);
+        return;
+    }
+
+    s_lease_probe = false;
+    lease_probe(&lease, lease_probe_check, &probe);
+
+    /* Another network or the address given to someone else: wait DHCP */
+    if(!probe.gw_seen || probe.ip_seen) {
+        ESP_LOGW(TAG, "Cached lease not used, gateway:%s address:%s",
+                        probe.gw_seen ? "found" : "missing", probe.ip_seen ? "in use" : "free");
+        return;
+    }
+
+    ESP_LOGW(TAG, "Gateway found, use cached lease");
+
+    ip.ip.addr = lease.ip;
+    ip.netmask.addr = lease.netmask;
+    ip.gw.addr = lease.gw;
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    dns.ip.u_addr.ip4.addr = lease.dns;
+
+    s_static_lease = true;
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_netif_dhcpc_stop(s_sta_netif) );
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_netif_set_ip_info(s_sta_netif, &ip) );
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_netif_set_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &dns) );
+
+    /* Keep it only for half of the remaining lease, like DHCP T1 */
+    esp_timer_start_once(s_lease_timer, (lease.expire_s - power_up_clock_s()) * 1000000LL / 2);
+}
+
+static void lease_save(esp_netif_t *netif, const esp_netif_ip_info_t *ip)
+{
+    struct dhcp *dhcp = netif_dhcp_data((struct netif*) esp_netif_get_netif_impl(netif));
+    struct PowerUpLease_st lease;
+    esp_netif_dns_info_t dns;
+
+    if(dhcp == NULL || dhcp->offered_t0_lease == 0)
+        return;
+
+    esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns);
+
+    lease.ip = ip->ip.addr;
+    lease.netmask = ip->netmask.addr;
+    lease.gw = ip->gw.addr;
+    lease.dns = dns.ip.u_addr.ip4.addr;
+    lease.lease_s = dhcp->offered_t0_lease;
+    lease.expire_s = power_up_clock_s() + lease.lease_s;
+    lease.gap = 0;
+    power_up_set_lease(&lease);
+
+    ESP_LOGD(TAG, "Lease saved, %lu s", dhcp->offered_t0_lease);
+}
 
 void time_sync_notification_cb(struct timeval *tv)
 {
     ESP_LOGI(TAG, "Notification of a time synchronization event");
+    boot_profile_mark(BOOT_PHASE_SNTP_SYNC);
     xEventGroupSetBits(s_wifi_event_group, CLOCK_SYNC_DONE);
 }
 
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
     switch (event_id) {
-    case WIFI_EVENT_STA_START:
-        esp_wifi_connect();
+    case WIFI_EVENT_STA_CONNECTED:
+        wifi_event_sta_connected_t *c = event_data;
+        struct PowerUpLease_st lease;
+
+        ESP_LOGI(TAG, "Associated ch:%d bssid:"MACSTR" in %lld ms",
+                        c->channel, MAC2STR(c->bssid), (esp_timer_get_time() - s_connect_start_us) / 1000);
+        power_up_set_wifi_hint(wifi_config.sta.ssid, c->bssid, c->channel);
+        boot_profile_mark(BOOT_PHASE_WIFI_ASSOC);
+
+        /* DHCP run INIT-REBOOT (LWIP_DHCP_RESTORE_LAST_IP), static lease if it stay silent */
+        s_assoc_us = esp_timer_get_time();
+        s_lease_cached = power_up_get_lease(&lease);
+        s_lease_probe = false;
+        if(s_lease_cached)
+            esp_timer_start_once(s_lease_timer, DHCP_FALLBACK_MS * 1000);
         break;
 
     case WIFI_EVENT_STA_DISCONNECTED:
         wifi_event_sta_disconnected_t *d =event_data;
 
-        ESP_LOGI(TAG, "Disconnect AP, reason:%d retry:%d", d->reason, ESP_MAXIMUM_RETRY - s_retry_num);
+        ESP_LOGI(TAG, "Disconnect AP, reason:%d retry:%d", d->reason, s_retry_num);
 
-        if (s_retry_num < ESP_MAXIMUM_RETRY) {
-            /* Wrong Password, or AP Disconnected */
-            if(d->reason == WIFI_REASON_ASSOC_FAIL || d->reason == WIFI_REASON_NO_AP_FOUND) {
+        esp_timer_stop(s_lease_timer);
+        s_lease_probe = false;
+        if(s_static_lease) {
+            s_static_lease = false;
+            ESP_ERROR_CHECK_WITHOUT_ABORT( esp_netif_dhcpc_start(s_sta_netif) );
+        }
 
-                if(d->reason == WIFI_REASON_ASSOC_FAIL)
-                    power_up_set_wrong_pass(true);
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT | CLOCK_SYNC_DONE);
+
+        /* Our own esp_wifi_disconnect(), the state machine already know */
+        if(d->reason == WIFI_REASON_ASSOC_LEAVE)
+            break;
+
+        /* Wrong Password */
+        if(d->reason == WIFI_REASON_ASSOC_FAIL)
+            power_up_set_wrong_pass(true);
+
+        link_monitor_disconnect(d->reason);
+        s_last_reason = d->reason;
+        xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        break;
+
+    case WIFI_EVENT_STA_BSS_RSSI_LOW:
+        xEventGroupSetBits(s_wifi_event_group, WIFI_ROAM_BIT);
+        break;
 
-                power_up_set_mode(STARTUP_MODE__AP);
-                s_retry_num = ESP_MAXIMUM_RETRY;
-                esp_restart();
-            } else {
-                ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_connect() );
-            }
-            s_retry_num++;
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-            xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-            xEventGroupClearBits(s_wifi_event_group, CLOCK_SYNC_DONE);
-        }
     default:
         break;
     }
@@ -77,42 +354,428 @@ static void event_got_ip(void* arg, esp_event_base_t event_base, int32_t event_i
 {
     ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
 
+    uint32_t dhcp_ms = (esp_timer_get_time() - s_assoc_us) / 1000;
+
     ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+    boot_profile_mark(BOOT_PHASE_GOT_IP);
+    link_monitor_connect_time((esp_timer_get_time() - s_connect_start_us) / 1000);
+    ESP_LOGI(TAG, "Connected in %lld ms, %s", (esp_timer_get_time() - s_connect_start_us) / 1000,
+                    s_fast_connect ? "fast connect" : "full scan");
+    s_fast_connect = false;
+
+    if(s_static_lease) {
+        ESP_LOGI(TAG, "IP from cached lease in %lu ms", dhcp_ms);
+    } else {
+        esp_timer_stop(s_lease_timer);
+        lease_save(event->esp_netif, &event->ip_info);
+
+        if(!s_lease_cached) {
+            /* No lease to reuse: full DHCP exchange, reference time */
+            power_up_set_dhcp_ref_ms(dhcp_ms > UINT16_MAX ? UINT16_MAX : dhcp_ms);
+            ESP_LOGI(TAG, "IP from DHCP in %lu ms", dhcp_ms);
+        } else {
+            ESP_LOGI(TAG, "IP from DHCP INIT-REBOOT in %lu ms", dhcp_ms);
+        }
+    }
+
+    /* Reference from another network or AP may be shorter */
+    if(s_lease_cached && power_up_get_dhcp_ref_ms())
+        ESP_LOGI(TAG, "Time saved on DHCP:%lu ms",
+                        power_up_get_dhcp_ref_ms() > dhcp_ms ? power_up_get_dhcp_ref_ms() - dhcp_ms : 0);
+    s_lease_cached = false;
 
     xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-    s_retry_num = 0;
 
     sntp_restart();
 }
 
-static wifi_config_t wifi_config = {
-    .sta = {
-        .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-        .pmf_cfg = {
-            .capable = true,
-            .required = false
-        },
-    },
-};
+static void wifi_set_state(enum WifiState state)
+{
+    if(state != s_state) {
+        ESP_LOGI(TAG, "State %s -> %s", state_name[s_state], state_name[state]);
+        event_bus_publish("wifi", "\"state\":\"%s\",\"ap\":%s", state_name[state], s_ap_active ? "true" : "false");
+    }
+    s_state = state;
+
+    power_policy_set_link(s_state == WIFI_STATE_CONNECTED, s_ap_active);
+}
+
+static int profile_find(const uint8_t *ssid)
+{
+    int i;
+
+    for(i = 0; i < s_profile_cnt; i++) {
+        if(strncmp(s_profile[i].ssid, (const char*)ssid, 32) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static void profile_apply(int idx)
+{
+    /* ESP SSID len, not null terminated when 32 char long */
+    memset(wifi_config.sta.ssid, 0, sizeof(wifi_config.sta.ssid));
+    memset(wifi_config.sta.password, 0, sizeof(wifi_config.sta.password));
+    strncpy((char*)wifi_config.sta.ssid, s_profile[idx].ssid, sizeof(wifi_config.sta.ssid));
+    strncpy((char*)wifi_config.sta.password, s_profile[idx].pass, sizeof(wifi_config.sta.password));
+}
+
+/* Blocking all channel scan, records in `s_scan_rec` */
+static uint16_t sta_scan(void)
+{
+    wifi_scan_config_t scan = {
+        .channel = 0,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time.active = { .min = 40, .max = 120 },
+        .home_chan_dwell_time = 30,
+    };
+    uint16_t n = ROAM_SCAN_MAX_AP;
+
+    if(ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_scan_start(&scan, true) ) != ESP_OK)
+        return 0;
+
+    if(esp_wifi_scan_get_ap_records(&n, s_scan_rec) != ESP_OK)
+        n = 0;
+    esp_wifi_clear_ap_list();
+
+    return n;
+}
+
+/* More than one known network: take the strongest in range */
+static void select_profile(void)
+{
+    int i, p, best = -1;
+    int8_t best_rssi = INT8_MIN;
+    uint16_t n;
+
+    if(s_profile_cnt < 2)
+        return;
+
+    n = sta_scan();
+    for(i = 0; i < n; i++) {
+        p = profile_find(s_scan_rec[i].ssid);
+        if(p >= 0 && s_scan_rec[i].rssi > best_rssi) {
+            best = p;
+            best_rssi = s_scan_rec[i].rssi;
+        }
+    }
+
+    if(best < 0) {
+        ESP_LOGW(TAG, "No known network in range, try `%s`", wifi_config.sta.ssid);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Network `%s` rssi:%d", s_profile[best].ssid, best_rssi);
+    profile_apply(best);
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+}
+
+/*
+ * Our own disconnect: the event clear WIFI_CONNECTED_BIT only later, the
+ * next wait must not take the old link for the new one.
+ */
+static void wifi_sta_disconnect(void)
+{
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT | CLOCK_SYNC_DONE);
+    esp_wifi_disconnect();
+}
+
+static void wifi_sta_connect(void)
+{
+    s_connect_start_us = esp_timer_get_time();
+
+    if(!wifi_config.sta.bssid_set)
+        select_profile();
 
-void wifi_init_sta(void)
+    /* Power profile changed since last association */
+    if(wifi_config.sta.listen_interval != power_policy_listen_interval()) {
+        wifi_config.sta.listen_interval = power_policy_listen_interval();
+        ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_connect() );
+    wifi_set_state(WIFI_STATE_CONNECTING);
+}
+
+static void wifi_read_credential(void)
+{
+    const struct AppConfig_t *cfg = app_config_get();
+    int i;
+
+    s_profile_cnt = 0;
+    if((cfg->valid & APP_CFG_WIFI_SSID) && cfg->wifi_ssid[0]) {
+        strlcpy(s_profile[0].ssid, cfg->wifi_ssid, sizeof(s_profile[0].ssid));
+        strlcpy(s_profile[0].pass, (cfg->valid & APP_CFG_WIFI_PASS) ? cfg->wifi_pass : "", sizeof(s_profile[0].pass));
+        s_profile_cnt++;
+    }
+
+    for(i = 0; i < APP_CFG_WIFI_PROFILE_CNT && (cfg->valid & APP_CFG_WIFI_PROFILES); i++) {
+        if(cfg->wifi_profile[i].ssid[0])
+            s_profile[s_profile_cnt++] = cfg->wifi_profile[i];
+    }
+
+    s_rssi_min = (cfg->valid & APP_CFG_WIFI_RSSI_MIN) ? cfg->wifi_rssi_min : APP_CFG_RSSI_MIN_DEFAULT;
+
+    s_have_credential = s_profile_cnt > 0;
+    if(s_have_credential) {
+        profile_apply(0);
+        ESP_LOGI(TAG, "Known networks:%d, roam below %d dBm", s_profile_cnt, s_rssi_min);
+    } else {
+        memset(wifi_config.sta.ssid, 0, sizeof(wifi_config.sta.ssid));
+        memset(wifi_config.sta.password, 0, sizeof(wifi_config.sta.password));
+        ESP_LOGW(TAG, "No Wi-Fi credential, provisioning only");
+    }
+}
+
+/*
+ * Link below `s_rssi_min`: look for a known AP stronger by ROAM_HYSTERESIS_DB
+ * and move there. Telegram long poll would otherwise crawl on a -85 dBm link.
+ */
+static void roam_check(void)
+{
+    wifi_ap_record_t cur;
+    int i, p, best = -1;
+    uint16_t n;
+
+    if(esp_wifi_sta_get_ap_info(&cur) != ESP_OK)
+        return;
+
+    s_weak_link = cur.rssi < s_rssi_min;
+    if(!s_weak_link) {
+        /* Event is one shot, arm it again */
+        esp_wifi_set_rssi_threshold(s_rssi_min);
+        return;
+    }
+
+    n = sta_scan();
+    for(i = 0; i < n; i++) {
+        const wifi_ap_record_t *r = &s_scan_rec[i];
+
+        if(profile_find(r->ssid) < 0 || memcmp(r->bssid, cur.bssid, sizeof(cur.bssid)) == 0)
+            continue;
+
+        if(r->rssi >= cur.rssi + ROAM_HYSTERESIS_DB && (best < 0 || r->rssi > s_scan_rec[best].rssi))
+            best = i;
+    }
+
+    if(best < 0) {
+        ESP_LOGI(TAG, "Weak link rssi:%d, no better AP", cur.rssi);
+        return;
+    }
+
+    p = profile_find(s_scan_rec[best].ssid);
+    ESP_LOGW(TAG, "Roam rssi:%d -> `%s` "MACSTR" ch:%d rssi:%d", cur.rssi, s_profile[p].ssid,
+                    MAC2STR(s_scan_rec[best].bssid), s_scan_rec[best].primary, s_scan_rec[best].rssi);
+
+    /* Locked on the new BSSID, a failure fall back to a full scan */
+    profile_apply(p);
+    memcpy(wifi_config.sta.bssid, s_scan_rec[best].bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.channel = s_scan_rec[best].primary;
+    wifi_config.sta.bssid_set = true;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+
+    s_roaming = true;
+    wifi_sta_disconnect();
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    wifi_sta_connect();
+}
+
+static void outage_begin(uint8_t reason)
+{
+    if(s_outage_start_us == 0) {
+        s_outage_start_us = esp_timer_get_time();
+        s_outage_reason = reason;
+    }
+}
+
+static void outage_end(void)
+{
+    struct WifiOutage_st *o;
+    int64_t now;
+
+    if(s_outage_start_us == 0)
+        return;
+
+    now = esp_timer_get_time();
+    o = &s_outage[s_outage_cnt % WIFI_OUTAGE_HISTORY];
+    o->at_s = s_outage_start_us / 1000000;
+    o->duration_ms = (now - s_outage_start_us) / 1000;
+    o->reason = s_outage_reason;
+    o->attempts = s_retry_num;
+    o->provisioning = s_ap_active;
+
+    s_outage_cnt++;
+    s_downtime_ms += o->duration_ms;
+    link_monitor_outage(o->duration_ms);
+    s_outage_start_us = 0;
+
+    ESP_LOGW(TAG, "Outage #%u: down %lu ms, reason:%d attempts:%d%s",
+                    s_outage_cnt, o->duration_ms, o->reason, o->attempts,
+                    o->provisioning ? " (recovery AP)" : "");
+}
+
+static void enter_provisioning(void)
+{
+    if(!s_ap_active) {
+        ESP_LOGW(TAG, "Start recovery AP");
+        power_up_set_mode(STARTUP_MODE__AP);
+        wifi_ap_start();
+        s_ap_active = true;
+    }
+
+    wifi_set_state(WIFI_STATE_PROVISIONING);
+}
+
+static void on_connected(void)
+{
+    wifi_set_state(WIFI_STATE_CONNECTED);
+    ESP_LOGI(TAG, "connected to ap SSID:%s", wifi_config.sta.ssid);
+
+    if(s_roaming) {
+        s_roaming = false;
+        s_roam_cnt++;
+        ESP_LOGI(TAG, "Roam done in %lld ms", (esp_timer_get_time() - s_connect_start_us) / 1000);
+    }
+
+    s_weak_link = false;
+    esp_wifi_set_rssi_threshold(s_rssi_min);
+
+    outage_end();
+    s_retry_num = 0;
+    s_backoff_ms = WIFI_BACKOFF_MIN_MS;
+    power_up_set_wrong_pass(false);
+    power_up_set_mode(STARTUP_MODE__STA);
+
+    if(s_ap_active) {
+        ESP_LOGI(TAG, "Stop recovery AP");
+        wifi_ap_stop();
+        s_ap_active = false;
+        power_policy_set_link(true, false);
+    }
+}
+
+/*
+ * Still locked on cached channel and BSSID: AP moved to another channel
+ * or was replaced, retry with a full scan before counting a failure.
+ */
+static bool try_fast_connect_fallback(void)
+{
+    if(!wifi_config.sta.bssid_set || s_last_reason == WIFI_REASON_ASSOC_FAIL)
+        return false;
+
+    fast_connect_fallback();
+    wifi_set_state(WIFI_STATE_CONNECTING);
+    return true;
+}
+
+static void on_connect_failed(void)
+{
+    s_retry_num++;
+    ESP_LOGW(TAG, "Connect to SSID:%s failed, attempt:%d", wifi_config.sta.ssid, s_retry_num);
+    s_roaming = false;
+
+    if(s_ap_active || power_up_get_wrong_pass() || s_retry_num >= ESP_MAXIMUM_RETRY)
+        enter_provisioning();
+    else
+        wifi_set_state(WIFI_STATE_BACKOFF);
+}
+
+/* New credential: apply them without reboot */
+static void on_reload(void)
+{
+    ESP_LOGI(TAG, "Reload Wi-Fi credential");
+
+    if(s_state == WIFI_STATE_CONNECTED)
+        outage_begin(WIFI_REASON_ASSOC_LEAVE);
+
+    s_fast_connect = false;
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    wifi_read_credential();
+    /* AP may be already up: enter_provisioning() won't restart it */
+    wifi_ap_refresh_known();
+
+    s_retry_num = 0;
+    s_backoff_ms = WIFI_BACKOFF_MIN_MS;
+    power_up_set_wrong_pass(false);
+
+    wifi_sta_disconnect();
+    ESP_ERROR_CHECK_WITHOUT_ABORT( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+
+    if(s_have_credential)
+        wifi_sta_connect();
+    else
+        enter_provisioning();
+}
+
+/* Wait for any of `bits`, edge bits are consumed */
+static EventBits_t wait_event(EventBits_t bits, TickType_t wait)
+{
+    EventBits_t got;
+
+    got = xEventGroupWaitBits(s_wifi_event_group, bits, pdFALSE, pdFALSE, wait);
+    xEventGroupClearBits(s_wifi_event_group, got & bits & (WIFI_FAIL_BIT | WIFI_RELOAD_BIT | WIFI_RETRY_BIT | WIFI_ROAM_BIT));
+
+    return got & bits;
+}
+
+/* Delay before the next STA attempt, doubled on each failure */
+static TickType_t backoff_next(void)
+{
+    TickType_t wait = pdMS_TO_TICKS(s_backoff_ms);
+
+    ESP_LOGI(TAG, "Next attempt in %lu ms", s_backoff_ms);
+    s_backoff_ms *= 2;
+    if(s_backoff_ms > WIFI_BACKOFF_MAX_MS)
+        s_backoff_ms = WIFI_BACKOFF_MAX_MS;
+
+    return wait;
+}
+
+static void wifi_setup(void)
 {
     esp_err_t err;
+    int i;
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
 
     s_wifi_event_group = xEventGroupCreate();
+    link_monitor_init();
+    ota_pull_init();
+
+    wifi_read_credential();
+
+    /*
+     * Warm reboot: go straight to the last AP. The PMK is cached by the
+     * driver in NVS (CONFIG_ESP32_WIFI_NVS_ENABLED), no need to keep it here.
+     */
+    for(i = 0; i < s_profile_cnt && !s_fast_connect; i++) {
+        profile_apply(i);
+        s_fast_connect = power_up_get_wifi_hint(wifi_config.sta.ssid, wifi_config.sta.bssid, &wifi_config.sta.channel);
+    }
 
-    err = nvs_read_wifi_credential(wifi_config.sta.ssid, wifi_config.sta.password);
-    if(err != ESP_OK) {
-        power_up_set_mode(STARTUP_MODE__AP);
-        esp_restart();
+    if(!s_fast_connect && s_have_credential)
+        profile_apply(0);
+
+    if(s_fast_connect) {
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+        wifi_config.sta.bssid_set = true;
+        ESP_LOGI(TAG, "Fast connect ch:%d bssid:"MACSTR, wifi_config.sta.channel, MAC2STR(wifi_config.sta.bssid));
     }
 
-    esp_netif_create_default_wifi_sta();
+    s_sta_netif = esp_netif_create_default_wifi_sta();
     err = esp_wifi_init(&cfg);
     ESP_ERROR_CHECK(err);
 
+    esp_timer_create_args_t lease_timer_args = {
+        .callback = lease_timer_cb,
+        .name = "dhcp-lease",
+    };
+    err = esp_timer_create(&lease_timer_args, &s_lease_timer);
+    ESP_ERROR_CHECK(err);
+
     /* Wifi Event */
     err = esp_event_handler_instance_register(  WIFI_EVENT,
                                                 ESP_EVENT_ANY_ID,
@@ -132,44 +795,158 @@ void wifi_init_sta(void)
     err = esp_wifi_set_mode(WIFI_MODE_STA);
     ESP_ERROR_CHECK(err);
 
+    wifi_config.sta.listen_interval = power_policy_listen_interval();
     err = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
     ESP_ERROR_CHECK(err);
 
     err = esp_wifi_start();
     ESP_ERROR_CHECK(err);
+    boot_profile_mark(BOOT_PHASE_WIFI_START);
 
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
+    ESP_LOGI(TAG, "wifi_setup finished.");
 
+    /* Started once, they follow the interface that is up */
     initialise_mdns();
-
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-                 wifi_config.sta.ssid, wifi_config.sta.password);
-        power_up_set_wrong_pass(false);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-                 wifi_config.sta.ssid, wifi_config.sta.password);
-        power_up_set_mode(STARTUP_MODE__AP);
-        esp_restart();
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-        power_up_set_mode(STARTUP_MODE__AP);
-        esp_restart();
-    }
+    start_config_server();
+    gate_mqtt_init();
+    gate_udp_init();
 
     sntp_setoperatingmode(SNTP_OPMODE_POLL);
     sntp_setservername(0, "pool.ntp.org");
     sntp_set_time_sync_notification_cb(time_sync_notification_cb);
-
-    start_config_server();
     sntp_init();
+
     xTaskCreate(http_test_task, "Telegram", 8192, NULL, 10, NULL);
 }
+
+void wifi_connectivity_run(bool provisioning)
+{
+    EventBits_t ev;
+    TickType_t wait;
+
+    wifi_setup();
+
+    if(provisioning || !s_have_credential)
+        enter_provisioning();
+
+    if(s_have_credential)
+        wifi_sta_connect();
+
+    for(;;) {
+        switch (s_state) {
+        case WIFI_STATE_CONNECTING:
+            ev = wait_event(WIFI_CONNECTED_BIT | WIFI_FAIL_BIT | WIFI_RELOAD_BIT, pdMS_TO_TICKS(WIFI_CONNECT_TIMEOUT_MS));
+            if(ev & WIFI_RELOAD_BIT) {
+                on_reload();
+            } else if(ev & WIFI_CONNECTED_BIT) {
+                on_connected();
+            } else {
+                if(ev == 0) {
+                    ESP_LOGW(TAG, "Connect timeout");
+                    esp_wifi_disconnect();
+                }
+                if(!try_fast_connect_fallback())
+                    on_connect_failed();
+            }
+            break;
+
+        case WIFI_STATE_CONNECTED:
+            /* Weak link: check again periodically, the RSSI event fire only once */
+            ev = wait_event(WIFI_FAIL_BIT | WIFI_RELOAD_BIT | WIFI_ROAM_BIT,
+                            s_weak_link ? pdMS_TO_TICKS(ROAM_CHECK_MS) : portMAX_DELAY);
+            if(ev & WIFI_RELOAD_BIT) {
+                on_reload();
+            } else if(ev & WIFI_FAIL_BIT) {
+                outage_begin(s_last_reason);
+                if(!try_fast_connect_fallback())
+                    wifi_sta_connect();
+            } else {
+                roam_check();
+            }
+            break;
+
+        case WIFI_STATE_BACKOFF:
+            ev = wait_event(WIFI_RELOAD_BIT | WIFI_RETRY_BIT, backoff_next());
+            if(ev & WIFI_RELOAD_BIT)
+                on_reload();
+            else
+                wifi_sta_connect();
+            break;
+
+        case WIFI_STATE_PROVISIONING:
+            /*
+             * No SSID: nothing to retry until a new config. Wrong password
+             * is also an AP reboot or a transient assoc fail: still retry,
+             * at the longest backoff, a gate opener must not stay offline
+             */
+            if(!s_have_credential) {
+                wait = portMAX_DELAY;
+            } else if(power_up_get_wrong_pass()) {
+                wait = pdMS_TO_TICKS(WIFI_BACKOFF_MAX_MS);
+                ESP_LOGI(TAG, "Wrong password, next attempt in %d ms", WIFI_BACKOFF_MAX_MS);
+            } else {
+                wait = backoff_next();
+            }
+            ev = wait_event(WIFI_RELOAD_BIT | WIFI_RETRY_BIT, wait);
+
+            if(ev & WIFI_RELOAD_BIT)
+                on_reload();
+            else if(s_have_credential)
+                wifi_sta_connect();
+            break;
+        }
+    }
+}
+
+const char* wifi_known_ssid(int idx)
+{
+    return idx < s_profile_cnt ? s_profile[idx].ssid : NULL;
+}
+
+void wifi_config_reload(void)
+{
+    xEventGroupSetBits(s_wifi_event_group, WIFI_RELOAD_BIT);
+}
+
+void wifi_sta_retry_now(void)
+{
+    xEventGroupSetBits(s_wifi_event_group, WIFI_RETRY_BIT);
+}
+
+void wifi_add_json(struct cJSON *root)
+{
+    cJSON *wifi, *list, *obj;
+    wifi_ap_record_t ap;
+    unsigned i, first;
+
+    wifi = cJSON_AddObjectToObject(root, "wifi");
+    cJSON_AddStringToObject(wifi, "state", state_name[s_state]);
+    cJSON_AddBoolToObject(wifi, "recovery_ap", s_ap_active);
+    cJSON_AddNumberToObject(wifi, "networks", s_profile_cnt);
+    cJSON_AddNumberToObject(wifi, "rssi_min", s_rssi_min);
+    cJSON_AddNumberToObject(wifi, "roams", s_roam_cnt);
+    if(s_state == WIFI_STATE_CONNECTED && esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        cJSON_AddStringToObject(wifi, "ssid", (const char*)ap.ssid);
+        cJSON_AddNumberToObject(wifi, "rssi", ap.rssi);
+        cJSON_AddNumberToObject(wifi, "channel", ap.primary);
+    }
+    cJSON_AddNumberToObject(wifi, "outages", s_outage_cnt);
+    cJSON_AddNumberToObject(wifi, "downtime_ms", s_downtime_ms);
+    if(s_outage_start_us)
+        cJSON_AddNumberToObject(wifi, "current_outage_ms", (esp_timer_get_time() - s_outage_start_us) / 1000);
+
+    /* Oldest first */
+    list = cJSON_AddArrayToObject(wifi, "outage_history");
+    first = (s_outage_cnt > WIFI_OUTAGE_HISTORY) ? s_outage_cnt - WIFI_OUTAGE_HISTORY : 0;
+    for(i = first; i < s_outage_cnt; i++) {
+        const struct WifiOutage_st *o = &s_outage[i % WIFI_OUTAGE_HISTORY];
+
+        obj = cJSON_CreateObject();
+        cJSON_AddNumberToObject(obj, "at_s", o->at_s);
+        cJSON_AddNumberToObject(obj, "duration_ms", o->duration_ms);
+        cJSON_AddNumberToObject(obj, "reason", o->reason);
+        cJSON_AddNumberToObject(obj, "attempts", o->attempts);
+        cJSON_AddBoolToObject(obj, "recovery_ap", o->provisioning);
+        cJSON_AddItemToArray(list, obj);
+    }
+}
@@ -1,15 +1,30 @@
 #ifndef _WIFI_CONFIG_H_
 #define _WIFI_CONFIG_H_
 
+#include <stdbool.h>
 #include "freertos/event_groups.h"
 
 /* Bit related to Wifi `s_wifi_event_group` */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 #define CLOCK_SYNC_DONE    BIT2
+#define WIFI_RELOAD_BIT    BIT3     /* New credential stored */
+#define WIFI_RETRY_BIT     BIT4     /* Configured SSID seen by the recovery scan */
+#define WIFI_ROAM_BIT      BIT5     /* RSSI below `wifi_rssi_min` */
 
 extern EventGroupHandle_t s_wifi_event_group;
 
-void wifi_init_sta(void);
+/* Bring up Wi-Fi and run the connectivity state machine, never return */
+void wifi_connectivity_run(bool provisioning);
+
+/* SSID of the known network `idx`, NULL past the last. Net-start task only */
+const char* wifi_known_ssid(int idx);
+
+void wifi_config_reload(void);
+void wifi_sta_retry_now(void);
+
+/* Add `wifi` state and outage history to `root` */
+struct cJSON;
+void wifi_add_json(struct cJSON *root);
 
 #endif
@@ -7,20 +7,50 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "lwip/err.h"
 #include "lwip/sys.h"
 #include "config.h"
+#include "wifi_config.h"
+#include "boot_profile.h"
 #include "cJSON.h"
 
 #define WIFI_SSID           "esp-recovery"
 #define WIFI_PASS           "recovery-esp"
 #define WIFI_ERASE_SSID     "esp-erase-cfg"
 
+/*
+ * Recovery scan: every SCAN_INTERVAL_MS one all-channel scan filtered on
+ * each known SSID (`wifi_ssid` and the profiles), until one is found. The
+ * driver answer only for that SSID, dwell time can be short. Every
+ * SCAN_FULL_EVERY rounds (or every round without SSID) a full scan refresh
+ * the list served by /api/v1/ap-list and look for the erase AP.
+ */
+#define SCAN_INTERVAL_MS        15000
+#define SCAN_FULL_EVERY         8
+#define SCAN_MAX_AP             16
+#define SCAN_KNOWN_MAX          (APP_CFG_WIFI_PROFILE_CNT + 1)
+
+/* Directed probe request: AP answer in a few ms */
+#define SCAN_FILTER_ACTIVE_MIN  20
+#define SCAN_FILTER_ACTIVE_MAX  60
+#define SCAN_FULL_ACTIVE_MIN    40
+#define SCAN_FULL_ACTIVE_MAX    120
+/* Back on AP channel between two scanned channels, keep clients connected */
+#define SCAN_HOME_DWELL_MS      30
+
 static const char *TAG = "wifi softAP";
-static uint8_t ssid[32];
-static wifi_ap_record_t *ap_list;
+/* Written by wifi_ap_refresh_known() with `known_lock` */
+static uint8_t known_ssid[SCAN_KNOWN_MAX][APP_CFG_SSID_SZ];
+static int known_cnt;
+static portMUX_TYPE known_lock = portMUX_INITIALIZER_UNLOCKED;
+/* Copy taken at each scan round, scan task only */
+static uint8_t round_ssid[SCAN_KNOWN_MAX][APP_CFG_SSID_SZ];
+static int round_cnt;
+static wifi_ap_record_t ap_list[SCAN_MAX_AP];
 static int ap_no = -1;
+static volatile bool scan_enabled;
 
 bool get_scan_ap_no(int *p_ap_no, wifi_ap_record_t **p_ap_list)
 {
@@ -31,85 +61,141 @@ bool get_scan_ap_no(int *p_ap_no, wifi_ap_record_t **p_ap_list)
 }
 
 static void erase_all_config() {
-    nvs_handle_t nvs_handle;
     esp_err_t err;
 
-    err = nvs_open(NVS_NAME, NVS_READONLY, &nvs_handle);
+    err = app_config_erase();
     if(err != ESP_OK)
-        goto err;
-
-    nvs_erase_all(nvs_handle);
-    nvs_close(nvs_handle);
+        ESP_LOGE(TAG, "Can't erase configuration:%s", esp_err_to_name(err));
 
-err:
-    ESP_LOGE(TAG, "Can't read credentials");
-    memset(ssid, 0, sizeof(ssid));
+    portENTER_CRITICAL(&known_lock);
+    known_cnt = 0;
+    portEXIT_CRITICAL(&known_lock);
+    round_cnt = 0;
 }
 
-static void wifi_event_scandone_cb(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+static bool is_known(const uint8_t *ssid)
 {
-    uint16_t apCount = 0, i;
+    int i;
 
-    if(ap_list != NULL) {
-        ap_no = 0;
-        free(ap_list);
-        ap_list = NULL;
+    for(i = 0; i < round_cnt; i++) {
+        if(strncmp((const char*)ssid, (const char*)round_ssid[i], 32) == 0)
+            return true;
     }
 
-    esp_wifi_scan_get_ap_num(&apCount);
-    if (apCount == 0) {
-        return;
+    return false;
+}
+
+/* True when a known network was found */
+static bool check_ap_record(const wifi_ap_record_t *r)
+{
+    /* AP was search for found */
+    if(is_known(r->ssid)) {
+        /* Wrong password: seeing the AP does not help, the STA retry at the longest backoff */
+        if(power_up_get_wrong_pass())
+            return false;
+
+        ESP_LOGI(TAG, "Found: `%s` ch:%d rssi:%d retry connect with ap", r->ssid, r->primary, r->rssi);
+        wifi_sta_retry_now();
+        return true;
+    } else if (strcmp((char*)r->ssid, WIFI_ERASE_SSID) == 0) {
+        ESP_LOGW(TAG, "Found erase network");
+        erase_all_config();
     }
 
-    ap_list = (wifi_ap_record_t *)malloc(sizeof(wifi_ap_record_t) * apCount);
-    if (!ap_list) {
-        ESP_LOGE(TAG, "malloc error, ap_list is NULL");
-        return;
+    return false;
+}
+
+/*
+ * Read the records right after the blocking scan, in this task: a
+ * WIFI_EVENT_SCAN_DONE handler would also steal the results of the scans
+ * started by the station for network selection and roaming.
+ */
+static bool scan_done(const wifi_scan_config_t *config)
+{
+    static wifi_ap_record_t found;
+    bool known = false;
+    uint16_t n, i;
+
+    /* Filtered: only that SSID, keep the list of the last full scan */
+    if(config->ssid) {
+        n = 1;
+        if(esp_wifi_scan_get_ap_records(&n, &found) == ESP_OK && n)
+            known = check_ap_record(&found);
+        else
+            ESP_LOGD(TAG, "AP:%s not found", config->ssid);
+
+        esp_wifi_clear_ap_list();
+        return known;
     }
 
-    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&apCount, ap_list));
-    for(i = 0; i < apCount; i++) {
-        wifi_ap_record_t *r = &ap_list[i];
-
-        /* AP was search for found */
-        if( strcmp((char*)&r->ssid, (char*)ssid) == 0) {
-            ESP_LOGI(TAG, "Found: `%s` Restart and connect with ap", r->ssid);
-            power_up_data.data.mode = STARTUP_MODE__STA;
-            power_up_set_mode(STARTUP_MODE__STA);
-
-            esp_restart();
-        } else if (strcmp((char*)&r->ssid, WIFI_ERASE_SSID) == 0) {
-            ESP_LOGW(TAG, "Found erase network");
-            erase_all_config();
-        } else {
-            ESP_LOGW(TAG, "Can't found AP:%s", ssid);
-        }
+    n = SCAN_MAX_AP;
+    if(esp_wifi_scan_get_ap_records(&n, ap_list) != ESP_OK)
+        n = 0;
+
+    for(i = 0; i < n; i++)
+        known |= check_ap_record(&ap_list[i]);
+
+    ap_no = n;
+    esp_wifi_clear_ap_list();
+    return known;
+}
+
+static bool scan_one(wifi_scan_config_t *config, const uint8_t *ssid)
+{
+    int64_t start = esp_timer_get_time();
+
+    config->ssid = (uint8_t*)ssid;
+    if(ssid) {
+        config->scan_time.active.min = SCAN_FILTER_ACTIVE_MIN;
+        config->scan_time.active.max = SCAN_FILTER_ACTIVE_MAX;
+    } else {
+        config->scan_time.active.min = SCAN_FULL_ACTIVE_MIN;
+        config->scan_time.active.max = SCAN_FULL_ACTIVE_MAX;
     }
 
-    ap_no = apCount;
-    ESP_ERROR_CHECK( esp_wifi_clear_ap_list() );
+    /* Fail while the STA is connecting, next round will do */
+    if(ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_scan_start(config, true)) != ESP_OK)
+        return false;
+
+    ESP_LOGI(TAG, "%s scan in %lld ms", ssid ? "Filtered" : "Full", (esp_timer_get_time() - start) / 1000);
+    return scan_done(config);
 }
 
 static void search_network_task(void* arg) {
-    static wifi_scan_config_t config;
-    config.scan_time.active.max = 200;
-    config.scan_time.active.max = 250;
-    config.scan_time.passive = 150;
-
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &wifi_event_scandone_cb, &config));
+    static wifi_scan_config_t config = {
+        .channel = 0,                   /* All channels in one scan */
+        .show_hidden = false,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .home_chan_dwell_time = SCAN_HOME_DWELL_MS,
+    };
+    unsigned round = 0;
 
     while (true) {
-        int i;
-        ESP_LOGI(TAG, "Search network scan!");
-        if(!power_up_get_wrong_pass()) {
-            for(i = 0; i < 14; i++) {
-                config.channel = i;
-                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_scan_start(&config, true));
-                vTaskDelay( pdMS_TO_TICKS(250) );
+        if(scan_enabled) {
+            bool full;
+            int i;
+
+            /* New credential may come at any time through this same AP */
+            portENTER_CRITICAL(&known_lock);
+            memcpy(round_ssid, known_ssid, sizeof(round_ssid));
+            round_cnt = known_cnt;
+            portEXIT_CRITICAL(&known_lock);
+
+            full = round_cnt == 0 || power_up_get_wrong_pass() || round % SCAN_FULL_EVERY == 0;
+
+            if(full) {
+                scan_one(&config, NULL);
+            } else {
+                for(i = 0; i < round_cnt && scan_enabled; i++) {
+                    if(scan_one(&config, round_ssid[i]))
+                        break;
+                }
             }
+
+            round++;
         }
 
-        vTaskDelay( pdMS_TO_TICKS(15000) );
+        vTaskDelay( pdMS_TO_TICKS(SCAN_INTERVAL_MS) );
     }
 }
 
@@ -127,18 +213,24 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
     }
 }
 
-void wifi_init_softap(void)
+void wifi_ap_refresh_known(void)
 {
-    esp_netif_create_default_wifi_ap();
+    uint8_t ssid[SCAN_KNOWN_MAX][APP_CFG_SSID_SZ];
+    int cnt;
 
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    memset(ssid, 0, sizeof(ssid));
+    for(cnt = 0; cnt < SCAN_KNOWN_MAX && wifi_known_ssid(cnt); cnt++)
+        strlcpy((char*)ssid[cnt], wifi_known_ssid(cnt), sizeof(ssid[0]));
 
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        NULL));
+    portENTER_CRITICAL(&known_lock);
+    memcpy(known_ssid, ssid, sizeof(known_ssid));
+    known_cnt = cnt;
+    portEXIT_CRITICAL(&known_lock);
+}
+
+void wifi_ap_start(void)
+{
+    static bool init;
 
     wifi_config_t wifi_config = {
         .ap = {
@@ -156,22 +248,33 @@ void wifi_init_softap(void)
         wifi_config.ap.authmode = WIFI_AUTH_OPEN;
     }
 
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    if(!init) {
+        esp_netif_create_default_wifi_ap();
+
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                            ESP_EVENT_ANY_ID,
+                                                            &wifi_event_handler,
+                                                            NULL,
+                                                            NULL));
 
-    nvs_read_wifi_credential(ssid, NULL);
-    start_config_server();
+        xTaskCreate(search_network_task, "scan-networks", 2048, NULL, 10, NULL);
+        init = true;
+    }
 
-    ESP_LOGI(TAG, "AP start");
-    initialise_mdns();
+    /* Networks may have changed since last time */
+    wifi_ap_refresh_known();
 
-    ESP_LOGI(TAG, "wifi_init_softap finished. SSID:%s password:%s", WIFI_SSID, WIFI_PASS);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_mode(WIFI_MODE_APSTA));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
+    scan_enabled = true;
 
-    xTaskCreate(search_network_task, "scan-networks", 2048, NULL, 10, NULL);
+    ESP_LOGI(TAG, "AP start. SSID:%s password:%s", WIFI_SSID, WIFI_PASS);
+}
 
-    vTaskDelay(pdMS_TO_TICKS(60000));
+void wifi_ap_stop(void)
+{
+    scan_enabled = false;
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_mode(WIFI_MODE_STA));
 
-    power_up_set_mode(STARTUP_MODE__STA);
-    esp_restart();
+    ESP_LOGI(TAG, "AP stop");
 }
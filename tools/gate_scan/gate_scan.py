@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+"""
+List every gate opener on the LAN with a single mDNS query (main/gate_mdns.c)
+
+    gate_scan.py                 one _gate._tcp browse, table of the answers
+    gate_scan.py --watch         then print each state change announced
+
+No dependency: the query is sent from a random port (legacy unicast), the
+boards answer directly with PTR, SRV, TXT and A records. --watch listen on
+5353 for the announcements sent when the TXT `state` change.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import time
+
+MDNS_ADDR = "224.0.0.251"
+MDNS_PORT = 5353
+SERVICE = "_gate._tcp.local"
+
+T_A, T_PTR, T_TXT, T_SRV = 1, 12, 16, 33
+
+
+def encode_name(name):
+    out = b""
+    for label in name.strip(".").split("."):
+        out += bytes([len(label)]) + label.encode()
+    return out + b"\0"
+
+
+def build_query(name):
+    return struct.pack(">HHHHHH", 0, 0, 1, 0, 0, 0) + encode_name(name) + struct.pack(">HH", T_PTR, 1)
+
+
+def read_name(data, off):
+    labels = []
+    jumped = False
+    end = off
+    for _ in range(64):
+        n = data[off]
+        if n & 0xc0 == 0xc0:
+            if not jumped:
+                end = off + 2
+            off = ((n & 0x3f) << 8) | data[off + 1]
+            jumped = True
+        elif n == 0:
+            if not jumped:
+                end = off + 1
+            return ".".join(labels), end
+        else:
+            labels.append(data[off + 1:off + 1 + n].decode(errors="replace"))
+            off += 1 + n
+    raise ValueError("name loop")
+
+
+def parse(data):
+    """Return the list of (name, type, value) of all the records"""
+    _, flags, qd, an, ns, ar = struct.unpack(">HHHHHH", data[:12])
+    off = 12
+    for _ in range(qd):
+        _, off = read_name(data, off)
+        off += 4
+
+    records = []
+    for _ in range(an + ns + ar):
+        name, off = read_name(data, off)
+        rtype, _, _, rdlen = struct.unpack(">HHIH", data[off:off + 10])
+        off += 10
+        rdata = data[off:off + rdlen]
+
+        if rtype == T_PTR:
+            value = read_name(data, off)[0]
+        elif rtype == T_SRV:
+            _, _, port = struct.unpack(">HHH", rdata[:6])
+            value = (read_name(data, off + 6)[0], port)
+        elif rtype == T_TXT:
+            value = {}
+            i = 0
+            while i < len(rdata):
+                item = rdata[i + 1:i + 1 + rdata[i]].decode(errors="replace")
+                i += 1 + rdata[i]
+                k, _, v = item.partition("=")
+                value[k] = v
+        elif rtype == T_A and rdlen == 4:
+            value = socket.inet_ntoa(rdata)
+        else:
+            value = None
+
+        off += rdlen
+        if value is not None:
+            records.append((name.lower(), rtype, value))
+
+    return records
+
+
+class Fleet:
+    def __init__(self):
+        self.instances = set()
+        self.srv = {}
+        self.txt = {}
+        self.addr = {}
+
+    def add(self, records):
+        """Add records, return the instances whose TXT changed"""
+        changed = []
+        for name, rtype, value in records:
+            if rtype == T_PTR and name == SERVICE.lower():
+                self.instances.add(value.lower())
+            elif rtype == T_SRV:
+                self.srv[name] = value
+            elif rtype == T_TXT:
+                if name.endswith(SERVICE.lower()) and self.txt.get(name) != value:
+                    changed.append(name)
+                self.txt[name] = value
+            elif rtype == T_A:
+                self.addr[name] = value
+        return changed
+
+    def row(self, inst):
+        txt = self.txt.get(inst, {})
+        target, port = self.srv.get(inst, ("?", 0))
+        ip = self.addr.get(target.lower(), "?")
+        label = inst[:-len(SERVICE) - 1] if inst.endswith(SERVICE.lower()) else inst
+        return "%-24s %-15s %-6s %-10s %-8s %-7s %s" % (
+            label, ip, txt.get("id", "?"), txt.get("fw", "?"), txt.get("state", "?"),
+            txt.get("lines", "?"), target)
+
+
+def scan(fleet, timeout):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 255)
+    sock.settimeout(0.2)
+    sock.sendto(build_query(SERVICE), (MDNS_ADDR, MDNS_PORT))
+
+    end = time.time() + timeout
+    while time.time() < end:
+        try:
+            data, _ = sock.recvfrom(9000)
+        except socket.timeout:
+            continue
+        try:
+            fleet.add(parse(data))
+        except (ValueError, IndexError, struct.error):
+            pass
+    sock.close()
+
+
+def watch(fleet):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if hasattr(socket, "SO_REUSEPORT"):
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    sock.bind(("", MDNS_PORT))
+    mreq = socket.inet_aton(MDNS_ADDR) + socket.inet_aton("0.0.0.0")
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+
+    while True:
+        data, _ = sock.recvfrom(9000)
+        try:
+            changed = fleet.add(parse(data))
+        except (ValueError, IndexError, struct.error):
+            continue
+        for inst in changed:
+            fleet.instances.add(inst)
+            print(time.strftime("%H:%M:%S"), fleet.row(inst), flush=True)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--timeout", type=float, default=2.0, help="second waiting for answers")
+    ap.add_argument("--watch", action="store_true", help="print state changes until Ctrl-C")
+    args = ap.parse_args()
+
+    fleet = Fleet()
+    scan(fleet, args.timeout)
+
+    print("%-24s %-15s %-6s %-10s %-8s %-7s %s" % ("name", "ip", "id", "fw", "state", "lines", "host"))
+    for inst in sorted(fleet.instances):
+        print(fleet.row(inst))
+
+    if args.watch:
+        try:
+            watch(fleet)
+        except KeyboardInterrupt:
+            pass
+
+    return 0 if fleet.instances else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+"""
+UDP door open: load generator and client (main/gate_udp.c)
+
+    gate_udp.py --host 192.168.1.50 --key <hex> ping --duration 10
+    gate_udp.py --host 192.168.1.50 --key <hex> ping --rate 200
+    gate_udp.py --host 192.168.1.50 --key <hex> ping --window 8
+    gate_udp.py --host 192.168.1.50 --key <hex> open p1
+
+`ping` is signed and checked like an open but does not move the gate.
+Without --rate it is closed loop with --window frames in flight: the
+rate is the most the board answer. With --rate it is paced and the loss
+is what the board or the network drop at that rate. Round trip from
+send to the answer, the answer MAC is checked.
+
+`open` take the session with a ping, then send the open. The nonce is
+the unix time in us, it grow also across runs of the script.
+"""
+
+import argparse
+import hashlib
+import hmac
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+
+VERSION = 1
+T_OPEN, T_PING = 1, 2
+REQ_SZ, ACK_SZ, ACK_MAC_SZ = 56, 40, 16
+# enum DoorResult of main/door_result.h
+RESULTS = ["ok", "bad_request", "no_key", "bad_mac", "bad_session", "replay", "busy", "no_clock", "stale"]
+LINES = {"p1": 1, "p2": 2, "all": 3}
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def frame(key, ftype, lines, session, nonce):
+    head = b"GU" + struct.pack(">BBB3xQQ", VERSION, ftype, lines, session, nonce)
+    return head + hmac.new(key, head, hashlib.sha256).digest()
+
+
+def parse_ack(key, data):
+    """(type, result, session, nonce) of a good answer, None otherwise"""
+    if len(data) != ACK_SZ or data[:2] != b"GU":
+        return None
+    mac = hmac.new(key, data[:24], hashlib.sha256).digest()[:ACK_MAC_SZ]
+    if not hmac.compare_digest(mac, data[24:]):
+        return None
+    version, ftype, result, session, nonce = struct.unpack(">BBB3xQQ", data[2:24])
+    if version != VERSION:
+        return None
+    return ftype & 0x7f, result, session, nonce
+
+
+def result_name(r):
+    return RESULTS[r] if r < len(RESULTS) else "unknown(%d)" % r
+
+
+class Pinger:
+    def __init__(self, sock, key):
+        self.sock, self.key = sock, key
+        self.sent = {}
+        self.rtt = []
+        self.bad = 0
+        self.lock = threading.Lock()
+        self.done = threading.Event()
+        self.credit = threading.Semaphore(0)
+
+    def send(self, seq):
+        with self.lock:
+            self.sent[seq] = time.perf_counter()
+        self.sock.send(frame(self.key, T_PING, 0, 0, seq))
+
+    def receiver(self):
+        self.sock.settimeout(0.2)
+        while not self.done.is_set():
+            try:
+                data = self.sock.recv(256)
+            except socket.timeout:
+                continue
+            except OSError:
+                # ICMP unreachable of an earlier frame
+                continue
+            now = time.perf_counter()
+            ack = parse_ack(self.key, data)
+            if ack is None or ack[0] != T_PING:
+                self.bad += 1
+                continue
+            with self.lock:
+                t = self.sent.pop(ack[3], None)
+            if t is not None:
+                self.rtt.append((now - t) * 1000)
+                self.credit.release()
+
+
+def cmd_ping(sock, key, args):
+    p = Pinger(sock, key)
+    rx = threading.Thread(target=p.receiver, daemon=True)
+    rx.start()
+
+    seq = 0
+    start = time.perf_counter()
+    end = start + args.duration
+
+    if args.rate > 0:
+        period = 1.0 / args.rate
+        while time.perf_counter() < end:
+            seq += 1
+            p.send(seq)
+            wait = start + seq * period - time.perf_counter()
+            if wait > 0:
+                time.sleep(wait)
+    else:
+        for _ in range(args.window):
+            seq += 1
+            p.send(seq)
+        while time.perf_counter() < end:
+            # A lost frame give back its credit after the timeout
+            if not p.credit.acquire(timeout=args.timeout):
+                with p.lock:
+                    p.sent.clear()
+                for _ in range(args.window):
+                    seq += 1
+                    p.send(seq)
+                continue
+            seq += 1
+            p.send(seq)
+
+    elapsed = time.perf_counter() - start
+    time.sleep(args.timeout)
+    p.done.set()
+    rx.join()
+
+    got = len(p.rtt)
+    print("sent %d  answered %d  lost %d (%.2f%%)  bad answer %d" % (
+        seq, got, seq - got, 100.0 * (seq - got) / max(seq, 1), p.bad))
+    print("rate sent %.0f/s  answered %.0f/s" % (seq / elapsed, got / elapsed))
+    if p.rtt:
+        print("rtt ms  min %.2f  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f" % (
+            min(p.rtt), percentile(p.rtt, 50), percentile(p.rtt, 95), percentile(p.rtt, 99), max(p.rtt)))
+
+    return 0 if got and (seq - got) <= seq * args.max_loss / 100 else 1
+
+
+def request(sock, key, data, nonce, timeout):
+    """Send and wait the answer with the same nonce, (ack, ms) or (None, None)"""
+    start = time.perf_counter()
+    sock.send(data)
+    sock.settimeout(timeout)
+    end = time.time() + timeout
+    while time.time() < end:
+        try:
+            ack = parse_ack(key, sock.recv(256))
+        except socket.timeout:
+            break
+        if ack is not None and ack[3] == nonce:
+            return ack, (time.perf_counter() - start) * 1000
+    return None, None
+
+
+def cmd_open(sock, key, args):
+    ack, ms = request(sock, key, frame(key, T_PING, 0, 0, 0), 0, args.timeout)
+    if ack is None:
+        print("no answer to ping: host, port or key")
+        return 1
+    session = ack[2]
+    print("session %016x, ping %.2f ms" % (session, ms))
+
+    last = 0
+    for i in range(args.n):
+        for _ in range(2):
+            nonce = max(time.time_ns() // 1000, last + 1)
+            last = nonce
+            ack, ms = request(sock, key, frame(key, T_OPEN, LINES[args.line], session, nonce), nonce, args.timeout)
+            if ack is None:
+                print("open %s: no answer" % args.line)
+                return 1
+            # Board rebooted since the ping: once more with its session
+            if result_name(ack[1]) != "bad_session":
+                break
+            session = ack[2]
+
+        print("open %s: %s in %.2f ms" % (args.line, result_name(ack[1]), ms))
+        if ack[1] != 0:
+            return 1
+        if i + 1 < args.n:
+            time.sleep(args.interval)
+
+    return 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--host", required=True)
+    ap.add_argument("--port", type=int, default=4210)
+    ap.add_argument("--key", default=os.environ.get("GATE_LAN_KEY"), help="hex, from /chiave_lan (or GATE_LAN_KEY)")
+    ap.add_argument("--timeout", type=float, default=1.0, help="second waiting an answer")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("ping", help="load: signed ping, round trip and rate")
+    p.add_argument("--duration", type=float, default=5.0)
+    p.add_argument("--rate", type=float, default=0, help="frame/s paced, 0: closed loop")
+    p.add_argument("--window", type=int, default=1, help="frames in flight in closed loop")
+    p.add_argument("--max-loss", type=float, default=1.0, help="percent, above exit 1")
+
+    p = sub.add_parser("open", help="open a line")
+    p.add_argument("line", choices=sorted(LINES))
+    p.add_argument("-n", type=int, default=1)
+    p.add_argument("--interval", type=float, default=5.0, help="second between opens")
+
+    args = ap.parse_args()
+    if not args.key:
+        ap.error("--key is required")
+    key = bytes.fromhex(args.key)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.connect((socket.gethostbyname(args.host), args.port))
+
+    if args.cmd == "ping":
+        return cmd_ping(sock, key, args)
+    return cmd_open(sock, key, args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+API latency while an OTA upload runs (main/http_async.c)
+
+Poll an API URI at a fixed rate, upload an image to /ota in the middle and
+compare the latency before, during and after the upload:
+
+    http_latency.py --host apri-cancello.local --image build/Apri-cancello.bin
+    http_latency.py --host 192.168.1.50 --path /api/v1/ap-list --settle 10
+
+The board boots the image only at the next reset, upload the running one
+to leave it as it is. Exit 1 when the p95 during the upload is more than
+--max-ratio times the one before, or a poll fail.
+"""
+
+import argparse
+import hashlib
+import http.client
+import os
+import sys
+import threading
+import time
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+class Poller(threading.Thread):
+    def __init__(self, host, port, path, interval, timeout):
+        super().__init__(daemon=True)
+        self.host, self.port, self.path = host, port, path
+        self.interval, self.timeout = interval, timeout
+        self.phase = "before"
+        self.samples = {}
+        self.errors = {}
+        self.stop = threading.Event()
+
+    def run(self):
+        while not self.stop.is_set():
+            phase = self.phase
+            start = time.perf_counter()
+            try:
+                conn = http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+                conn.request("GET", self.path)
+                resp = conn.getresponse()
+                resp.read()
+                conn.close()
+                if resp.status != 200:
+                    raise OSError("status %d" % resp.status)
+                self.samples.setdefault(phase, []).append((time.perf_counter() - start) * 1000)
+            except OSError as e:
+                self.errors[phase] = self.errors.get(phase, 0) + 1
+                print("poll %s: %s" % (phase, e))
+
+            left = self.interval - (time.perf_counter() - start)
+            if left > 0:
+                self.stop.wait(left)
+
+
+def upload(host, port, image, timeout):
+    with open(image, "rb") as f:
+        data = f.read()
+
+    start = time.perf_counter()
+    conn = http.client.HTTPConnection(host, port, timeout=timeout)
+    conn.putrequest("POST", "/ota")
+    conn.putheader("Content-Length", str(len(data)))
+    conn.putheader("X-Image-SHA256", hashlib.sha256(data).hexdigest())
+    conn.endheaders()
+    for i in range(0, len(data), 4096):
+        conn.send(data[i:i + 4096])
+    resp = conn.getresponse()
+    body = resp.read().decode(errors="replace")
+    conn.close()
+
+    return resp.status, body, time.perf_counter() - start, len(data)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--host", required=True)
+    ap.add_argument("--port", type=int, default=80)
+    ap.add_argument("--path", default="/api/v1/system/info", help="URI polled")
+    ap.add_argument("--image", help="image uploaded to /ota, without it only the baseline")
+    ap.add_argument("--interval", type=float, default=0.2, help="second between poll")
+    ap.add_argument("--settle", type=float, default=5.0, help="second polled before and after the upload")
+    ap.add_argument("--timeout", type=float, default=10.0)
+    ap.add_argument("--max-ratio", type=float, default=3.0)
+    args = ap.parse_args()
+
+    if args.image and not os.path.isfile(args.image):
+        ap.error("%s not found" % args.image)
+
+    poller = Poller(args.host, args.port, args.path, args.interval, args.timeout)
+    poller.start()
+    time.sleep(args.settle)
+
+    if args.image:
+        poller.phase = "ota"
+        status, body, elapsed, size = upload(args.host, args.port, args.image, 120)
+        print("upload %d byte in %.1f s: %d %s" % (size, elapsed, status, body.strip()))
+        poller.phase = "after"
+        time.sleep(args.settle)
+
+    poller.stop.set()
+    poller.join()
+
+    print("%-7s %5s %5s %8s %8s %8s" % ("phase", "n", "fail", "p50 ms", "p95 ms", "max ms"))
+    for phase in ("before", "ota", "after"):
+        s = poller.samples.get(phase, [])
+        if not s and phase not in poller.errors:
+            continue
+        print("%-7s %5d %5d %8.1f %8.1f %8.1f" % (phase, len(s), poller.errors.get(phase, 0),
+              percentile(s, 50), percentile(s, 95), max(s) if s else float("nan")))
+
+    if sum(poller.errors.values()):
+        return 1
+
+    base = percentile(poller.samples.get("before", []), 95)
+    ota = percentile(poller.samples.get("ota", []), 95)
+    if args.image and ota > base * args.max_ratio:
+        print("p95 during upload %.1f ms is over %.1fx the baseline %.1f ms" % (ota, args.max_ratio, base))
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
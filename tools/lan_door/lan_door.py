@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""
+Open the gate from the LAN, POST /api/v1/door/open (main/lan_door.c)
+
+The key is the hex string the board send on Telegram `/chiave_lan`:
+
+    lan_door.py --host apri-cancello.local --key <64 hex digit> [--line all]
+    lan_door.py --host 192.168.1.50 --key-file ~/.gate-key -n 20 --interval 5
+
+Every request is signed with the PC clock, keep it in sync (NTP) with the
+board, at most 30 s apart. A board without clock (no SNTP since boot)
+answer no_clock with its session: the request is sent again signed with
+it, then every next one. The time printed is connect, request and answer:
+the board answer once the request is queued, not when the gate moved. The
+board side latency is in /metrics, gate_actuation_latency_seconds{source="lan"}.
+"""
+
+import argparse
+import hashlib
+import hmac
+import http.client
+import json
+import statistics
+import sys
+import time
+
+
+def sign(key, line, time_ms, session=None):
+    msg = "open:%s:%d" % (line, time_ms)
+    if session:
+        msg += ":" + session
+    return hmac.new(key, msg.encode(), hashlib.sha256).hexdigest()
+
+
+class Session:
+    """Board session and last nonce, when the board has no clock"""
+    def __init__(self):
+        self.id = None
+        self.nonce = 0
+
+
+def door_open(host, port, key, line, timeout, sess):
+    # With a session the time is a nonce, it must grow
+    time_ms = int(time.time() * 1000)
+    if sess.id:
+        time_ms = max(time_ms, sess.nonce + 1)
+        sess.nonce = time_ms
+    headers = {
+        "X-Gate-Line": line,
+        "X-Gate-Time": str(time_ms),
+        "X-Gate-Mac": sign(key, line, time_ms, sess.id),
+        "Content-Length": "0",
+    }
+    if sess.id:
+        headers["X-Gate-Session"] = sess.id
+
+    start = time.perf_counter()
+    conn = http.client.HTTPConnection(host, port, timeout=timeout)
+    try:
+        conn.request("POST", "/api/v1/door/open", headers=headers)
+        resp = conn.getresponse()
+        body = resp.read()
+    finally:
+        conn.close()
+    elapsed = time.perf_counter() - start
+
+    try:
+        answer = json.loads(body)
+        result = answer.get("result", "?")
+    except ValueError:
+        answer = {}
+        result = body.decode(errors="replace")
+
+    # Board without clock or rebooted: the caller retry with the session
+    if result in ("no_clock", "bad_session") and answer.get("session"):
+        sess.id = answer["session"]
+        sess.nonce = 0
+
+    return resp.status, result, elapsed
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--host", required=True)
+    ap.add_argument("--port", type=int, default=80)
+    ap.add_argument("--key", help="key as hex string")
+    ap.add_argument("--key-file", help="file with the key as hex string")
+    ap.add_argument("--line", default="all", choices=("p1", "p2", "all"))
+    ap.add_argument("-n", "--count", type=int, default=1, help="request to send")
+    ap.add_argument("--interval", type=float, default=5.0, help="second between request")
+    ap.add_argument("--timeout", type=float, default=5.0)
+    args = ap.parse_args()
+
+    if args.key_file:
+        with open(args.key_file) as f:
+            key_hex = f.read().strip()
+    elif args.key:
+        key_hex = args.key
+    else:
+        ap.error("--key or --key-file is needed")
+
+    key = bytes.fromhex(key_hex)
+    if len(key) != 32:
+        ap.error("key must be 32 byte, 64 hex digit")
+
+    sess = Session()
+    times = []
+    fail = 0
+    for i in range(args.count):
+        if i:
+            time.sleep(args.interval)
+        try:
+            status, result, elapsed = door_open(args.host, args.port, key, args.line, args.timeout, sess)
+            if result in ("no_clock", "bad_session") and sess.id:
+                print("%3d %d %-12s session %s, again" % (i, status, result, sess.id))
+                status, result, elapsed = door_open(args.host, args.port, key, args.line, args.timeout, sess)
+        except OSError as e:
+            print("%3d error %s" % (i, e))
+            fail += 1
+            continue
+
+        print("%3d %d %-12s %7.1f ms" % (i, status, result, elapsed * 1000))
+        if status == 200:
+            times.append(elapsed)
+        else:
+            fail += 1
+
+    if len(times) > 1:
+        ms = sorted(t * 1000 for t in times)
+        print("ok:%d fail:%d min:%.1f ms median:%.1f ms max:%.1f ms"
+              % (len(ms), fail, ms[0], statistics.median(ms), ms[-1]))
+
+    return 1 if fail else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
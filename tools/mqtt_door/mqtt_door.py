@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+"""
+Open the gate over MQTT and time it (main/gate_mqtt.c)
+
+    mqtt_door.py --broker 192.168.1.10 --prefix gate/door-lock --line p1
+    mqtt_door.py --broker 192.168.1.10 --user ha --password x -n 10 --interval 6
+
+Publish {"t": <unix ms>} on <prefix>/<line>/open with QoS 1, then wait the
+board answer on <prefix>/event/mqtt and the actuation start on
+<prefix>/event/gate. Times are from the publish: PUBACK is the broker,
+`result` and `start` went through the board and back, an upper bound of
+the LAN path. Exit 1 when a command fail or the p95 to `start` is over
+--max-ms.
+
+No dependency, MQTT 3.1.1 over a plain socket. The board clock must be
+in sync (SNTP) with this PC, or the command is refused as stale (no_clock
+before the board first sync).
+"""
+
+import argparse
+import json
+import socket
+import struct
+import sys
+import time
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def mqtt_str(s):
+    b = s.encode()
+    return struct.pack(">H", len(b)) + b
+
+
+def packet(kind, body):
+    n = len(body)
+    rlen = b""
+    while True:
+        byte = n & 0x7f
+        n >>= 7
+        rlen += bytes([byte | (0x80 if n else 0)])
+        if not n:
+            return bytes([kind]) + rlen + body
+
+
+class Client:
+    def __init__(self, host, port, client_id, user, password, timeout):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        self.buf = b""
+        self.pid = 0
+
+        flags = 0x02
+        payload = mqtt_str(client_id)
+        if user is not None:
+            flags |= 0x80
+            payload += mqtt_str(user)
+            if password is not None:
+                flags |= 0x40
+                payload += mqtt_str(password)
+        self.sock.sendall(packet(0x10, mqtt_str("MQTT") + bytes([4, flags]) + struct.pack(">H", 60) + payload))
+
+        kind, body = self.read(timeout)
+        if kind != 0x20 or body[1] != 0:
+            raise OSError("connect refused, code %d" % body[1])
+
+    def next_pid(self):
+        self.pid = self.pid % 0xffff + 1
+        return self.pid
+
+    def subscribe(self, topic):
+        pid = self.next_pid()
+        self.sock.sendall(packet(0x82, struct.pack(">H", pid) + mqtt_str(topic) + b"\x01"))
+
+    def publish(self, topic, payload):
+        pid = self.next_pid()
+        self.sock.sendall(packet(0x32, mqtt_str(topic) + struct.pack(">H", pid) + payload.encode()))
+        return pid
+
+    def read(self, timeout):
+        """Next packet as (type, body), None on timeout"""
+        end = time.time() + timeout
+        while True:
+            if len(self.buf) >= 2:
+                n, mul, i = 0, 1, 1
+                while i < len(self.buf) and i < 5:
+                    n += (self.buf[i] & 0x7f) * mul
+                    mul <<= 7
+                    i += 1
+                    if not self.buf[i - 1] & 0x80:
+                        if len(self.buf) >= i + n:
+                            kind, body = self.buf[0], self.buf[i:i + n]
+                            self.buf = self.buf[i + n:]
+                            return kind, body
+                        break
+
+            left = end - time.time()
+            if left <= 0:
+                return None
+            self.sock.settimeout(left)
+            try:
+                data = self.sock.recv(4096)
+            except socket.timeout:
+                return None
+            if not data:
+                raise OSError("broker closed the connection")
+            self.buf += data
+
+    def message(self, kind, body):
+        """Incoming PUBLISH as (topic, payload), acked when QoS 1"""
+        tlen = struct.unpack(">H", body[:2])[0]
+        topic = body[2:2 + tlen].decode(errors="replace")
+        off = 2 + tlen
+        if (kind >> 1) & 3:
+            self.sock.sendall(packet(0x40, body[off:off + 2]))
+            off += 2
+        return topic, body[off:]
+
+
+def open_once(c, prefix, line, timeout):
+    """Return dict of ms from the publish: puback, result, start"""
+    got = {}
+    start = time.perf_counter()
+    pid = c.publish("%s/%s/open" % (prefix, line), json.dumps({"t": int(time.time() * 1000)}))
+
+    end = time.time() + timeout
+    while "start" not in got and time.time() < end:
+        p = c.read(end - time.time())
+        if p is None:
+            break
+        kind, body = p
+        ms = (time.perf_counter() - start) * 1000
+
+        if kind == 0x40 and struct.unpack(">H", body[:2])[0] == pid:
+            got["puback"] = ms
+        elif kind & 0xf0 == 0x30:
+            topic, payload = c.message(kind, body)
+            try:
+                ev = json.loads(payload)
+            except ValueError:
+                continue
+            if topic.endswith("/event/mqtt") and "result" not in got:
+                got["result"] = ms
+                if ev.get("result") != "ok":
+                    print("refused:", ev.get("result"))
+                    break
+            elif topic.endswith("/event/gate") and ev.get("state") == "start" and ev.get("src") == "mqtt":
+                got["start"] = ms
+
+    return got
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--broker", required=True)
+    ap.add_argument("--port", type=int, default=1883)
+    ap.add_argument("--user")
+    ap.add_argument("--password")
+    ap.add_argument("--prefix", default="gate/door-lock", help="gate/<mdns name>")
+    ap.add_argument("--line", default="p1", choices=("p1", "p2", "all"))
+    ap.add_argument("-n", type=int, default=1, help="commands sent")
+    ap.add_argument("--interval", type=float, default=5.0, help="second between commands, longer than an actuation")
+    ap.add_argument("--timeout", type=float, default=5.0)
+    ap.add_argument("--max-ms", type=float, default=100.0, help="p95 limit to the actuation start")
+    args = ap.parse_args()
+
+    c = Client(args.broker, args.port, "mqtt-door-%d" % (time.time() % 100000),
+               args.user, args.password, args.timeout)
+    c.subscribe(args.prefix + "/event/#")
+    # Let the SUBACK and retained messages arrive
+    while c.read(0.5) is not None:
+        pass
+
+    starts = []
+    fail = 0
+    print("%4s %10s %10s %10s" % ("#", "puback ms", "result ms", "start ms"))
+    for i in range(args.n):
+        got = open_once(c, args.prefix, args.line, args.timeout)
+        print("%4d %10s %10s %10s" % (i + 1, *("%.1f" % got[k] if k in got else "-" for k in ("puback", "result", "start"))))
+        if "start" in got:
+            starts.append(got["start"])
+        else:
+            fail += 1
+        if i + 1 < args.n:
+            time.sleep(args.interval)
+
+    if starts:
+        print("start p50 %.1f ms  p95 %.1f ms  max %.1f ms" % (percentile(starts, 50), percentile(starts, 95), max(starts)))
+
+    if fail or not starts or percentile(starts, 95) > args.max_ms:
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+"""
+Compressed OTA tool
+
+Compress a firmware image (or a delta patch from tools/ota_delta) for
+POST /ota; main/ota_inflate.c decompress it while it's written to flash,
+with a window of 2^window byte.
+
+    ota_compress.py compress   image.bin image.bin.hs [-w 10] [-l 5]
+    ota_compress.py decompress image.bin.hs out.bin     # host reference
+    ota_compress.py info       image.bin.hs
+
+Format, heatshrink bitstream (LZSS, MSB first) behind a 12 byte header:
+
+    header   "GHSZ" u8 version u8 window_sz2 u8 lookahead_sz2 u8 flags
+             u32 size, little endian, decompressed byte
+    literal  1, 8 bit byte
+    backref  0, window_sz2 bit (offset - 1), lookahead_sz2 bit (count - 1)
+    bits after the last of `size` byte are padding
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+MAGIC = b"GHSZ"
+VERSION = 1
+HDR = struct.Struct("<4sBBBBI")
+
+MAX_WINDOW_SZ2 = 12     # OTA_INFLATE_MAX_WINDOW_SZ2 in main/ota_inflate.h
+MAX_CHAIN = 48          # Candidates tried per position
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.bits = 0
+
+    def put(self, n, v):
+        self.acc = (self.acc << n) | v
+        self.bits += n
+        while self.bits >= 8:
+            self.bits -= 8
+            self.out.append((self.acc >> self.bits) & 0xff)
+        self.acc &= (1 << self.bits) - 1
+
+    def flush(self):
+        if self.bits:
+            self.out.append((self.acc << (8 - self.bits)) & 0xff)
+            self.acc = self.bits = 0
+        return self.out
+
+
+def compress(data, w, l):
+    window = 1 << w
+    max_len = 1 << l
+    # Shortest back-reference cheaper than the same byte as literals
+    min_len = (1 + w + l) // 9 + 1
+
+    bw = BitWriter()
+    chains = {}
+    n = len(data)
+    p = 0
+
+    def insert(i):
+        if i + min_len <= n:
+            chains.setdefault(data[i:i + min_len], []).append(i)
+
+    while p < n:
+        best_len = 0
+        best_pos = 0
+        cand = chains.get(data[p:p + min_len]) if p + min_len <= n else None
+        if cand:
+            limit = min(max_len, n - p)
+            tried = 0
+            for c in reversed(cand):
+                if p - c > window:
+                    break
+                # Cheap reject: must at least beat the best one
+                if best_len and (best_len >= limit or data[c + best_len] != data[p + best_len]):
+                    tried += 1
+                    if tried >= MAX_CHAIN:
+                        break
+                    continue
+                k = min_len
+                while k < limit and data[c + k] == data[p + k]:
+                    k += 1
+                if k > best_len:
+                    best_len, best_pos = k, c
+                    if k == limit:
+                        break
+                tried += 1
+                if tried >= MAX_CHAIN:
+                    break
+
+        if best_len >= min_len:
+            bw.put(1, 0)
+            bw.put(w, p - best_pos - 1)
+            bw.put(l, best_len - 1)
+            step = best_len
+        else:
+            bw.put(1, 1)
+            bw.put(8, data[p])
+            step = 1
+
+        for i in range(p, p + step):
+            insert(i)
+            # Keep chains short, old entries are out of window anyway
+            lst = chains.get(data[i:i + min_len])
+            if lst and len(lst) > 4 * MAX_CHAIN:
+                del lst[:2 * MAX_CHAIN]
+        p += step
+
+    return HDR.pack(MAGIC, VERSION, w, l, 0, n) + bytes(bw.flush())
+
+
+def decompress(blob):
+    magic, ver, w, l, flags, size = HDR.unpack_from(blob)
+    if magic != MAGIC or ver != VERSION:
+        raise ValueError("not a compressed OTA stream")
+
+    out = bytearray()
+    bitpos = HDR.size * 8
+
+    def get(n):
+        nonlocal bitpos
+        v = 0
+        for _ in range(n):
+            byte = blob[bitpos >> 3]
+            v = (v << 1) | ((byte >> (7 - (bitpos & 7))) & 1)
+            bitpos += 1
+        return v
+
+    while len(out) < size:
+        if get(1):
+            out.append(get(8))
+        else:
+            index = get(w) + 1
+            count = get(l) + 1
+            for _ in range(min(count, size - len(out))):
+                out.append(out[-index] if index <= len(out) else 0)
+
+    return bytes(out)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def cmd_compress(args):
+    if not 4 <= args.window <= MAX_WINDOW_SZ2 or not 3 <= args.lookahead < args.window:
+        sys.exit("window 4..%d, lookahead 3..window-1" % MAX_WINDOW_SZ2)
+
+    data = read(args.input)
+    t = time.time()
+    blob = compress(data, args.window, args.lookahead)
+    dt = time.time() - t
+
+    # Never ship a stream that does not decompress
+    if decompress(blob) != data:
+        sys.exit("internal error: stream does not rebuild the input")
+
+    with open(args.output, "wb") as f:
+        f.write(blob)
+
+    print("in:%d out:%d (%.1f%%) w%d l%d, device window %d byte, in %.1f s" %
+          (len(data), len(blob), 100.0 * len(blob) / max(len(data), 1),
+           args.window, args.lookahead, 1 << args.window, dt))
+
+
+def cmd_decompress(args):
+    out = decompress(read(args.input))
+    with open(args.output, "wb") as f:
+        f.write(out)
+    print("wrote %d byte" % len(out))
+
+
+def cmd_info(args):
+    blob = read(args.input)
+    magic, ver, w, l, flags, size = HDR.unpack_from(blob)
+    if magic != MAGIC:
+        sys.exit("not a compressed OTA stream")
+    print("version:%d w%d l%d flags:0x%x size:%d compressed:%d (%.1f%%)" %
+          (ver, w, l, flags, size, len(blob), 100.0 * len(blob) / max(size, 1)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Compressed OTA tool")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("compress", help="compress an image or a patch")
+    p.add_argument("input")
+    p.add_argument("output")
+    p.add_argument("-w", "--window", type=int, default=10, help="window size, log2 (default 10)")
+    p.add_argument("-l", "--lookahead", type=int, default=5, help="max match, log2 (default 5)")
+    p.set_defaults(fn=cmd_compress)
+
+    p = sub.add_parser("decompress", help="decompress on the host")
+    p.add_argument("input")
+    p.add_argument("output")
+    p.set_defaults(fn=cmd_decompress)
+
+    p = sub.add_parser("info", help="print stream header")
+    p.add_argument("input")
+    p.set_defaults(fn=cmd_info)
+
+    args = ap.parse_args()
+    args.fn(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,317 @@
+#!/usr/bin/env python3
+"""
+Delta OTA patch tool
+
+Build a patch that turns the firmware running on the device (old.bin) into
+a new one (new.bin); main/delta_patch.c apply it while streaming into the
+next OTA partition.
+
+    ota_delta.py diff  old.bin new.bin patch.bin
+    ota_delta.py apply old.bin patch.bin out.bin    # host reference, check a patch
+    ota_delta.py info  patch.bin
+
+Format, little endian, varint is unsigned LEB128, svarint zigzag:
+
+    header  "GDLT" u16 version u16 flags u32 source_size u32 target_size
+            source_sha256[32] target_sha256[32]
+    record  varint diff_len, varint extra_len, svarint seek
+            source cursor += seek
+            diff:  pairs (varint skip, varint lit, lit byte) until diff_len
+                   output byte: skip copy source, lit add byte to source
+            extra: extra_len byte copied as is
+    until target_size byte are produced
+
+As bsdiff the diff part absorb code that moved (address changes are sparse
+byte differences), but zero runs are skipped instead of compressed.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+import time
+
+MAGIC = b"GDLT"
+VERSION = 1
+HDR = struct.Struct("<4sHHII32s32s")
+
+MIN_MATCH = 16          # Exact match to anchor a new alignment
+INDEX_STEP = 4          # Source indexed every INDEX_STEP byte
+LIT_ZERO_GAP = 3        # Zero run shorter than this stay inside a literal
+
+
+def put_varint(out, v):
+    while True:
+        b = v & 0x7f
+        v >>= 7
+        if v:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return
+
+
+def put_svarint(out, v):
+    put_varint(out, (v << 1) ^ (v >> 63) if v < 0 else v << 1)
+
+
+def get_varint(data, pos):
+    v = shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, pos
+
+
+def get_svarint(data, pos):
+    v, pos = get_varint(data, pos)
+    return (v >> 1) ^ -(v & 1), pos
+
+
+def find_matches(old, new):
+    """Exact matches (new_pos, old_pos, len), left to right, not overlapping in new"""
+    index = {}
+    for i in range(0, len(old) - MIN_MATCH + 1, INDEX_STEP):
+        index.setdefault(old[i:i + MIN_MATCH], i)
+
+    matches = []
+    delta = None
+    p = 0
+    while p <= len(new) - MIN_MATCH:
+        key = new[p:p + MIN_MATCH]
+        cand = None
+
+        # Same alignment of the previous match first: code that did not move
+        if delta is not None:
+            o = p + delta
+            if 0 <= o <= len(old) - MIN_MATCH and old[o:o + MIN_MATCH] == key:
+                cand = o
+
+        if cand is None:
+            cand = index.get(key)
+        if cand is None:
+            p += 1
+            continue
+
+        # Extend backward over byte not yet covered, then forward
+        start_floor = matches[-1][0] + matches[-1][2] if matches else 0
+        while p > start_floor and cand > 0 and new[p - 1] == old[cand - 1]:
+            p -= 1
+            cand -= 1
+
+        ln = MIN_MATCH
+        while p + ln < len(new) and cand + ln < len(old) and new[p + ln] == old[cand + ln]:
+            ln += 1
+
+        matches.append((p, cand, ln))
+        delta = cand - p
+        p += ln
+
+    return matches
+
+
+def approx_extend(new, old, new_pos, old_pos, limit, step):
+    """bsdiff score: longest run where equal byte outnumber the different one"""
+    score = best = best_len = 0
+    for k in range(limit):
+        n = new_pos + step * k
+        o = old_pos + step * k
+        if o < 0 or o >= len(old):
+            break
+        score += 1 if new[n] == old[o] else -1
+        if score > best:
+            best = score
+            best_len = k + 1
+    return best_len
+
+
+def build_records(old, new, matches):
+    """Records (diff_new, diff_old, diff_len, extra_len), extra follow the diff in new"""
+    spans = []
+    for i, (np_, op, ln) in enumerate(matches):
+        next_np = matches[i + 1][0] if i + 1 < len(matches) else len(new)
+        fwd = approx_extend(new, old, np_ + ln, op + ln, next_np - np_ - ln, 1)
+        spans.append([np_, op, ln + fwd])
+
+    # Backward extension of each span into what the previous one left
+    prev_end = 0
+    for s in spans:
+        back = approx_extend(new, old, s[0] - 1, s[1] - 1, s[0] - prev_end, -1)
+        s[0] -= back
+        s[1] -= back
+        s[2] += back
+        prev_end = s[0] + s[2]
+
+    records = []
+    if not spans or spans[0][0] > 0:
+        records.append([0, 0, 0, spans[0][0] if spans else len(new)])
+    for i, (np_, op, ln) in enumerate(spans):
+        next_np = spans[i + 1][0] if i + 1 < len(spans) else len(new)
+        records.append([np_, op, ln, next_np - np_ - ln])
+
+    # Merge records continuing on the same alignment without extra
+    merged = []
+    for r in records:
+        if merged:
+            m = merged[-1]
+            if m[3] == 0 and m[1] + m[2] == r[1] and m[0] + m[2] == r[0]:
+                m[2] += r[2]
+                m[3] = r[3]
+                continue
+        merged.append(r)
+
+    return merged
+
+
+def encode_diff(out, new, old, np_, op, ln):
+    d = bytes((new[np_ + i] - old[op + i]) & 0xff for i in range(ln))
+    i = 0
+    while i < ln:
+        skip = i
+        while i < ln and d[i] == 0:
+            i += 1
+        skip = i - skip
+
+        lit = i
+        while i < ln:
+            if d[i] == 0:
+                z = i
+                while z < ln and d[z] == 0 and z - i < LIT_ZERO_GAP:
+                    z += 1
+                if z == ln or z - i >= LIT_ZERO_GAP:
+                    break
+                i = z
+            else:
+                i += 1
+
+        put_varint(out, skip)
+        put_varint(out, i - lit)
+        out += d[lit:i]
+
+
+def make_patch(old, new):
+    matches = find_matches(old, new)
+    records = build_records(old, new, matches)
+
+    out = bytearray(HDR.pack(MAGIC, VERSION, 0, len(old), len(new),
+                             hashlib.sha256(old).digest(), hashlib.sha256(new).digest()))
+    cursor = 0
+    for np_, op, ln, extra in records:
+        put_varint(out, ln)
+        put_varint(out, extra)
+        put_svarint(out, op - cursor)
+        cursor = op
+        encode_diff(out, new, old, np_, op, ln)
+        out += new[np_ + ln:np_ + ln + extra]
+        cursor += ln
+
+    return bytes(out), len(matches), len(records)
+
+
+def apply_patch(old, patch):
+    magic, ver, flags, src_sz, tgt_sz, src_sha, tgt_sha = HDR.unpack_from(patch)
+    if magic != MAGIC or ver != VERSION:
+        raise ValueError("not a delta patch")
+    if src_sz != len(old) or hashlib.sha256(old).digest() != src_sha:
+        raise ValueError("patch is for another source image")
+
+    out = bytearray()
+    pos = HDR.size
+    cursor = 0
+    while len(out) < tgt_sz:
+        ln, pos = get_varint(patch, pos)
+        extra, pos = get_varint(patch, pos)
+        seek, pos = get_svarint(patch, pos)
+        cursor += seek
+
+        done = 0
+        while done < ln:
+            skip, pos = get_varint(patch, pos)
+            lit, pos = get_varint(patch, pos)
+            out += old[cursor:cursor + skip]
+            cursor += skip
+            for b in patch[pos:pos + lit]:
+                out.append((old[cursor] + b) & 0xff)
+                cursor += 1
+            pos += lit
+            done += skip + lit
+
+        out += patch[pos:pos + extra]
+        pos += extra
+
+    if len(out) != tgt_sz or hashlib.sha256(out).digest() != tgt_sha:
+        raise ValueError("patched image does not match target digest")
+
+    return bytes(out)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def cmd_diff(args):
+    old, new = read(args.old), read(args.new)
+    t = time.time()
+    patch, n_match, n_rec = make_patch(old, new)
+    dt = time.time() - t
+
+    # Never ship a patch that does not apply
+    if apply_patch(old, patch) != new:
+        sys.exit("internal error: patch does not rebuild the image")
+
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+
+    print("old:%d new:%d patch:%d (%.1f%% of new, %.1fx smaller) matches:%d records:%d in %.1f s" %
+          (len(old), len(new), len(patch), 100.0 * len(patch) / max(len(new), 1),
+           len(new) / max(len(patch), 1), n_match, n_rec, dt))
+    print("target sha256:%s" % hashlib.sha256(new).hexdigest())
+
+
+def cmd_apply(args):
+    out = apply_patch(read(args.old), read(args.patch))
+    with open(args.out, "wb") as f:
+        f.write(out)
+    print("wrote %d byte, sha256:%s" % (len(out), hashlib.sha256(out).hexdigest()))
+
+
+def cmd_info(args):
+    patch = read(args.patch)
+    magic, ver, flags, src_sz, tgt_sz, src_sha, tgt_sha = HDR.unpack_from(patch)
+    if magic != MAGIC:
+        sys.exit("not a delta patch")
+    print("version:%d flags:0x%x patch:%d" % (ver, flags, len(patch)))
+    print("source:%d sha256:%s" % (src_sz, src_sha.hex()))
+    print("target:%d sha256:%s" % (tgt_sz, tgt_sha.hex()))
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Delta OTA patch tool")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("diff", help="build a patch from old to new image")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("patch")
+    p.set_defaults(fn=cmd_diff)
+
+    p = sub.add_parser("apply", help="apply a patch on the host")
+    p.add_argument("old")
+    p.add_argument("patch")
+    p.add_argument("out")
+    p.set_defaults(fn=cmd_apply)
+
+    p = sub.add_parser("info", help="print patch header")
+    p.add_argument("patch")
+    p.set_defaults(fn=cmd_info)
+
+    args = ap.parse_args()
+    args.fn(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+LAN update server for the pull OTA (main/ota_pull.c)
+
+Serve a directory over plain HTTP with Range support and write the
+manifest for an image:
+
+    ota_server.py build/Apri-cancello.bin --version 1.4 [--port 8000]
+    curl -X POST name.local/api/v1/config/ota -d '{"url":"http://<pc>:8000/manifest.json","check":true}'
+
+--drop-after N close every image response after N byte, the board must
+resume with a Range request; --no-range answer 200 with the whole file as
+a server without Range support (python3 -m http.server) would.
+"""
+
+import argparse
+import hashlib
+import http.server
+import json
+import os
+import re
+import shutil
+
+
+def write_manifest(image, version, directory):
+    with open(image, "rb") as f:
+        data = f.read()
+
+    manifest = {
+        "version": version,
+        "image": os.path.basename(image),
+        "size": len(data),
+        "sha256": hashlib.sha256(data).hexdigest(),
+    }
+
+    dst = os.path.join(directory, manifest["image"])
+    if os.path.abspath(dst) != os.path.abspath(image):
+        shutil.copyfile(image, dst)
+
+    with open(os.path.join(directory, "manifest.json"), "w") as f:
+        json.dump(manifest, f, indent=2)
+
+    return manifest
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    drop_after = 0
+    no_range = False
+
+    def log_message(self, fmt, *args):
+        print("%s %s" % (self.address_string(), fmt % args))
+
+    def do_GET(self):
+        path = self.translate_path(self.path)
+        rng = self.headers.get("Range")
+        if self.path.endswith(".json") or not os.path.isfile(path):
+            return super().do_GET()
+
+        size = os.path.getsize(path)
+        start = 0
+        m = re.match(r"bytes=(\d+)-$", rng or "")
+        if m and not self.no_range:
+            start = int(m.group(1))
+            if start >= size:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % size)
+                self.end_headers()
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, size - 1, size))
+        else:
+            self.send_response(200)
+            self.send_header("Accept-Ranges", "none" if self.no_range else "bytes")
+
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(size - start))
+        self.end_headers()
+
+        with open(path, "rb") as f:
+            f.seek(start)
+            left = size - start
+            if self.drop_after:
+                left = min(left, self.drop_after)
+            while left > 0:
+                chunk = f.read(min(left, 16384))
+                if not chunk:
+                    break
+                self.wfile.write(chunk)
+                left -= len(chunk)
+
+        if self.drop_after and start + self.drop_after < size:
+            print("dropped at %d of %d byte" % (start + self.drop_after, size))
+            self.close_connection = True
+
+
+def main():
+    ap = argparse.ArgumentParser(description="LAN update server for the pull OTA")
+    ap.add_argument("image", help="firmware .bin, copied into --dir with manifest.json")
+    ap.add_argument("--version", required=True, help="version string in the manifest")
+    ap.add_argument("--dir", default="ota_www", help="served directory (default ota_www)")
+    ap.add_argument("--port", type=int, default=8000)
+    ap.add_argument("--drop-after", type=int, default=0, help="close image responses after N byte")
+    ap.add_argument("--no-range", action="store_true", help="ignore Range, always send the whole file")
+    args = ap.parse_args()
+
+    os.makedirs(args.dir, exist_ok=True)
+    manifest = write_manifest(args.image, args.version, args.dir)
+    print("manifest: %s" % json.dumps(manifest))
+
+    Handler.drop_after = args.drop_after
+    Handler.no_range = args.no_range
+    handler = lambda *a, **kw: Handler(*a, directory=args.dir, **kw)
+
+    server = http.server.ThreadingHTTPServer(("", args.port), handler)
+    print("serving %s on port %d" % (args.dir, args.port))
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
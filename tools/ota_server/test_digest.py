@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Host check: the server and the board agree on the image digest
+
+The pull OTA compare the sha256 of the manifest with the digest of the
+running image (ota_running_image_sha256 in main/ota_update.c). With two
+definitions the board never see itself up to date and update forever.
+Feed it the .bin of `idf.py build`:
+
+    test_digest.py build/Apri-cancello.bin [--partition-size 0x100000]
+
+server  write_manifest() of ota_server.py, in a temporary directory
+board   the image as flashed in the app partition (0xff after it), length
+        from the header as esp_image_get_metadata() compute it, SHA-256
+        of that many byte
+
+It also show the digest appended by idf.py (the last 32 byte), what
+esp_partition_get_sha256() give: it does not cover itself, so it can't
+be the one of the manifest. Exit 1 on any mismatch.
+"""
+
+import argparse
+import hashlib
+import os
+import struct
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from ota_server import write_manifest  # noqa: E402
+
+IMAGE_MAGIC = 0xE9
+HDR_SZ = 24             # esp_image_header_t, extended part included
+SEG_HDR_SZ = 8          # esp_image_segment_header_t
+MAX_SEGMENTS = 16
+HASH_LEN = 32
+HASH_APPENDED = 23      # Offset of `hash_appended` in the header
+
+
+def image_len(flash):
+    """Image length on flash as esp_image_get_metadata(): header, segments, checksum, digest"""
+    if flash[0] != IMAGE_MAGIC or flash[1] > MAX_SEGMENTS:
+        raise ValueError("not an app image, magic 0x%02x segments %d" % (flash[0], flash[1]))
+
+    pos = HDR_SZ
+    for _ in range(flash[1]):
+        _, size = struct.unpack_from("<II", flash, pos)
+        pos += SEG_HDR_SZ + size
+
+    # Checksum byte, then padded to 16
+    length = (pos + 1 + 15) & ~15
+    if flash[HASH_APPENDED]:
+        length += HASH_LEN
+    return length
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("image", help=".bin of idf.py build")
+    ap.add_argument("--partition-size", type=lambda v: int(v, 0), default=0x100000,
+                    help="app partition size, partitions.csv (default 1M)")
+    args = ap.parse_args()
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+
+    with tempfile.TemporaryDirectory() as d:
+        manifest = write_manifest(args.image, "test", d)
+
+    if len(data) > args.partition_size:
+        print("image %d byte, larger than the partition" % len(data))
+        return 1
+    flash = data + b"\xff" * (args.partition_size - len(data))
+
+    length = image_len(flash)
+    board = hashlib.sha256(flash[:length]).hexdigest()
+    appended = data[-HASH_LEN:].hex() if flash[HASH_APPENDED] else None
+
+    print("file      %d byte" % len(data))
+    print("server    %d byte sha256 %s" % (manifest["size"], manifest["sha256"]))
+    print("board     %d byte sha256 %s" % (length, board))
+    if appended:
+        print("appended  %s (esp_partition_get_sha256, over %d byte)" % (appended, len(data) - HASH_LEN))
+
+    ok = True
+    if length != manifest["size"]:
+        print("FAIL: image length on flash differ from the file")
+        ok = False
+    if board != manifest["sha256"]:
+        print("FAIL: board digest differ from the manifest")
+        ok = False
+    if appended and appended != hashlib.sha256(data[:-HASH_LEN]).hexdigest():
+        print("FAIL: appended digest is not the one of the image, not an idf.py output?")
+        ok = False
+
+    print("ok" if ok else "digest mismatch: the board would update forever")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
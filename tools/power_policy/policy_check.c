@@ -0,0 +1,126 @@
+/*
+ * Power policy decision table
+ *
+ * Run power_policy_decide() on every combination of inputs, print the
+ * result and check the rules the firmware rely on. Exit code is the
+ * number of violated rules.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "power_policy.h"
+
+static const char *ps_name[] = { "none", "min", "max" };
+static int errors;
+
+#define CHECK(cond, in, what) do { \
+        if(!(cond)) { \
+            printf("  FAIL %s: profile:%s sta:%d ap:%d act:%d cmd:%u\n", what, \
+                   power_profile_name((in)->profile), (in)->sta_connected, (in)->ap_active, \
+                   (in)->actuating, (in)->ms_since_cmd); \
+            errors++; \
+        } \
+    } while(0)
+
+/* Worst case extra delay of a packet buffered by the AP, in DTIM */
+static unsigned rx_delay(const struct PowerPolicyOutput_st *out)
+{
+    switch(out->ps) {
+    case POWER_PS_NONE:     return 0;
+    case POWER_PS_MIN_MODEM: return 1;
+    default:                return out->listen_interval;
+    }
+}
+
+static void check(const struct PowerPolicyInput_st *in, const struct PowerPolicyOutput_st *out)
+{
+    struct PowerPolicyInput_st lat = *in;
+    struct PowerPolicyOutput_st out_lat;
+
+    CHECK(out->cpu_min_mhz <= out->cpu_max_mhz, in, "cpu min above max");
+    CHECK(out->cpu_min_mhz == 40 || out->cpu_min_mhz == 80 || out->cpu_min_mhz == 160, in, "cpu min not an XTAL/APB divider");
+    CHECK(out->cpu_max_mhz == 80 || out->cpu_max_mhz == 160 || out->cpu_max_mhz == 240, in, "cpu max not a PLL clock");
+    CHECK(out->listen_interval >= 1, in, "listen interval zero");
+
+    if(in->profile == POWER_PROFILE_LATENCY)
+        CHECK(!out->light_sleep && out->ps == POWER_PS_NONE, in, "latency profile sleep");
+
+    if(in->ap_active)
+        CHECK(!out->light_sleep && out->ps == POWER_PS_NONE, in, "recovery AP with power save");
+
+    if(in->actuating)
+        CHECK(!out->light_sleep, in, "light sleep during actuation");
+
+    if(in->ms_since_cmd < POWER_POLICY_BURST_MS)
+        CHECK(out->ps != POWER_PS_MAX_MODEM && out->cpu_min_mhz >= 80, in, "burst on max modem or low clock");
+
+    /* Every profile is at least as slow as the one before it */
+    if(in->profile > POWER_PROFILE_LATENCY) {
+        lat.profile = in->profile - 1;
+        power_policy_decide(&lat, &out_lat);
+        CHECK(rx_delay(out) >= rx_delay(&out_lat), in, "rx delay lower than previous profile");
+        CHECK(out->cpu_min_mhz <= out_lat.cpu_min_mhz, in, "cpu min higher than previous profile");
+    }
+}
+
+int main(void)
+{
+    static const uint32_t since_cmd[] = { 0, POWER_POLICY_BURST_MS - 1, POWER_POLICY_BURST_MS, UINT32_MAX };
+    struct PowerPolicyInput_st in;
+    struct PowerPolicyOutput_st out;
+    enum PowerProfile profile;
+    unsigned flags, c;
+    int i;
+
+    printf("%-10s %3s %3s %3s %10s | %7s %5s %3s %6s %5s\n",
+           "profile", "sta", "ap", "act", "cmd-ms", "cpu", "sleep", "ps", "listen", "burst");
+
+    for(profile = 0; profile < POWER_PROFILE_CNT; profile++) {
+        for(flags = 0; flags < 8; flags++) {
+            for(c = 0; c < sizeof(since_cmd)/sizeof(since_cmd[0]); c++) {
+                memset(&in, 0, sizeof(in));
+                in.profile = profile;
+                in.sta_connected = flags & 1;
+                in.ap_active = flags & 2;
+                in.actuating = flags & 4;
+                in.ms_since_cmd = since_cmd[c];
+
+                power_policy_decide(&in, &out);
+
+                printf("%-10s %3d %3d %3d %10u | %3u-%3u %5d %3s %6u %5d\n",
+                       power_profile_name(profile), in.sta_connected, in.ap_active, in.actuating,
+                       in.ms_since_cmd, out.cpu_min_mhz, out.cpu_max_mhz, out.light_sleep,
+                       ps_name[out.ps], out.listen_interval, out.burst);
+
+                check(&in, &out);
+            }
+        }
+    }
+
+    /* Out of range profile from an old or corrupted configuration */
+    memset(&in, 0, sizeof(in));
+    in.profile = POWER_PROFILE_CNT;
+    in.ms_since_cmd = UINT32_MAX;
+    power_policy_decide(&in, &out);
+    in.profile = POWER_PROFILE_BALANCED;
+    check(&in, &out);
+
+    for(i = 0; i < POWER_PROFILE_CNT; i++) {
+        enum PowerProfile p;
+
+        if(!power_profile_from_name(power_profile_name(i), &p) || p != i) {
+            printf("  FAIL name round trip:%s\n", power_profile_name(i));
+            errors++;
+        }
+    }
+
+    if(power_profile_from_name("turbo", &profile)) {
+        printf("  FAIL unknown name accepted\n");
+        errors++;
+    }
+
+    printf("%s: %d error\n", errors ? "FAIL" : "OK", errors);
+
+    return errors;
+}
@@ -0,0 +1,9 @@
+#ifndef _SIM_ESP_SLEEP_H_
+#define _SIM_ESP_SLEEP_H_
+
+#include "sim_port.h"
+
+/* No light sleep on host, wake up source are accepted and ignored */
+static inline esp_err_t esp_sleep_enable_gpio_wakeup(void) { return ESP_OK; }
+
+#endif
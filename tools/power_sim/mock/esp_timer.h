@@ -0,0 +1,12 @@
+#ifndef _SIM_ESP_TIMER_H_
+#define _SIM_ESP_TIMER_H_
+
+#include "sim_port.h"
+
+/* Time since reset, from the virtual clock */
+static inline int64_t esp_timer_get_time(void)
+{
+    return (int64_t)sim_now_us();
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _SIM_ESP_WIFI_H_
+#define _SIM_ESP_WIFI_H_
+
+/* Only what config.h needs to be parsed on host */
+#include "sim_port.h"
+
+typedef struct {
+    uint8_t ssid[33];
+    int8_t rssi;
+} wifi_ap_record_t;
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Power driver simulator
+ *
+ * Run main/power_driver.c against the virtual clock of sim_port.c and
+ * measure what a scope on GPIO 26/27 would show:
+ *  - pulse : accuracy of up/down time against the configured values
+ *  - storm : queue backlog when requests arrive faster than they are served
+ *  - bounce: behaviour of the button ISR with a bouncing contact
+ *  - config: PowerLine_ConfigSetParams() applied at runtime
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "sim_port.h"
+#include "config.h"
+
+/* Mirror of power_driver.c */
+#define GPIO_POWER_P1   26
+#define GPIO_POWER_P2   27
+#define GPIO_INPUT_SW2  0
+#define TIME_DEFAULT    175
+#define CYCLE_DEFAULT   5
+
+#define MAX_REQ 256
+
+struct scenario {
+    const char *name;
+    void (*setup)(void);
+    uint32_t up_ms, down_ms, cycle;
+};
+
+static uint64_t req_t[MAX_REQ];
+static unsigned req_cnt;
+static const char *trace_prefix;
+
+static void stim_open_p1(void *arg) { drive_door_open(POWER_LINE_1, POWER_SRC_TELEGRAM); }
+static void stim_open_p2(void *arg) { drive_door_open(POWER_LINE_2, POWER_SRC_TELEGRAM); }
+static void stim_sw2_low(void *arg) { sim_gpio_set_input(GPIO_INPUT_SW2, 0); }
+static void stim_sw2_high(void *arg) { sim_gpio_set_input(GPIO_INPUT_SW2, 1); }
+
+static void stim_config(void *arg)
+{
+    char *err_txt = NULL;
+    esp_err_t err;
+
+    err = PowerLine_ConfigSetParams("p1", 100, 50, 3, &err_txt);
+    if(err != ESP_OK)
+        printf("  config error:%d %s\n", err, err_txt ? err_txt : "");
+    free(err_txt);
+}
+
+static void request_at(uint64_t t_us, sim_stimulus_fn fn)
+{
+    if(req_cnt < MAX_REQ)
+        req_t[req_cnt++] = t_us;
+    sim_schedule(t_us, fn, NULL);
+}
+
+/* Single request, start out of tick phase */
+static void setup_pulse(void)
+{
+    request_at(3300, stim_open_p1);
+}
+
+/* Telegram `/apri` spam: each command enqueue both lines */
+static void setup_storm(void)
+{
+    int i;
+
+    for(i = 0; i < 12; i++) {
+        request_at(1000 + i * 8000, stim_open_p1);
+        request_at(1000 + i * 8000, stim_open_p2);
+    }
+}
+
+/* One press on SW2 held 250 ms, contact bounce for ~3 ms on press and release */
+static void setup_bounce(void)
+{
+    static const uint32_t press_us[] = { 0, 300, 800, 1500, 3000 };
+    static const uint32_t release_us[] = { 250000, 250400, 252000 };
+    int i;
+
+    for(i = 0; i < sizeof(press_us)/sizeof(press_us[0]); i++)
+        sim_schedule(5000 + press_us[i], (i & 1) ? stim_sw2_high : stim_sw2_low, NULL);
+
+    for(i = 0; i < sizeof(release_us)/sizeof(release_us[0]); i++)
+        sim_schedule(5000 + release_us[i], (i & 1) ? stim_sw2_low : stim_sw2_high, NULL);
+}
+
+static void setup_config(void)
+{
+    sim_schedule(1000, stim_config, NULL);
+    request_at(2000, stim_open_p1);
+}
+
+static const struct scenario scenarios[] = {
+    { "pulse",  setup_pulse,  TIME_DEFAULT, TIME_DEFAULT, CYCLE_DEFAULT },
+    { "storm",  setup_storm,  TIME_DEFAULT, TIME_DEFAULT, CYCLE_DEFAULT },
+    { "bounce", setup_bounce, TIME_DEFAULT, TIME_DEFAULT, CYCLE_DEFAULT },
+    { "config", setup_config, 50, 100, 3 },
+};
+
+struct width_stat {
+    unsigned n;
+    int64_t min, max, sum;
+};
+
+static void width_add(struct width_stat *s, int64_t v)
+{
+    if(s->n == 0 || v < s->min)
+        s->min = v;
+    if(s->n == 0 || v > s->max)
+        s->max = v;
+    s->sum += v;
+    s->n++;
+}
+
+static void width_print(const char *what, const struct width_stat *s, uint32_t expected_ms)
+{
+    if(s->n == 0)
+        return;
+
+    printf("  %-5s n:%-3u expected:%6.1f ms  min:%7.2f  max:%7.2f  avg:%7.2f  err-max:%+6.2f ms\n",
+           what, s->n, (double)expected_ms,
+           s->min / 1000.0, s->max / 1000.0, s->sum / 1000.0 / s->n,
+           ((llabs(s->min - expected_ms * 1000LL) > llabs(s->max - expected_ms * 1000LL)) ?
+                s->min - expected_ms * 1000LL : s->max - expected_ms * 1000LL) / 1000.0);
+}
+
+static void write_trace(const char *name)
+{
+    const struct sim_edge *e;
+    char path[256];
+    size_t n, i;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s-%s.csv", trace_prefix, name);
+    f = fopen(path, "w");
+    if(f == NULL) {
+        perror(path);
+        return;
+    }
+
+    n = sim_edges(&e);
+    fprintf(f, "t_us,gpio,level\n");
+    for(i = 0; i < n; i++)
+        fprintf(f, "%llu,%u,%d\n", (unsigned long long)e[i].t_us, e[i].pin, e[i].level);
+
+    fclose(f);
+}
+
+static void report(const struct scenario *sc)
+{
+    struct width_stat high = {0}, low = {0};
+    struct sim_queue_stats qs;
+    const struct sim_edge *e;
+    uint64_t last_fall[2] = {0, 0};
+    uint64_t rise_t[MAX_REQ];
+    unsigned rises = 0, act = 0;
+    size_t n, i;
+
+    n = sim_edges(&e);
+    for(i = 0; i < n; i++) {
+        int line = (e[i].pin == GPIO_POWER_P1) ? 0 : 1;
+        size_t j;
+
+        if(e[i].level == 1) {
+            /* Low time only inside the same actuation burst */
+            if(last_fall[line] && rises % sc->cycle)
+                width_add(&low, e[i].t_us - last_fall[line]);
+
+            if(rises % sc->cycle == 0 && act < MAX_REQ)
+                rise_t[act++] = e[i].t_us;
+            rises++;
+
+            for(j = i + 1; j < n; j++) {
+                if(e[j].pin == e[i].pin && e[j].level == 0) {
+                    width_add(&high, e[j].t_us - e[i].t_us);
+                    break;
+                }
+            }
+        } else {
+            last_fall[line] = e[i].t_us;
+        }
+    }
+
+    sim_queue_get_stats(&qs);
+
+    printf("scenario:%s\n", sc->name);
+    printf("  edges:%zu pulses:%u actuations:%u requests:%u end:%.1f ms\n",
+           n, rises, act, req_cnt, sim_now_us() / 1000.0);
+    width_print("high", &high, sc->up_ms);
+    width_print("low", &low, sc->down_ms);
+    printf("  queue sent:%u recv:%u high-water:%u isr-dropped:%u blocked-senders:%u\n",
+           qs.sent, qs.received, qs.high_water, qs.isr_dropped, qs.blocked);
+
+    if(req_cnt && act) {
+        uint64_t worst = 0, sum = 0;
+        unsigned k, m = (act < req_cnt) ? act : req_cnt;
+
+        for(k = 0; k < m; k++) {
+            uint64_t lat = rise_t[k] - req_t[k];
+            sum += lat;
+            if(lat > worst)
+                worst = lat;
+        }
+        printf("  request->first edge avg:%.1f ms worst:%.1f ms\n", sum / 1000.0 / m, worst / 1000.0);
+    }
+
+    /* Same latency as measured by the driver itself */
+    for(i = 0; i < POWER_SRC_CNT; i++) {
+        struct PowerSourceStats_st st;
+
+        power_driver_get_stats(i, &st);
+        if(st.cnt)
+            printf("  driver %-8s n:%-3lu avg:%.1f ms max:%.1f ms\n", power_source_name(i),
+                   (unsigned long)st.cnt, st.lat_sum_us / 1000.0 / st.cnt, st.lat_max_us / 1000.0);
+    }
+
+    if(trace_prefix)
+        write_trace(sc->name);
+}
+
+static void run_scenario(const struct scenario *sc)
+{
+    sim_reset();
+    req_cnt = 0;
+
+    power_driver_init();
+    sc->setup();
+    sim_run();
+
+    report(sc);
+}
+
+static void usage(const char *prg)
+{
+    printf("Usage: %s [-v] [-t trace-prefix] [scenario...]\n", prg);
+    printf("  -v   log power driver output with virtual timestamp\n");
+    printf("  -t   write every level change to <prefix>-<scenario>.csv\n");
+    printf("Scenarios: pulse storm bounce config (default all)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, j;
+
+    while((opt = getopt(argc, argv, "vt:h")) != -1) {
+        switch (opt) {
+        case 'v':
+            sim_set_verbose(true);
+            break;
+        case 't':
+            trace_prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    printf("tick:%d Hz\n", SIM_TICK_HZ);
+
+    if(optind == argc) {
+        for(i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); i++)
+            run_scenario(&scenarios[i]);
+        return 0;
+    }
+
+    for(j = optind; j < argc; j++) {
+        for(i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); i++) {
+            if(strcmp(scenarios[i].name, argv[j]) == 0)
+                break;
+        }
+
+        if(i == sizeof(scenarios)/sizeof(scenarios[0])) {
+            fprintf(stderr, "Unknown scenario `%s`\n", argv[j]);
+            return 1;
+        }
+        run_scenario(&scenarios[i]);
+    }
+
+    return 0;
+}
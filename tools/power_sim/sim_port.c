@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <setjmp.h>
+
+#include "sim_port.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "driver/gpio.h"
+#include "config.h"
+#include "boot_profile.h"
+#include "power_policy.h"
+#include "event_bus.h"
+#include "gate_mdns.h"
+
+#define TICK_US         (1000000ULL / SIM_TICK_HZ)
+#define MAX_STIMULI     1024
+#define MAX_EDGES       8192
+#define MAX_GPIO        40
+#define MAX_PENDING     64
+
+struct stimulus {
+    uint64_t t_us;
+    unsigned seq;
+    sim_stimulus_fn fn;
+    void *arg;
+};
+
+struct sim_queue {
+    uint8_t *buff;
+    unsigned len, item_sz;
+    unsigned head, count;
+
+    /* Senders that would be blocked by the real kernel, waiting for a free slot */
+    uint8_t *pending;
+    unsigned pending_cnt;
+};
+
+static uint64_t now_us;
+static bool verbose;
+
+static struct stimulus stimuli[MAX_STIMULI];
+static unsigned stimuli_cnt, stimuli_seq;
+
+static struct sim_edge edges[MAX_EDGES];
+static size_t edges_cnt;
+
+static int gpio_level[MAX_GPIO];
+static gpio_isr_t gpio_isr[MAX_GPIO];
+static void *gpio_isr_arg[MAX_GPIO];
+static gpio_int_type_t gpio_intr_type[MAX_GPIO];
+static bool gpio_intr_masked[MAX_GPIO];
+
+static struct AppConfig_t app_config;
+
+static struct sim_queue_stats q_stats;
+
+static TaskFunction_t task_fn;
+static void *task_arg;
+static jmp_buf task_exit;
+
+uint64_t sim_now_us(void)
+{
+    return now_us;
+}
+
+void sim_set_verbose(bool v)
+{
+    verbose = v;
+}
+
+void sim_log(char level, const char *tag, const char *fmt, ...)
+{
+    va_list ap;
+
+    if(!verbose)
+        return;
+
+    printf("[%10.3f ms] %c (%s) ", now_us / 1000.0, level, tag);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+/* Reset the whole virtual world, configuration is kept across scenarios */
+void sim_reset(void)
+{
+    now_us = 0;
+    stimuli_cnt = 0;
+    edges_cnt = 0;
+    task_fn = NULL;
+    memset(gpio_level, 0, sizeof(gpio_level));
+    memset(gpio_isr, 0, sizeof(gpio_isr));
+    memset(gpio_intr_type, 0, sizeof(gpio_intr_type));
+    memset(gpio_intr_masked, 0, sizeof(gpio_intr_masked));
+    memset(&q_stats, 0, sizeof(q_stats));
+}
+
+void sim_schedule(uint64_t t_us, sim_stimulus_fn fn, void *arg)
+{
+    if(stimuli_cnt == MAX_STIMULI) {
+        fprintf(stderr, "sim: too many stimuli\n");
+        exit(1);
+    }
+
+    stimuli[stimuli_cnt].t_us = t_us;
+    stimuli[stimuli_cnt].seq = stimuli_seq++;
+    stimuli[stimuli_cnt].fn = fn;
+    stimuli[stimuli_cnt].arg = arg;
+    stimuli_cnt++;
+}
+
+static int next_stimulus(void)
+{
+    int i, best = -1;
+
+    for(i = 0; i < stimuli_cnt; i++) {
+        if(best < 0 ||
+           stimuli[i].t_us < stimuli[best].t_us ||
+           (stimuli[i].t_us == stimuli[best].t_us && stimuli[i].seq < stimuli[best].seq))
+            best = i;
+    }
+
+    return best;
+}
+
+static void run_stimulus(int idx)
+{
+    struct stimulus s = stimuli[idx];
+
+    stimuli[idx] = stimuli[--stimuli_cnt];
+    if(s.t_us > now_us)
+        now_us = s.t_us;
+    s.fn(s.arg);
+}
+
+/* Fire every stimulus due before `t_us`, then move the clock to `t_us` */
+static void advance_to(uint64_t t_us)
+{
+    int idx;
+
+    while((idx = next_stimulus()) >= 0 && stimuli[idx].t_us < t_us)
+        run_stimulus(idx);
+
+    if(t_us > now_us)
+        now_us = t_us;
+}
+
+void sim_run(void)
+{
+    if(task_fn == NULL)
+        return;
+
+    if(setjmp(task_exit) == 0)
+        task_fn(task_arg);
+}
+
+/** FreeRTOS task **/
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle)
+{
+    if(task_fn != NULL)
+        fprintf(stderr, "sim: only one task is simulated, `%s` replace previous\n", name);
+
+    task_fn = fn;
+    task_arg = arg;
+    if(handle)
+        *handle = (TaskHandle_t)fn;
+
+    return pdPASS;
+}
+
+/* Host stack is not the target one, nothing to report */
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return ~(UBaseType_t)0;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(now_us / TICK_US);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    /* Kernel wake up on tick boundary: real delay is in (ticks-1, ticks] periods */
+    advance_to((now_us / TICK_US + ticks) * TICK_US);
+}
+
+void vTaskDelayUntil(TickType_t *prev, TickType_t ticks)
+{
+    *prev += ticks;
+    if((uint64_t)*prev * TICK_US > now_us)
+        advance_to((uint64_t)*prev * TICK_US);
+}
+
+/** FreeRTOS queue **/
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_sz)
+{
+    struct sim_queue *q = calloc(1, sizeof(*q));
+
+    q->len = len;
+    q->item_sz = item_sz;
+    q->buff = malloc(len * item_sz);
+    q->pending = malloc(MAX_PENDING * item_sz);
+
+    return q;
+}
+
+static void queue_push(QueueHandle_t q, const void *item)
+{
+    memcpy(&q->buff[((q->head + q->count) % q->len) * q->item_sz], item, q->item_sz);
+    q->count++;
+    q_stats.sent++;
+
+    if(q->count > q_stats.high_water)
+        q_stats.high_water = q->count;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait)
+{
+    if(q->count < q->len) {
+        queue_push(q, item);
+        return pdTRUE;
+    }
+
+    if(wait == 0 || q->pending_cnt == MAX_PENDING)
+        return pdFALSE;
+
+    /* Caller would sleep until power-task frees a slot */
+    memcpy(&q->pending[q->pending_cnt * q->item_sz], item, q->item_sz);
+    q->pending_cnt++;
+    q_stats.blocked++;
+
+    return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken)
+{
+    if(q->count == q->len) {
+        q_stats.isr_dropped++;
+        return pdFALSE;
+    }
+
+    queue_push(q, item);
+    if(woken)
+        *woken = pdTRUE;
+
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+    uint64_t deadline = (wait == portMAX_DELAY) ? UINT64_MAX : now_us + (uint64_t)wait * TICK_US;
+
+    while(q->count == 0) {
+        int idx = next_stimulus();
+
+        if(idx < 0) {
+            /* Nothing will ever wake up this task again: end of scenario */
+            if(wait == portMAX_DELAY)
+                longjmp(task_exit, 1);
+
+            advance_to(deadline);
+            return pdFALSE;
+        }
+
+        if(stimuli[idx].t_us > deadline) {
+            advance_to(deadline);
+            return pdFALSE;
+        }
+
+        run_stimulus(idx);
+    }
+
+    memcpy(item, &q->buff[q->head * q->item_sz], q->item_sz);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    q_stats.received++;
+
+    if(q->pending_cnt) {
+        queue_push(q, q->pending);
+        q->pending_cnt--;
+        memmove(q->pending, &q->pending[q->item_sz], q->pending_cnt * q->item_sz);
+    }
+
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    return q->count;
+}
+
+void sim_queue_get_stats(struct sim_queue_stats *stats)
+{
+    *stats = q_stats;
+}
+
+/** GPIO driver **/
+
+esp_err_t gpio_config(const gpio_config_t *conf)
+{
+    int pin;
+
+    for(pin = 0; pin < MAX_GPIO; pin++) {
+        if(!(conf->pin_bit_mask & (1ULL << pin)))
+            continue;
+
+        gpio_intr_type[pin] = conf->intr_type;
+        /* Input left floating read as pulled */
+        if(conf->mode == GPIO_MODE_INPUT)
+            gpio_level[pin] = !!conf->pull_up_en;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level)
+{
+    if(gpio < 0 || gpio >= MAX_GPIO)
+        return ESP_ERR_INVALID_ARG;
+
+    level = !!level;
+    if(gpio_level[gpio] != level) {
+        gpio_level[gpio] = level;
+
+        if(edges_cnt < MAX_EDGES) {
+            edges[edges_cnt].t_us = now_us;
+            edges[edges_cnt].pin = gpio;
+            edges[edges_cnt].level = level;
+            edges_cnt++;
+        }
+    }
+
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio)
+{
+    return gpio_level[gpio];
+}
+
+esp_err_t gpio_install_isr_service(int flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio, gpio_isr_t fn, void *arg)
+{
+    gpio_isr[gpio] = fn;
+    gpio_isr_arg[gpio] = arg;
+
+    return ESP_OK;
+}
+
+/* Run the ISR if `pin` going from `old` to its current level trigger an interrupt */
+static void gpio_check_isr(uint32_t pin, int old)
+{
+    int level = gpio_level[pin];
+    bool fire;
+
+    if(gpio_isr[pin] == NULL || gpio_intr_masked[pin])
+        return;
+
+    switch(gpio_intr_type[pin]) {
+    case GPIO_INTR_POSEDGE:     fire = !old && level; break;
+    case GPIO_INTR_NEGEDGE:     fire = old && !level; break;
+    case GPIO_INTR_ANYEDGE:     fire = old != level; break;
+    case GPIO_INTR_LOW_LEVEL:   fire = !level; break;
+    case GPIO_INTR_HIGH_LEVEL:  fire = level; break;
+    default:                    fire = false; break;
+    }
+
+    if(fire)
+        gpio_isr[pin](gpio_isr_arg[pin]);
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio)
+{
+    gpio_intr_masked[gpio] = false;
+    /* Level interrupt still active raise again at once */
+    gpio_check_isr(gpio, gpio_level[gpio]);
+
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t gpio)
+{
+    gpio_intr_masked[gpio] = true;
+
+    return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio, gpio_int_type_t intr_type)
+{
+    /* As the IDF driver: wake up need a level interrupt, it replace the configured one */
+    gpio_intr_type[gpio] = intr_type;
+
+    return ESP_OK;
+}
+
+void sim_gpio_set_input(uint32_t pin, int level)
+{
+    int old = gpio_level[pin];
+
+    gpio_level[pin] = !!level;
+    gpio_check_isr(pin, old);
+}
+
+size_t sim_edges(const struct sim_edge **out)
+{
+    *out = edges;
+    return edges_cnt;
+}
+
+/** Configuration cache, RAM only. Content is kept across scenarios **/
+
+const struct AppConfig_t* app_config_get(void)
+{
+    return &app_config;
+}
+
+void app_config_set_power_line(enum PowerLine pl, const struct PowerLineConfig_t *cfg)
+{
+    app_config.power_line[pl] = *cfg;
+    app_config.valid |= APP_CFG_PL_DOWN(pl) | APP_CFG_PL_UP(pl) | APP_CFG_PL_CYCLE(pl);
+}
+
+esp_err_t app_config_commit(void)
+{
+    return ESP_OK;
+}
+
+/** Boot profile, nothing to record on host **/
+
+void boot_profile_mark(enum BootPhase phase)
+{
+}
+
+/** Power policy, CPU clock and sleep do not exist on host **/
+
+void power_policy_command(void)
+{
+}
+
+void power_policy_set_actuating(bool actuating)
+{
+}
+
+/** mDNS, no network on host **/
+
+void gate_mdns_set_state(enum GateMdnsState flag, bool on)
+{
+}
+
+/** Event stream, shown in the verbose log **/
+
+void event_bus_publish(const char *event, const char *fmt, ...)
+{
+    char data[EVENT_BUS_EVENT_SZ] = "";
+    va_list ap;
+
+    if(fmt) {
+        va_start(ap, fmt);
+        vsnprintf(data, sizeof(data), fmt, ap);
+        va_end(ap);
+    }
+
+    sim_log('I', "events", "%s {%s}", event, data);
+}
@@ -0,0 +1,69 @@
+#ifndef _SIM_PORT_H_
+#define _SIM_PORT_H_
+
+/*
+ * Host-side port layer used to build main/power_driver.c on Linux.
+ *
+ * FreeRTOS tasks, queues, ticks and the GPIO driver are replaced by a
+ * single threaded cooperative model driven by a virtual clock (us). The
+ * only "real" task is the one registered through xTaskCreate (power-task),
+ * everything else (button ISR, Telegram requests, config writes) is injected
+ * as a timed stimulus with sim_schedule().
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef SIM_TICK_HZ
+/* Same value of CONFIG_FREERTOS_HZ inside sdkconfig */
+#define SIM_TICK_HZ 100
+#endif
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_TIMEOUT         0x107
+
+#define IRAM_ATTR
+#define __NOINIT_ATTR
+
+#define ESP_ERROR_CHECK(x)               do { esp_err_t __e = (x); (void)__e; } while(0)
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x) ({ esp_err_t __e = (x); __e; })
+
+typedef void (*sim_stimulus_fn)(void *arg);
+
+struct sim_edge {
+    uint64_t t_us;
+    uint32_t pin;
+    int level;
+};
+
+struct sim_queue_stats {
+    unsigned sent;
+    unsigned received;
+    unsigned high_water;
+    unsigned isr_dropped;   /* xQueueSendFromISR() on full queue */
+    unsigned blocked;       /* task send that would have blocked */
+};
+
+uint64_t sim_now_us(void);
+void sim_reset(void);
+void sim_schedule(uint64_t t_us, sim_stimulus_fn fn, void *arg);
+void sim_run(void);
+void sim_set_verbose(bool verbose);
+
+/* Drive an input pin from outside, the ISR run if the interrupt type match */
+void sim_gpio_set_input(uint32_t pin, int level);
+
+size_t sim_edges(const struct sim_edge **out);
+void sim_queue_get_stats(struct sim_queue_stats *stats);
+
+void sim_log(char level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#endif